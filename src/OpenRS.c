@@ -37,40 +37,38 @@
 #include <linux/serial.h>
 #endif
 
-#define DEFAULT_BITRATE 19200;
+#include "OpenRS.h"
+#include "trace.h"
+#include "dlog.h"
+#include "vfs.h"
+#include "fastread.h"
+#include "transport.h"
+#include "fleet.h"
+#include "digest.h"
+#include "progress.h"
+#include "sync.h"
+#include "preenc.h"
+#include "timer.h"
+#include "rt.h"
+#include "textmode.h"
+#include "script.h"
+#include "daemon.h"
+#include "capture.h"
+#include "cache.h"
+#include "nameidx.h"
+#include "mux.h"
+#include "wire.h"
+#include "dissect.h"
+#include "store.h"
 
-enum {CMD_FOPEN, CMD_FREAD, CMD_FWRITE, CMD_FCLOSE,
-	CMD_FGETC, CMD_FPUTC, CMD_FGETS, CMD_FPUTS,
-	CMD_FINDFIRST, CMD_FINDNEXT,
-	CMD_REMOVE, CMD_RENAME,
-	CMD_FTELL, CMD_FSEEK,
-	CMD_UNGETC
-};
+#define DEFAULT_BITRATE 19200;
+#define DIR_TIMEOUT		60		// s until an unfinished directory listing is closed
+#define TX_HOLD			1000	// ms after a file request the console input waits for the next one
 
 enum { STATE_IDLE, STATE_GETCMD, STATE_PROCESS};
 enum { GET_IDLE, GET_STRING1, GET_STRING2, GET_DW, GET_W, GET_FD };
 
 
-typedef struct ff_fdate{
-	unsigned 		day:5;
-	unsigned		month:4;
-	unsigned 		year:7;	// Jahre seit 1980
-}t_ffdate;
-
-typedef struct ff_ftime{
-	unsigned		sek_2:5;	// Zählung in Schritten von 2 Sekunden
-	unsigned		min:6;
-	unsigned		hour:5;
-}t_fftime;
-
-struct FileInfo{
-	uint16_t	attr;
-	t_fftime	LastWriteTime;
-	t_ffdate	LastWriteDate;
-	uint32_t	filesize;
-	char		filename[14]; 	// sprintf(&FileInfo.filename,"%-1.13s", Dateiname))
-};
-
 struct termios org_termios;
 struct termios wrk_termios;
 struct termios org_termios_console;
@@ -79,50 +77,69 @@ struct termios wrk_termios_console;
 int iDescriptor=-1;
 int iConsoleSettingsModified = 0;
 
-#define MAXFPTR 256
-FILE * File[MAXFPTR];	// since TNC3OS does not support 64 Bit pointers, but
+FILE * File[MAXFPTR+1];	// since TNC3OS does not support 64 Bit pointers, but
 					// wants to handle "File *" by itself, we do a mapping
 					// using a table. Instead of File * we return a table
 					// index
+struct fileHandle Handle[MAXFPTR+1];
+struct protoStats protoStats;
 int fptr;
+uint32_t portTxBytes = 0;	// bytes written to the serial port
+uint32_t portRxBytes = 0;	// bytes received from the serial port
+time_t portLastRx = 0;		// last time data was received from the TNC
 char * cwd = NULL;
-char * wd = NULL;
+void (*consoleTap)(int c) = NULL;
+int requestTimeout = 10;	// s without data until a request is abandoned, 0: never
+int handleTimeout = 0;		// s until an unused handle is closed, 0: never
 
 
 void protocolHandler(char c);
-int openSerial(char * port, int speed);
+static void protocolFlush(void);
 
 void restoreState(void)
 {
 	int i;
 
     fprintf(stdout,"\n\rExiting...\n\r");
-    if(iDescriptor != -1)
-    {
-    	tcsetattr(iDescriptor, TCSADRAIN, &org_termios);
-    	close(iDescriptor);
-    	iDescriptor = -1;
-    }
+    portClose();
 
     if(iConsoleSettingsModified)
     	tcsetattr(0, TCSANOW, &org_termios_console);
 
+    traceClose();
+
+    if(protoStats.resyncs || protoStats.unknown || protoStats.badHandles ||
+    		protoStats.timeouts || protoStats.reclaimed || protoStats.dirClosed ||
+    		protoStats.held || protoStats.discarded || protoStats.reconnects)
+    {
+    	protoStatsPrint(stdout);
+    }
+    rtStatsPrint(stdout);
+    cacheStatsPrint(stdout);
+    storeStatsPrint(stdout);
+    captureClose();
+
+    if(dlogLevel != DLOG_OFF)
+    {
+    	dlogDump(stderr);
+    }
+    dlogFree();
+
 	for(i=1;i<=MAXFPTR;i++)
 	{
+		digestClose(i-1);
 		if(File[i-1])
 			fclose(File[i-1]);
     	File[i-1] = NULL;
+    	freadFastRelease(i-1);
+    	cacheRelease(i-1);
+    	storeRelease(i-1);
 	}
 	if(cwd)
 	{
 		free(cwd);
 		cwd=NULL;
 	}
-	if(wd)
-	{
-		free(wd);
-		wd=NULL;
-	}
 }
 
 
@@ -135,6 +152,53 @@ void restoreStateSig(int sig)
 }
 
 
+void dlogSig(int sig)
+{
+	if(sig == SIGUSR2)
+	{
+		// cycle through log levels
+		dlogLevel = dlogLevel < DLOG_MAX ? dlogLevel + 1 : DLOG_OFF;
+	}
+	else
+	{
+		// render the log from the main loop, not from the signal handler
+		dlogDumpRequested = 1;
+	}
+}
+
+
+/*
+ * Capture rotation "64M", "1h" or both "64M,1h",
+ * sizes in k/M/G, times in s/m/h/d
+ */
+static int parseRotate(const char * s, unsigned long long * bytes, unsigned * secs)
+{
+	while(*s)
+	{
+		char * end;
+		unsigned long long v = strtoull(s, &end, 10);
+
+		if(end == s)
+			return -1;
+		switch(*end)
+		{
+		case 'k': case 'K': *bytes = v << 10; break;
+		case 'M': *bytes = v << 20; break;
+		case 'G': *bytes = v << 30; break;
+		case 's': *secs = v; break;
+		case 'm': *secs = v * 60; break;
+		case 'h': *secs = v * 3600; break;
+		case 'd': *secs = v * 86400; break;
+		default: return -1;
+		}
+		s = end + 1;
+		if(*s == ',')
+			s++;
+	}
+	return 0;
+}
+
+
 int dataAvailable(int iDescriptor)
 {
     struct timeval tv = { 0L, 0L };
@@ -145,23 +209,26 @@ int dataAvailable(int iDescriptor)
 }
 
 
-int getch()
+/*
+ * Keyboard input to the console queue, -1 on CTRL-C
+ */
+int getKeys(void)
 {
-    int r;
-    int c;
+	char buf[256];
+	int n;
+	int i;
 
-    if ((r = read(0, &c, sizeof(c))) < 0)
-    {
-        return r;
-    }
-    else
-    {
-    	if(c==0x7f)
-    	{
-    		c=0x08;		// replace DEL by BS
-    	}
-        return c & 0xff;
-    }
+	n = read(0, buf, sizeof buf);
+	for(i = 0; i < n; i++)
+	{
+		if(buf[i]==0x03)		// exit on CTRL-C
+			return -1;
+		if(buf[i]==0x7f)
+			buf[i]=0x08;		// replace DEL by BS
+	}
+	if(n > 0)
+		portConsole(buf, n);
+	return 0;
 }
 
 
@@ -183,8 +250,169 @@ int main(int argc, char *argv[]) {
 	char port[PATH_MAX];
 	char * command = NULL;
 	int bitrate = DEFAULT_BITRATE;
-	char data[1024];
-	int i;
+	int opt;
+	int fleet = 0;
+	char * traceName = NULL;
+	int logLevel = DLOG_OFF;
+	int logRecords = 65536;
+	struct vfsBackend * mem = NULL;
+	char * manifestName = NULL;
+	int digests = 0;
+	int progress = 0;
+	char * statusName = NULL;
+	char * syncDir = NULL;
+	int rtPrio = 0;
+	int rtCpu = -1;
+	char * scriptName = NULL;
+	char * daemonSock = NULL;
+	char * clientSock = NULL;
+	char * muxSocks = NULL;
+	char * dissectQuery = NULL;
+	int query = 0;
+	int quiet = 500;
+	char * captureBase = NULL;
+	unsigned long long rotateBytes = 0;
+	unsigned rotateSecs = 0;
+	int captureLevel = 0;
+
+	// options precede the positional arguments, the TNC command is left alone
+	while((opt = getopt(argc, argv, "+t:d:D:a:m:Fc:spP:u:E:w:W:R:A:x:S:C:Qq:M:L:Z:B:U:T:Y:H:V:")) != -1)
+	{
+		switch(opt)
+		{
+		case 't':
+			traceName = optarg;
+			break;
+		case 'd':
+			logLevel = atoi(optarg);
+			break;
+		case 'D':
+			logRecords = atoi(optarg);
+			break;
+		case 'a':
+			vfs = vfsArchiveOpen(optarg);
+			if(vfs == NULL)
+			{
+				fprintf(stderr, "Could not open archive %s (%s)\r\n", optarg, strerror(errno));
+				exit(1);
+			}
+			break;
+		case 'F':
+			fleet = 1;
+			break;
+		case 'c':
+			manifestName = optarg;
+			digests |= 1;
+			break;
+		case 's':
+			digests |= 2;
+			break;
+		case 'p':
+			progress = 1;
+			break;
+		case 'P':
+			statusName = optarg;
+			break;
+		case 'u':
+			syncDir = optarg;
+			break;
+		case 'w':
+			requestTimeout = atoi(optarg);
+			break;
+		case 'H':
+			hotplugWait = atoi(optarg);
+			break;
+		case 'W':
+			handleTimeout = atoi(optarg);
+			break;
+		case 'R':
+			rtPrio = atoi(optarg);
+			break;
+		case 'A':
+			rtCpu = atoi(optarg);
+			break;
+		case 'x':
+			scriptName = optarg;
+			break;
+		case 'S':
+			daemonSock = optarg;
+			break;
+		case 'C':
+			clientSock = optarg;
+			break;
+		case 'U':
+			muxSocks = optarg;
+			break;
+		case 'T':
+			wireName = optarg;
+			break;
+		case 'Y':
+			dissectQuery = optarg;
+			break;
+		case 'Q':
+			query = 1;
+			break;
+		case 'q':
+			quiet = atoi(optarg);
+			break;
+		case 'M':
+			captureBase = optarg;
+			break;
+		case 'L':
+			if(parseRotate(optarg, &rotateBytes, &rotateSecs) != 0)
+			{
+				fprintf(stderr, "Could not parse rotation %s\r\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'Z':
+			captureLevel = atoi(optarg);
+			break;
+		case 'B':
+			cacheInit((uint64_t) atoi(optarg) << 20);
+			break;
+		case 'V':
+			if(storeInit(optarg) != 0)
+				exit(1);
+			break;
+		case 'E':
+			exit(preencEncode(optarg) == 0 ? 0 : 1);
+			break;
+		case 'm':
+			if(mem == NULL)
+			{
+				mem = vfsMemCreate(0);
+			}
+			if(mem == NULL || vfsMemLoad(mem, optarg) != 0)
+			{
+				fprintf(stderr, "Could not load %s into memory (%s)\r\n", optarg, strerror(errno));
+				exit(1);
+			}
+			vfs = mem;
+			break;
+		default:
+			argc = 0;
+			break;
+		}
+	}
+	// argc is 0 after an unknown option
+	if(dissectQuery && optind < argc)
+	{
+		exit(dissectRun(dissectQuery, argc - optind, argv + optind));
+	}
+	if(muxSocks && argc)
+	{
+		exit(muxRun(muxSocks));
+	}
+	if(clientSock && argc)
+	{
+		exit(daemonClient(clientSock, query, quiet, argc - optind, argv + optind));
+	}
+	if(argc)
+	{
+		argc -= optind - 1;
+		argv += optind - 1;
+	}
 
 	if(argc > 1)
 	{
@@ -248,13 +476,59 @@ int main(int argc, char *argv[]) {
 	else
 	{
 		printf("\nPlease specify serial device and (optionally) speed (default: 19200).\r\n");
-		printf("Usage: openrs <serialPort> <speed> <tnc command>\r\n");
+		printf("Usage: openrs [options] <serialPort> <speed> <tnc command>\r\n");
+		printf("       <serialPort> may also be tcp:<host>:<port> (raw TCP serial server)\r\n");
+		printf("       or rfc2217:<host>:<port> (RFC 2217, bitrate is set on the server)\r\n");
 		printf("Exit with CTRL-C\r\n\r\n");
+		printf("Options:\r\n");
+		printf("  -t <file>   write protocol trace events to <file> (Chrome trace JSON)\r\n");
+		printf("  -d <level>  debug log level: 0 off, 1 requests, 2 arguments, 3 bytes\r\n");
+		printf("              the log is kept in memory, dump it with SIGUSR1, cycle level with SIGUSR2\r\n");
+		printf("  -D <n>      debug log size in records (default 65536)\r\n");
+		printf("  -a <file>   serve files from a tar or zip archive instead of the current directory\r\n");
+		printf("  -m <path>   serve files from memory, preloaded from a file or directory (repeatable)\r\n");
+		printf("              files written by the TNC are kept in memory only\r\n");
+		printf("  -c <file>   checksum (CRC32C) every transferred file, append the results to <file>\r\n");
+		printf("  -s          also compute SHA-256 (implies checksums)\r\n");
+		printf("  -p          show the progress of open files on stderr\r\n");
+		printf("  -P <file>   keep the progress of open files in <file>\r\n");
+		printf("  -u <dir>    sync: copy the files of <dir> that changed to the TNC drive given as\r\n");
+		printf("              command (default r:)\r\n");
+		printf("  -w <s>      abandon a request after <s> seconds without data (default 10, 0 never)\r\n");
+		printf("  -H <s>      wait up to <s> s for a lost port (USB adapter reset) to come back,\r\n");
+		printf("              open files are kept (default 60, 0 exit)\r\n");
+		printf("  -W <s>      close files the TNC has not used for <s> seconds (default never)\r\n");
+		printf("  -R <prio>   real-time mode: SCHED_FIFO <prio> (or a raised priority), memory locked\r\n");
+		printf("  -A <cpu>    run the session loop on <cpu>\r\n");
+		printf("  -x <file>   run the expect/send script <file> on the TNC console, exit when it ends\r\n");
+		printf("  -S <socket> daemon: keep the port open, take commands from clients on <socket>\r\n");
+		printf("  -C <socket> client: openrs -C <socket> [-Q] [-q <ms>] [<tnc command>]\r\n");
+		printf("              types the command and prints the console output until it is quiet\r\n");
+		printf("              for <ms> (default 500), attaches the console without command,\r\n");
+		printf("              -Q shows the state of the daemon\r\n");
+		printf("  -U <sockets> console of several daemons (comma separated or @file) as tabs or panes,\r\n");
+		printf("              CTRL-A n/p/1-9 switch, s split, [ scrollback, / search, q quit\r\n");
+		printf("  -T <file>   record the raw bytes on the port in both directions with time stamps\r\n");
+		printf("  -Y <query>  dissect: openrs -Y \"cmd=fread handle=3 ms>200\" <capture>...\r\n");
+		printf("              decodes the requests of captures made with -T into an index\r\n");
+		printf("              (<capture>.dix) and prints those matching the query\r\n");
+		printf("  -M <base>   capture the console output to <base>-<date>-<time>.log with time stamps\r\n");
+		printf("  -L <limit>  start a new capture file after a size (64M) and/or time (1h): 64M,1h\r\n");
+		printf("  -Z <level>  compress the capture with zstd <level>\r\n");
+		printf("  -B <MiB>    keep the files the TNC reads in a cache of <MiB>, shared by all handles\r\n");
+		printf("  -V <dir>    backup store: files the TNC writes (binary) may exist and are replaced,\r\n");
+		printf("              every close is kept as a version in <dir>, identical content only once\r\n");
+		printf("  -E <file>   write the pre-escaped image <file>" PREENC_EXT ", served in place of <file>\r\n");
+		printf("  -F          fleet mode: <serialPort> is a comma separated list of ports (or @file),\r\n");
+		printf("              the command is sent to all TNCs and the image (its last argument) is\r\n");
+		printf("              served to all of them in parallel\r\n\r\n");
 		printf("!!! Use DOS/Windows style drive letters as prefix to read from TNC to a local file\n\r");
 		printf("    otherwise the TNC will not initiate the transfer.\n\r");
 		printf("The drive letter will be stripped and the file placed in the current directory.\r\n");
 		printf("Example:\nopenrs /dev/tty.usb 19200 cp r:dip1.scr c:dip1.scr\r\n\r\n");
 		printf("Example:\nopenrs /dev/tty.usb 19200 flash epflash.bin\r\n\r\n");
+		printf("Example:\nopenrs -F /dev/ttyUSB0,/dev/ttyUSB1 19200 flash epflash.bin\r\n\r\n");
+		printf("Example:\nopenrs -u scripts /dev/ttyUSB0 19200 r:\r\n\r\n");
 		exit(0);
 	}
 
@@ -265,7 +539,29 @@ int main(int argc, char *argv[]) {
 		exit(1);
 	}
 
-	wd = malloc(strlen(cwd)+1+PATH_MAX);
+	dlogInit(logLevel, logRecords);
+
+	if(traceName && traceOpen(traceName) != 0)
+	{
+		fprintf(stderr, "Could not open trace file %s (%s)\r\n", traceName, strerror(errno));
+		exit(1);
+	}
+
+	if(digests && digestInit(manifestName, digests & 2) != 0)
+	{
+		fprintf(stderr, "Could not open manifest %s (%s)\r\n", manifestName, strerror(errno));
+		exit(1);
+	}
+
+	if((progress || statusName) && progressInit(progress, statusName, bitrate) != 0)
+	{
+		exit(1);
+	}
+
+	if((rtPrio > 0 || rtCpu >= 0) && rtInit(rtPrio > 0 ? rtPrio : 1, rtCpu) != 0)
+	{
+		exit(1);
+	}
 
 	tcgetattr(0, &org_termios_console);
 	wrk_termios_console = org_termios_console;
@@ -273,66 +569,150 @@ int main(int argc, char *argv[]) {
     atexit(restoreState);
     signal(SIGINT,restoreStateSig);
     signal(SIGTERM,restoreStateSig);
+    signal(SIGUSR1,dlogSig);
+    signal(SIGUSR2,dlogSig);
+
+    fptr = 1;
+    memset(File,0,sizeof(File));
+
+    if(fleet)
+    {
+    	exit(fleetRun(port, bitrate, command));
+    }
+    if(syncDir)
+    {
+    	if(command)
+    		strtok(command, " ");		// the drive, without the trailing blank
+    	exit(syncRun(port, bitrate, syncDir, command));
+    }
 
-    if(openSerial(port, bitrate)!=0)
+    if(portOpen(port, bitrate)!=0)
     {
     	exit(1);
     }
+    if(captureBase && captureInit(captureBase, rotateBytes, rotateSecs, captureLevel) != 0)
+    {
+    	exit(1);
+    }
+    if(daemonSock)
+    {
+    	exit(daemonRun(daemonSock, port, bitrate));
+    }
 
     iConsoleSettingsModified=1;
     cfmakeraw(&wrk_termios_console);
     tcsetattr(0, TCSANOW, &wrk_termios_console);
 
-    fptr = 1;
-    memset(File,0,sizeof(File));
+    if(scriptName)
+    {
+    	if(scriptLoad(scriptName) != 0)
+    		exit(2);
+    	if(sessionLoop(1, scriptPoll) == 1)
+    		exit(scriptStatus());
+    	exit(EXIT_SUCCESS);
+    }
+
+    sessionLoop(1, NULL);
+
+	return EXIT_SUCCESS;
+}
+
+
+/*
+ * Serve the TNC until CTRL-C is pressed on the console or poll() returns
+ * a value other than 0. Without console the keyboard is not read.
+ */
+int sessionLoop(int console, int (*poll)(void))
+{
+	char data[1024];
+	int down = 0;
+	int i;
+	int r;
 
     while(1)
     {
-    	if(dataAvailable(0))
+    	if(dlogDumpRequested)
     	{
-    		int ch;
-    		int retries=0;
-
-    		ch=getch();
-    		if(ch==0x03)		// exit on CTRL-C
-    			break;
-
-			while(write(iDescriptor,&ch,1)!= 1){
-				usleep(500* ++retries);
-				if(retries==5){
-					fprintf(stderr,"Error writing to serial port.\n\r");
-					exit(errno);
-				}
-			}
+    		dlogDump(stderr);
+    		protoStatsPrint(stderr);
+    		rtStatsPrint(stderr);
+    		cacheStatsPrint(stderr);
+    		storeStatsPrint(stderr);
+    		if(captureOn)
+    			captureStatsPrint(stderr);
     	}
-    	else
+
+    	timerRun();
+    	progressUpdate();
+
+    	if(poll && (r = poll()) != 0)
+    	{
+    		return r;
+    	}
+
+    	// keystrokes are queued, they go out once no request or transfer is in progress
+    	if(console && dataAvailable(0) && getKeys() != 0)
+    		break;
+
+    	// the device went away: open files and positions stay, the request in progress is lost
+    	if(portLost())
     	{
-    		if(dataAvailable(iDescriptor))
+    		if(!down)
+    			protocolAbandon();
+    		down = 1;
+    		if(portReopen() != 0)
     		{
-    			int j;
+    			rtSleep(50000);
+    			continue;
+    		}
+    	}
+    	down = 0;
+    	portConsoleFlush();
 
-    			i=read(iDescriptor, &data,sizeof(data));
+    	if(dataAvailable(iDescriptor))
+    	{
+    		int j;
 
-    			for(j=0;j<i;j++)
-    			{
-					protocolHandler(data[j]);
-    			}
+    		i=portRead(data,sizeof(data));
+    		portLastRx = time(NULL);
+    		if(i > 0)
+    			portRxBytes += i;
 
-    			usleep(1000);
+    		for(j=0;j<i;j++)
+    		{
+				protocolHandler(data[j]);
     		}
-    		else
-    			usleep(5000);
+    		// everything the received data triggered leaves in one write
+    		protocolFlush();
+
+    		rtSleep(1000);
     	}
+    	else
+    		rtSleep(5000);
     }
 
-	return EXIT_SUCCESS;
+	return 0;
 }
 
 
+/*
+ * Type a command line on the TNC console
+ */
+void sendCommand(const char * command)
+{
+	portConsole(command, strlen(command));
+	portConsole("\r", 1);
+}
 
-int getcEsc(char data)
+
+
+/*
+ * Unescape a byte received from the TNC: the byte value, -1 for the
+ * escape character 0x10, -2 for the frame characters 0x02 and 0x03.
+ * escState keeps a pending escape, 0 to start with.
+ */
+int escDecode(int * escState, char data)
 {
-	static int escState = 0;
 	int r;
 	r=0;
 
@@ -342,10 +722,10 @@ int getcEsc(char data)
 	case 0x03:
 	case 0x10:
 	{
-		if(escState)
+		if(*escState)
 		{
 			r = (unsigned char) data;
-			escState=0;
+			*escState=0;
 		}
 		else
 		{
@@ -355,7 +735,7 @@ int getcEsc(char data)
 			}
 			else
 			{
-				escState=1;
+				*escState=1;
 				r=-1;
 			}
 		}
@@ -364,7 +744,7 @@ int getcEsc(char data)
 	default:
 	{
 		r = (unsigned char) data;
-		escState=0;
+		*escState=0;
 		break;
 	}
 	}
@@ -372,31 +752,18 @@ int getcEsc(char data)
 }
 
 
-void putPort(int data)
+int getcEsc(char data)
 {
-	int err;
-	int errcnt;
+	static int escState = 0;
 
-	err=0;
-	errcnt=0;
+	return escDecode(&escState, data);
+}
 
-	do
-	{
-		if(err){
-			usleep(1000);
-			errcnt++;
-		}
-		err=write(iDescriptor,&data,1);
-	}while(err==-1 && errno==EAGAIN && errcnt<100);
-	if(errcnt)
-	{
-		fprintf(stderr,"Error writing to serial Port. Discarding some data.\r\n");
-	}
-	if(err==-1 && errno!=EAGAIN)
-	{
-		perror("Unrecoverable Error while writing to serial port. Exiting...\r\n");
-		exit(errno);
-	}
+
+void putPort(int data)
+{
+	portPut(data);
+	portTxBytes++;
 }
 
 
@@ -484,47 +851,17 @@ void putfiEsc(struct FileInfo * fi)
 
 
 
-void foundFile(struct dirent * dir)
+void setFileInfoTime(struct FileInfo * fi, time_t mtime)
 {
-	struct stat st;
-	struct tm * time;
-	struct FileInfo dirFile;
-	char * name;
-
-	name = malloc(sizeof(dir->d_name)+sizeof(wd));
-	sprintf(name,"%s%s",wd, dir->d_name);
-
-	if(stat(name, &st)==0)
-	{
-#ifndef __APPLE__
-		time = localtime(&((st.st_mtim).tv_sec));
-#else
-		time = localtime(&((st.st_mtimespec).tv_sec));
-#endif
-		dirFile.LastWriteDate.year = time->tm_year-80;
-		dirFile.LastWriteDate.month = time->tm_mon+1;
-		dirFile.LastWriteDate.day = time->tm_mday;
-		dirFile.LastWriteTime.hour = time->tm_hour;
-		dirFile.LastWriteTime.min = time->tm_min;
-		dirFile.LastWriteTime.sek_2 = time->tm_sec / 2;
-
-		dirFile.attr = 0;
-		if(S_ISDIR(st.st_mode))
-		{
-			dirFile.attr = 0x10;
-		}
-
-		dirFile.filesize = (uint32_t) st.st_size;
-
-		strncpy(dirFile.filename, dir->d_name, 13);
-	}
-	else
-	{
-		memset(&dirFile,0,sizeof(dirFile));
-		strncpy(dirFile.filename, dir->d_name, 13);
-	}
-	putfiEsc(&dirFile);
-	free(name);
+	struct tm time;
+
+	localtime_r(&mtime, &time);
+	fi->LastWriteDate.year = time.tm_year-80;
+	fi->LastWriteDate.month = time.tm_mon+1;
+	fi->LastWriteDate.day = time.tm_mday;
+	fi->LastWriteTime.hour = time.tm_hour;
+	fi->LastWriteTime.min = time.tm_min;
+	fi->LastWriteTime.sek_2 = time.tm_sec / 2;
 }
 
 
@@ -667,6 +1004,190 @@ int findNext(void)
 */
 
 
+/*
+ * Remove the data of an FWRITE the TNC abandoned, it will be sent again.
+ * The file is only cut back if the write had extended it.
+ */
+static void fwriteRollback(int h, off_t start, uint32_t n)
+{
+	FILE * f = File[h];
+	struct stat st;
+
+	if(f == NULL || start < 0)
+		return;
+
+	fflush(f);
+	if(fileno(f) != -1 && fstat(fileno(f), &st) == 0 && S_ISREG(st.st_mode) && st.st_size == start + (off_t) n)
+	{
+		if(ftruncate(fileno(f), start) != 0)
+			perror("Could not remove partial write");
+	}
+	fseeko(f, start, SEEK_SET);
+	storeRollback(h, start, n);
+	Handle[h].bytes -= n;
+	digestSeek(h);
+	protoStats.rollbacks++;
+	protoStats.dropped += n;
+	DLOG(DLOG_REQUEST, "FWRITE rolled back by %u bytes", n, 0, 0);
+}
+
+
+void protoStatsPrint(FILE * f)
+{
+	fprintf(f, "Protocol: %u resyncs, %u unknown requests, %u bad handles, "
+			"%u writes rolled back (%llu bytes)\r\n",
+			protoStats.resyncs, protoStats.unknown, protoStats.badHandles,
+			protoStats.rollbacks, (unsigned long long) protoStats.dropped);
+	fprintf(f, "Watchdogs: %u requests timed out, %u idle files closed, %u listings closed, "
+			"%u timers fired\r\n",
+			protoStats.timeouts, protoStats.reclaimed, protoStats.dirClosed, timersFired);
+	fprintf(f, "Console: %u bytes held back during transfers, %u discarded\r\n",
+			protoStats.held, protoStats.discarded);
+	if(protoStats.reconnects)
+		fprintf(f, "Port: lost and reopened %u times\r\n", protoStats.reconnects);
+}
+
+
+/*
+ * Watchdogs. Activity only stores a time stamp, an expired timer checks
+ * it and re-arms for the remainder if there was activity in between.
+ */
+static void * dirp=NULL;
+static int listdir=0;
+static int requestHandle = 0;		// handle of the request in progress
+static int requestBusy = 0;
+static int timedOut = 0;			// 1: request watchdog, 2: port lost
+static uint64_t requestLast;
+static uint64_t handleUse[MAXFPTR];
+static uint64_t dirUse;
+static struct timer requestTimer;
+static struct timer handleTimer[MAXFPTR];
+static struct timer dirTimer;
+
+
+/*
+ * publish: the TNC closed the file (FCLOSE), a backup goes to the store;
+ * a handle that is reclaimed or reused drops it
+ */
+static int closeHandle(int h, int publish)
+{
+	int res;
+
+	res = fclose(File[h]);
+	File[h] = NULL;
+	if(!publish)
+		storeRelease(h);
+	else
+	if(storeClose(h) != 0)
+		res = EOF;
+	freadFastRelease(h);
+	cacheRelease(h);
+	digestClose(h);
+	progressClose(h);
+	timerDel(&handleTimer[h]);
+	return res;
+}
+
+
+static int rearm(struct timer * t, uint64_t last, uint32_t limit)
+{
+	uint64_t idle = timerNow() - last;
+
+	if(idle >= limit)
+		return 0;
+	timerAdd(t, limit - idle);
+	return 1;
+}
+
+
+static void requestExpired(struct timer * t)
+{
+	if(rearm(t, requestLast, requestTimeout * 1000))
+		return;
+	timedOut = 1;
+	protocolHandler(0);
+}
+
+
+void protocolAbandon(void)
+{
+	timedOut = 2;
+	protocolHandler(0);
+}
+
+
+static int flushCmd = -1;			// completed request, its response may still be in txBuf
+static uint32_t flushBytes;
+static int rdHandle = -1;			// FREAD whose data may not have reached the TNC
+static off_t rdStart;
+static uint64_t rdBytes;
+
+/*
+ * Write what the requests left in txBuf, a completed request ends here.
+ * If the port was lost on the way the data of an FREAD is discarded, the
+ * file goes back to where the request started.
+ */
+static void protocolFlush(void)
+{
+	portFlush();
+	if(rdHandle != -1)
+	{
+		FILE * f = File[rdHandle];
+
+		if(portLost() && f && rdStart != -1 && fseeko(f, rdStart, SEEK_SET) == 0)
+		{
+			Handle[rdHandle].bytes = rdBytes;
+			Handle[rdHandle].pushback = 0;
+			digestSeek(rdHandle);
+			storeSeek(rdHandle);
+			DLOG(DLOG_REQUEST, "--- fread rolled back to %u, port lost", (uint32_t) rdStart, 0, 0);
+		}
+		rdHandle = -1;
+	}
+	if(flushCmd != -1)
+	{
+		TRACE_FLUSH(flushCmd, flushBytes);
+		flushCmd = -1;
+	}
+}
+
+
+static void handleExpired(struct timer * t)
+{
+	int h = t - handleTimer;
+
+	if(File[h] == NULL)
+		return;
+	if(h+1 == requestHandle)
+	{
+		timerAdd(t, handleTimeout * 1000);
+		return;
+	}
+	if(rearm(t, handleUse[h], handleTimeout * 1000))
+		return;
+
+	printf("Handle %d unused for %d s, closing it.\r\n", h+1, handleTimeout);
+	DLOG(DLOG_REQUEST, "handle %d reclaimed", h+1, 0, 0);
+	closeHandle(h, 0);
+	protoStats.reclaimed++;
+}
+
+
+static void dirExpired(struct timer * t)
+{
+	if(dirp == NULL)
+		return;
+	if(rearm(t, dirUse, (handleTimeout ? handleTimeout : DIR_TIMEOUT) * 1000))
+		return;
+
+	DLOG(DLOG_REQUEST, "directory listing closed", 0, 0, 0);
+	vfsListStop(dirp);
+	dirp = NULL;
+	listdir = 0;
+	protoStats.dirClosed++;
+}
+
+
 void protocolHandler(char c)
 {
 	static int state = STATE_IDLE;
@@ -677,43 +1198,87 @@ void protocolHandler(char c)
 	static uint32_t arg_dw;
 	static uint16_t arg_w;
 	static int iArg=0;
-	static DIR * dirp=NULL;
 	static int activeFptr;
 	static int i;
-#ifdef DEBUG
-	static int bc;
-#endif
-	static int listdir=0;
+	static uint32_t txStart;
+	static off_t wrStart;
+	static int wrActive;		// FWRITE data is being received, wrStart is valid
 
 	int r;
+	int abandon = -1;
 
-	r=getcEsc(c);
-
-#ifdef DEBUG
-	if(r==-2)
+	if(timedOut)
 	{
-		fprintf(stderr,"\r\n%02X\r\n", (uint8_t) c);
-		bc=0;
+		// called by the request watchdog, the TNC went silent (or was reset),
+		// or the port was lost and the rest of the request with it
+		int lost = timedOut == 2;
+
+		timedOut = 0;
+		getcEsc(0);		// forget a pending escape
+		if(state == STATE_IDLE)
+			return;
+		if(lost)
+		{
+			printf("Request %02x abandoned, the port was lost.\r\n", cmd);
+			DLOG(DLOG_REQUEST, "-x- request 0x%02x abandoned after %u bytes, port lost", cmd, i, 0);
+		}
+		else
+		{
+			printf("Request %02x timed out. Resetting.\r\n", cmd);
+			DLOG(DLOG_REQUEST, "-x- request 0x%02x timed out after %u bytes", cmd, i, 0);
+			protoStats.timeouts++;
+		}
+		abandon = STATE_IDLE;
 	}
 	else
-	if(r>=0)
 	{
-		if(bc++ % 16 == 0)
+		r=getcEsc(c);
+		requestLast = timerNow();
+
+		if(r!=-1)
 		{
-			fprintf(stderr,"\r\n");
+			DLOG_BYTE((uint8_t) c, r==-2);
 		}
-		fprintf(stderr,"%02hhx ",(uint8_t) c);
-	}
-#endif
 
-	if(r==-1)
-		return;
+		if(r==-1)
+			return;
+
+		if(c==0x02 && r==-2 && state != STATE_IDLE)
+		{
+			// the TNC gave up on the request, this 0x02 starts the next one
+			printf("Received request while processing %02x. Resynchronising.\r\n",cmd );
+			DLOG(DLOG_REQUEST, "-x- request 0x%02x abandoned after %u bytes", cmd, i, 0);
+			protoStats.resyncs++;
+			abandon = STATE_GETCMD;
+		}
+	}
 
-	if(c==0x02 && r==-2 && state != STATE_IDLE)
+	if(abandon != -1)
 	{
-		printf("Received request while processing %02x. Aborting.\r\n",cmd );
-		state = STATE_IDLE;
+		if(wrActive)
+		{
+			if(i > 1)
+				fwriteRollback(activeFptr-1, wrStart, i-1);
+			wrActive = 0;
+		}
+		if((cmd == CMD_FINDFIRST || cmd == CMD_FINDNEXT) && dirp)
+		{
+			vfsListStop(dirp);
+			dirp = NULL;
+		}
+		TRACE_ABANDON(cmd, portTxBytes - txStart);
+		if(requestHandle)
+		{
+			handleUse[requestHandle-1] = timerNow();
+			requestHandle = 0;
+		}
+		if(abandon == STATE_IDLE)
+			timerDel(&requestTimer);
 		cmd = -1;
+		getArgument = GET_IDLE;
+		iArg = 0;
+		state = abandon;
+		requestBusy = state != STATE_IDLE;
 		return;
 	}
 
@@ -734,7 +1299,7 @@ void protocolHandler(char c)
 			i=0;
 			getArgument = GET_IDLE;
 			iArg++;
-			fprintf(stderr, "Argument 1 (String): %s\r\n", arg_str1);
+			DLOGS(DLOG_DETAIL, "Argument 1 (String): %s", arg_str1, 0, 0);
 		}
 		break;
 	case GET_STRING2:
@@ -751,7 +1316,7 @@ void protocolHandler(char c)
 			i=0;
 			getArgument = GET_IDLE;
 			iArg++;
-			fprintf(stderr, "Argument 2 (String): %s\r\n", arg_str2);
+			DLOGS(DLOG_DETAIL, "Argument 2 (String): %s", arg_str2, 0, 0);
 		}
 		break;
 	case GET_DW:
@@ -767,7 +1332,7 @@ void protocolHandler(char c)
 				i=0;
 				getArgument = GET_IDLE;
 				iArg++;
-				fprintf(stderr, "\r\nArgument (DWORD): 0x%04x\r\n", arg_dw);
+				DLOG(DLOG_DETAIL, "Argument (DWORD): 0x%04x", arg_dw, 0, 0);
 			}
 		}
 		break;
@@ -784,7 +1349,7 @@ void protocolHandler(char c)
 				i=0;
 				getArgument = GET_IDLE;
 				iArg++;
-				fprintf(stderr, "\r\nArgument (WORD): 0x%02x\r\n", arg_w);
+				DLOG(DLOG_DETAIL, "Argument (WORD): 0x%02x", arg_w, 0, 0);
 			}
 		}
 		break;
@@ -801,7 +1366,17 @@ void protocolHandler(char c)
 				i = 0;
 				getArgument = GET_IDLE;
 				iArg++;
-				fprintf(stderr, "\r\nArgument (FD *): 0x%x\r\n", activeFptr);
+				DLOG(DLOG_DETAIL, "Argument (FD *): 0x%x", activeFptr, 0, 0);
+				if(activeFptr < 1 || activeFptr > MAXFPTR)
+				{
+					protoStats.badHandles++;
+					activeFptr = BADFPTR;
+				}
+				else
+				{
+					requestHandle = activeFptr;
+					handleUse[activeFptr-1] = timerNow();
+				}
 			}
 		}
 		break;
@@ -828,13 +1403,22 @@ void protocolHandler(char c)
 				fprintf(stderr, "Error writing to STDOUT.\r\n");
 				exit(errno);
 			}
+			if(consoleTap)
+				consoleTap(r);
+			if(captureOn)
+				captureByte(r);
 		}
 		else
 		if(r==-2 && c==2)		// start command
 		{
-			fprintf(stderr, "Preparing for request\r\n");
+			DLOG(DLOG_REQUEST, "Preparing for request", 0, 0, 0);
 			state = STATE_GETCMD;
 			iArg = 0;
+			if(requestTimeout)
+			{
+				requestTimer.fn = requestExpired;
+				timerAdd(&requestTimer, requestTimeout * 1000);
+			}
 		}
 		break;
 	}
@@ -842,6 +1426,10 @@ void protocolHandler(char c)
 	{
 		if(r>= CMD_FOPEN && r<=CMD_UNGETC)
 		{
+			if(flushCmd != -1)
+				protocolFlush();		// the previous response leaves first
+			txStart = portTxBytes;
+			TRACE_REQ_START(r);
 			putPort(0x03);
 			iArg = 0;
 			i = 0;
@@ -853,7 +1441,7 @@ void protocolHandler(char c)
 
 			cmd = r;
 			state = STATE_PROCESS;
-			fprintf(stderr, "Received request 0x%02x.\r\n",cmd);
+			DLOG(DLOG_REQUEST, "Received request 0x%02x.", cmd, 0, 0);
 			switch(cmd)
 			{
 				case CMD_FOPEN:
@@ -892,6 +1480,7 @@ void protocolHandler(char c)
 		else
 		{
 			fprintf(stderr, "Ignoring unknown request 0x%02x\r\n",r );
+			protoStats.unknown++;
 			state = STATE_IDLE;
 			break;
 		}
@@ -912,9 +1501,13 @@ void protocolHandler(char c)
 			{
 				char * s;
 				char * a=NULL;
-				struct stat st;
+				struct vfsStat st;
+				int exists;
+				int text;
 				char local_path[PATH_MAX];
+				char real_path[PATH_MAX];
 
+				TRACE_ARGS(cmd, 0);
 				s=arg_str1;
 				while(*s)
 				{
@@ -923,13 +1516,15 @@ void protocolHandler(char c)
 				}
 
 				sanitizePath(arg_str1,local_path, sizeof local_path);
-				fprintf(stderr, "Sanitized Path: %s\r\n", local_path);
+				DLOGS(DLOG_DETAIL, "Sanitized Path: %s", local_path, 0, 0);
 
 				s=strrchr(local_path,'/');	// restrict access to current directory
 				if(s==NULL)
 					s=local_path;
 
-				fprintf(stderr, "restricted path: %s\r\n", s);
+				vfsResolve(s, real_path, sizeof real_path);	// host name of any case or 8.3 alias
+				s=real_path;
+				DLOGS(DLOG_DETAIL, "restricted path: %s", s, 0, 0);
 
 				a=strchr(arg_str2, 'w');
 				if(!a)
@@ -937,7 +1532,10 @@ void protocolHandler(char c)
 					a=strchr(arg_str2, 'W');
 				}
 
-				if((stat(s, &st)==0) && (a!=NULL))
+				TRACE_FOP_BEGIN(cmd, fptr);
+				exists = vfsStat(s, &st)==0;
+				text = strpbrk(arg_str2, "tT") != NULL;
+				if(exists && (a!=NULL) && !storeWanted(arg_str2))
 				{
 					printf("File %s exists. Ignoring 'open for write' request.\r\n",s);
 					activeFptr = 0;
@@ -947,17 +1545,37 @@ void protocolHandler(char c)
 					activeFptr=fptr;
 					if (File[activeFptr-1] != NULL)
 					{
-						fclose(File[activeFptr-1]);
+						closeHandle(activeFptr-1, 0);
 					}
+					Handle[activeFptr-1].pushback = 0;
+					Handle[activeFptr-1].bytes = 0;
 					FILE * f;
-					f = fopen(s, arg_str2);	// open file
+					if(storeWanted(arg_str2))
+					{
+						f = storeOpen(activeFptr-1, s, arg_str2);	// backup, published on close
+					}
+					else
+					{
+						f = preencOpen(activeFptr-1, s, arg_str2);
+						if(f == NULL)
+							f = cacheOpen(activeFptr-1, s, arg_str2);
+						if(f == NULL)
+							f = text ? textOpen(s, arg_str2) : vfsOpen(s, arg_str2);	// open file
+						if(f && !text && strpbrk(arg_str2, "wWaA+") == NULL)
+							Handle[activeFptr-1].mem = vfsMemFind(s);	// FREAD from the image data
+					}
 					if(f)
 					{
 						File[activeFptr-1] = f;
+						digestOpen(activeFptr-1, s, arg_str2);
+						progressOpen(activeFptr-1, s, exists && !st.isDir && !text && !Handle[activeFptr-1].store ? st.size : 0);
+						handleUse[activeFptr-1] = timerNow();
+						if(handleTimeout)
+						{
+							handleTimer[activeFptr-1].fn = handleExpired;
+							timerAdd(&handleTimer[activeFptr-1], handleTimeout * 1000);
+						}
 						printf("File %s opened in mode %s.\r\n", s, arg_str2);
-#ifdef DEBUG
-						bc = 0;
-#endif
 					}
 					else
 					{
@@ -966,6 +1584,7 @@ void protocolHandler(char c)
 						printf("%s\n\r",strerror(errno));
 					}
 				}
+				TRACE_FOP_DONE(cmd, activeFptr);
 				putDwEsc(activeFptr);
 
 				if(++fptr>MAXFPTR)
@@ -977,7 +1596,17 @@ void protocolHandler(char c)
 		case CMD_FCLOSE:
 		{
 			int res;
-			res=fclose(File[activeFptr-1]);
+			TRACE_ARGS(cmd, activeFptr);
+			TRACE_FOP_BEGIN(cmd, activeFptr);
+			if(File[activeFptr-1])
+			{
+				res=closeHandle(activeFptr-1, 1);
+			}
+			else
+			{
+				res = EOF;
+			}
+			TRACE_FOP_DONE(cmd, res);
 			putWEsc((uint16_t) res);
 			state = STATE_IDLE;
 			break;
@@ -991,18 +1620,35 @@ void protocolHandler(char c)
 			}
 			else
 			{
-				while(arg_dw--)
+				TRACE_ARGS(cmd, activeFptr);
+				TRACE_FOP_BEGIN(cmd, activeFptr);
+				// where to go back to if the data is lost with the port
+				rdHandle = activeFptr-1;
+				rdStart = File[rdHandle] ? ftello(File[rdHandle]) : -1;
+				rdBytes = Handle[rdHandle].bytes;
+				// pre-escaped images and clean runs of a host file go to the port with sendfile(),
+				// cached files straight from memory
+				if(preencRead(activeFptr-1, arg_dw) != 0 && cacheRead(activeFptr-1, arg_dw) != 0 &&
+						freadFast(activeFptr-1, arg_dw) != 0)
 				{
-					d=fgetc(File[activeFptr-1]);
-					if(d!=EOF)
-					{
-						putcEsc(d);
-					}
-					else
+					while(arg_dw--)
 					{
-						putPort(0x03);
+						d=File[activeFptr-1] ? fgetc(File[activeFptr-1]) : EOF;
+						if(d!=EOF)
+						{
+							unsigned char b = d;
+
+							putcEsc(d);
+							handleData(activeFptr-1, &b, 1);
+						}
+						else
+						{
+							putPort(0x03);
+						}
 					}
 				}
+				Handle[activeFptr-1].pushback = 0;
+				TRACE_FOP_DONE(cmd, portTxBytes - txStart);
 				state = STATE_IDLE;
 			}
 			break;
@@ -1012,44 +1658,58 @@ void protocolHandler(char c)
 			// begin processing with first data byte (the next one)
 			if(i==0)
 			{
+				TRACE_ARGS(cmd, activeFptr);
+				TRACE_FOP_BEGIN(cmd, activeFptr);
+				// where to roll back to if the TNC abandons the request
+				wrStart = File[activeFptr-1] ? ftello(File[activeFptr-1]) : -1;
+				wrActive = 1;
 				i++;
 				break;
 			}
 
+			// 0x03 ends the data, 0x02 has been handled as resync above
 			if(r==-2)
 			{
-				if(c!=3)
-				{
-					fprintf(stderr,"\r\n-x-\r\n");
-					printf("Protocol exception: Received 0x02 during fwrite. Halting operation.\r\n");
-				}
-				else
-				{
-					fprintf(stderr,"\r\n---\r\n");
-				}
+				DLOG(DLOG_REQUEST, "--- fwrite done, %u bytes", i-1, 0, 0);
+				TRACE_FOP_DONE(cmd, i-1);
+				wrActive = 0;
 				state = STATE_IDLE;
 			}
 			else
 			{
 				if(File[activeFptr-1])
 				{
+					unsigned char b = r;
+
 					fputc(r, File[activeFptr-1]);
+					handleData(activeFptr-1, &b, 1);
 				}
+				i++;
 			}
 			break;
 		}
 		case CMD_FGETC:
 		{
 			int c;
+			TRACE_ARGS(cmd, activeFptr);
+			TRACE_FOP_BEGIN(cmd, activeFptr);
 			if(File[activeFptr-1])
 			{
 				c=fgetc(File[activeFptr-1]);
-				putWEsc((uint16_t)c);
+				Handle[activeFptr-1].pushback = 0;
+				if(c!=EOF)
+				{
+					unsigned char b = c;
+
+					handleData(activeFptr-1, &b, 1);
+				}
 			}
 			else
 			{
-				putWEsc(EOF);
+				c=EOF;
 			}
+			TRACE_FOP_DONE(cmd, c);
+			putWEsc((uint16_t)c);
 			state = STATE_IDLE;
 			break;
 		}
@@ -1063,7 +1723,16 @@ void protocolHandler(char c)
 			{
 				int res;
 
-				res=fputc((int) arg_w, File[activeFptr-1]);
+				TRACE_ARGS(cmd, activeFptr);
+				TRACE_FOP_BEGIN(cmd, activeFptr);
+				res=File[activeFptr-1] ? fputc((int) arg_w, File[activeFptr-1]) : EOF;
+				if(res!=EOF)
+				{
+					unsigned char b = res;
+
+					handleData(activeFptr-1, &b, 1);
+				}
+				TRACE_FOP_DONE(cmd, res);
 				putWEsc((uint16_t)res);
 				state = STATE_IDLE;
 			}
@@ -1079,14 +1748,23 @@ void protocolHandler(char c)
 			{
 				char cbuf[4096];
 
+				TRACE_ARGS(cmd, activeFptr);
 				if((arg_w > 4096) || (File[activeFptr-1]==NULL))
 				{
 					putWEsc(0);
+					state = STATE_IDLE;
 				}
 				else
 				{
-					if(fgets(cbuf, (int) arg_w, File[activeFptr-1]))
+					char * res;
+
+					TRACE_FOP_BEGIN(cmd, activeFptr);
+					res = fgets(cbuf, (int) arg_w, File[activeFptr-1]);
+					Handle[activeFptr-1].pushback = 0;
+					TRACE_FOP_DONE(cmd, res ? (int32_t) strlen(cbuf) : -1);
+					if(res)
 					{
+						handleData(activeFptr-1, cbuf, strlen(cbuf));
 						putWEsc(1);
 						putsEsc(cbuf);
 					}
@@ -1108,14 +1786,19 @@ void protocolHandler(char c)
 			else
 			{
 				int res;
+				TRACE_ARGS(cmd, activeFptr);
+				TRACE_FOP_BEGIN(cmd, activeFptr);
 				if(File[activeFptr-1])
 				{
 					res = fputs(arg_str1, File[activeFptr-1]);
+					if(res!=EOF)
+						handleData(activeFptr-1, arg_str1, strlen(arg_str1));
 				}
 				else
 				{
 					res = EOF;
 				}
+				TRACE_FOP_DONE(cmd, res);
 				putWEsc((uint16_t)res);
 				state = STATE_IDLE;
 			}
@@ -1129,85 +1812,78 @@ void protocolHandler(char c)
 			}
 			else
 			{
-				struct dirent * dir;
-				char * cc;
+				char cc[PATH_MAX];
+				char path[PATH_MAX];
 				char * cd;
 
 				listdir=0;
 
+				TRACE_ARGS(cmd, 0);
+				TRACE_FOP_BEGIN(cmd, 0);
 				if(dirp)
-					closedir(dirp);
-
-				if(strlen(arg_str1)>3)
 				{
-					cc = &arg_str1[3];
+					vfsListStop(dirp);
+					dirp=NULL;
 				}
-				else
-					cc = arg_str1;
 
-				while((cd = strchr(cc,'\\') ))
-				{
-					*cd = '/';
-				}
+				path[0] = 0;
+				sanitizePath(arg_str1, path, sizeof path);	// drive and '\\' removed
 
-				cd = strstr(cc,"*.*");
+				cd = strstr(path,"*.*");
 				if(cd)
 				{
 					// list directory
 					*cd = 0;
 					listdir = 1;
 				}
+				vfsResolve(path, cc, sizeof cc);
 
 				if(listdir)
 				{
-					sprintf(wd,"%s/%s",cwd,cc);
-					dirp = opendir(wd);
-					if(dirp && (dir = readdir(dirp)))
+					struct FileInfo dirFile;
+
+					dirp = vfsListStart(cc);	// host: stat of the following entries runs in the background
+					dirUse = timerNow();
+					if(dirp)
 					{
+						dirTimer.fn = dirExpired;
+						timerAdd(&dirTimer, (handleTimeout ? handleTimeout : DIR_TIMEOUT) * 1000);
+					}
+					if(dirp && vfsListNext(dirp, &dirFile)==0)
+					{
+						TRACE_FOP_DONE(cmd, 0);
 						putWEsc(0);
-						foundFile(dir);
+						putfiEsc(&dirFile);
 					}
 					else
 					{
+						TRACE_FOP_DONE(cmd, -1);
 						putWEsc(-1);
 					}
 				}
 				else
 				{
-					struct stat st;
-					struct tm * time;
+					struct vfsStat st;
 					struct FileInfo dirFile;
 
 					memset(&dirFile,0,sizeof(dirFile));
 
-					if( (stat(cc, &st)==0) && (!S_ISDIR(st.st_mode)))
+					if( (vfsStat(cc, &st)==0) && (!st.isDir))
 					{
-#ifndef __APPLE__
-						time = localtime(&((st.st_mtim).tv_sec));
-#else
-						time = localtime(&((st.st_mtimespec).tv_sec));
-#endif
-						dirFile.LastWriteDate.year = time->tm_year-80;
-						dirFile.LastWriteDate.month = time->tm_mon+1;
-						dirFile.LastWriteDate.day = time->tm_mday;
-						dirFile.LastWriteTime.hour = time->tm_hour;
-						dirFile.LastWriteTime.min = time->tm_min;
-						dirFile.LastWriteTime.sek_2 = time->tm_sec / 2;
+						setFileInfoTime(&dirFile, st.mtime);
 
 						dirFile.attr = 0;
-						if(S_ISDIR(st.st_mode))
-						{
-							dirFile.attr = 0x10;
-						}
-
-						dirFile.filesize = (uint32_t) st.st_size;
+						dirFile.filesize = (uint32_t) st.size;
 
-						strncpy(dirFile.filename, arg_str1, 13);
+						cd = strrchr(cc, '/');
+						nameAlias(cd ? cd+1 : cc, dirFile.filename);
+						TRACE_FOP_DONE(cmd, 0);
 						putWEsc(0);
 						putfiEsc(&dirFile);
 					}
 					else
 					{
+						TRACE_FOP_DONE(cmd, -1);
 						putWEsc(-1);
 					}
 				}
@@ -1217,19 +1893,24 @@ void protocolHandler(char c)
 		}
 		case CMD_FINDNEXT:
 		{
-			struct dirent * dir;
+			struct FileInfo dirFile;
 
-			if(listdir && (dir = readdir(dirp)))
+			TRACE_ARGS(cmd, 0);
+			TRACE_FOP_BEGIN(cmd, 0);
+			dirUse = timerNow();
+			if(listdir && dirp && vfsListNext(dirp, &dirFile)==0)
 			{
+				TRACE_FOP_DONE(cmd, 0);
 				putWEsc(0);
-				foundFile(dir);
+				putfiEsc(&dirFile);
 			}
 			else
 			{
+				TRACE_FOP_DONE(cmd, -1);
 				putWEsc(-1);
 				if(dirp)
 				{
-					closedir(dirp);
+					vfsListStop(dirp);
 					dirp=NULL;
 				}
 			}
@@ -1238,6 +1919,7 @@ void protocolHandler(char c)
 		}
 		case CMD_REMOVE:
 		{
+			TRACE_ARGS(cmd, 0);
 			fprintf(stderr,"Request to remove file ignored. (unimplemented)\r\n.");
 			fprintf(stderr,"Please remove %s manually\r\n",arg_str1);
 			state = STATE_IDLE;
@@ -1250,6 +1932,7 @@ void protocolHandler(char c)
 			}
 			else
 			{
+				TRACE_ARGS(cmd, 0);
 				fprintf(stderr,"Request to rename file ignored. (unimplemented)\r\n.");
 				fprintf(stderr,"Please rename\r\n%s\nmanually to\r\n%s\r\n",arg_str1, arg_str2);
 				state = STATE_IDLE;
@@ -1258,6 +1941,8 @@ void protocolHandler(char c)
 		case CMD_FTELL:
 		{
 			long l;
+			TRACE_ARGS(cmd, activeFptr);
+			TRACE_FOP_BEGIN(cmd, activeFptr);
 			if(File[activeFptr-1])
 			{
 				l = ftell(File[activeFptr-1]);
@@ -1266,6 +1951,7 @@ void protocolHandler(char c)
 			{
 				l = -1;
 			}
+			TRACE_FOP_DONE(cmd, (int32_t) l);
 			putDwEsc((uint32_t) l);
 			state = STATE_IDLE;
 			break;
@@ -1283,14 +1969,25 @@ void protocolHandler(char c)
 			}
 			else
 			{
+				int res;
+
+				TRACE_ARGS(cmd, activeFptr);
+				TRACE_FOP_BEGIN(cmd, activeFptr);
 				if(File[activeFptr-1])
 				{
-					putWEsc((uint16_t) fseek(File[activeFptr-1], arg_dw, arg_w));
+					res = fseek(File[activeFptr-1], arg_dw, arg_w);
+					if(res == 0 && !(arg_w == SEEK_CUR && arg_dw == 0))
+					{
+						digestSeek(activeFptr-1);
+						storeSeek(activeFptr-1);
+					}
 				}
 				else
 				{
-					putWEsc(EOF);
+					res = EOF;
 				}
+				TRACE_FOP_DONE(cmd, res);
+				putWEsc((uint16_t) res);
 				state = STATE_IDLE;
 			}
 			break;
@@ -1303,14 +2000,22 @@ void protocolHandler(char c)
 			}
 			else
 			{
+				int res;
+
+				TRACE_ARGS(cmd, activeFptr);
+				TRACE_FOP_BEGIN(cmd, activeFptr);
 				if(File[activeFptr-1])
 				{
-					putWEsc((uint16_t) ungetc((int)arg_w, File[activeFptr-1]));
+					res = ungetc((int)arg_w, File[activeFptr-1]);
+					Handle[activeFptr-1].pushback = res != EOF;
+					digestSeek(activeFptr-1);
 				}
 				else
 				{
-					putWEsc(EOF);
+					res = EOF;
 				}
+				TRACE_FOP_DONE(cmd, res);
+				putWEsc((uint16_t) res);
 				state = STATE_IDLE;
 			}
 			break;
@@ -1325,6 +2030,55 @@ void protocolHandler(char c)
 		break;
 	}
 	}
+
+	if(state == STATE_IDLE && cmd != -1)
+	{
+		// request completed, the response is flushed by protocolFlush()
+		flushCmd = cmd;
+		flushBytes = portTxBytes - txStart;
+		cmd = -1;
+	}
+	if(state == STATE_IDLE && requestHandle)
+	{
+		handleUse[requestHandle-1] = timerNow();
+		requestHandle = 0;
+	}
+	if(state == STATE_IDLE)
+		timerDel(&requestTimer);
+	requestBusy = state != STATE_IDLE;
+}
+
+
+int protocolIdle(void)
+{
+	return !requestBusy;
+}
+
+
+/*
+ * A keystroke must not reach the TNC while it waits for a response, nor
+ * between the requests of a running transfer: it would be taken as part of
+ * the next response.
+ */
+int consoleClear(void)
+{
+	uint64_t now = timerNow();
+	int i;
+
+	if(requestBusy)
+		return 0;
+	for(i = 0; i < MAXFPTR; i++)
+	{
+		if(File[i] && now - handleUse[i] < TX_HOLD)
+			return 0;
+	}
+	return 1;
+}
+
+
+void restoreSerial(void)
+{
+	tcsetattr(iDescriptor, TCSADRAIN, &org_termios);
 }
 
 
@@ -1338,8 +2092,11 @@ int openSerial(char * port, int speed)
 	if (iDescriptor == -1)
 	{
 		iError = 2;
-		printf("Error: can't open device %s\r\n", port);
-		printf("       (%s)\r\n", strerror(errno));
+		if(!portLost())		// portReopen() retries quietly
+		{
+			printf("Error: can't open device %s\r\n", port);
+			printf("       (%s)\r\n", strerror(errno));
+		}
 		return iError;
 	}
 
@@ -1434,16 +2191,22 @@ int openSerial(char * port, int speed)
             if (cfsetispeed(&(wrk_termios), speed) == -1)
             {
                 iError = 4;
-                printf("Error: can't set input bitrate on %s\r\n", port);
-                printf("       (%s)\r\n", strerror(errno));
+                if(!portLost())
+                {
+                	printf("Error: can't set input bitrate on %s\r\n", port);
+                	printf("       (%s)\r\n", strerror(errno));
+                }
             }
 
             /* Empfangsparameter setzen */
             if (cfsetospeed(&(wrk_termios), speed) == -1)
             {
                 iError = 4;
-                printf("Error: can't set output bitrate on %s\r\n", port);
-                printf("       (%s)\r\n", strerror(errno));
+                if(!portLost())
+                {
+                	printf("Error: can't set output bitrate on %s\r\n", port);
+                	printf("       (%s)\r\n", strerror(errno));
+                }
             }
 #endif
         }
@@ -1465,6 +2228,7 @@ int openSerial(char * port, int speed)
 		if (iError > 2)
 		{
 			close(iDescriptor);
+			iDescriptor = -1;
 		}
     }
 
@@ -0,0 +1,107 @@
+/*
+ ============================================================================
+ Name        : OpenRS.h
+ Author      : F. Erckenbrecht / dg1yfe
+ Copyright   : GPL
+ Description : Types and functions shared between the OpenRS modules
+ ============================================================================
+ */
+
+#ifndef OPENRS_H_
+#define OPENRS_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+enum {CMD_FOPEN, CMD_FREAD, CMD_FWRITE, CMD_FCLOSE,
+	CMD_FGETC, CMD_FPUTC, CMD_FGETS, CMD_FPUTS,
+	CMD_FINDFIRST, CMD_FINDNEXT,
+	CMD_REMOVE, CMD_RENAME,
+	CMD_FTELL, CMD_FSEEK,
+	CMD_UNGETC
+};
+
+
+typedef struct ff_fdate{
+	unsigned 		day:5;
+	unsigned		month:4;
+	unsigned 		year:7;	// Jahre seit 1980
+}t_ffdate;
+
+typedef struct ff_ftime{
+	unsigned		sek_2:5;	// Zählung in Schritten von 2 Sekunden
+	unsigned		min:6;
+	unsigned		hour:5;
+}t_fftime;
+
+struct FileInfo{
+	uint16_t	attr;
+	t_fftime	LastWriteTime;
+	t_ffdate	LastWriteDate;
+	uint32_t	filesize;
+	char		filename[14]; 	// sprintf(&FileInfo.filename,"%-1.13s", Dateiname))
+};
+
+#define MAXFPTR 256
+#define BADFPTR (MAXFPTR+1)	// handles out of range end up here, its File[] is always NULL
+extern FILE * File[MAXFPTR+1];
+
+// per handle state kept next to File[]
+struct fileHandle {
+	int			pushback;	// ungetc() since the last read, stream differs from the file
+	char *		map;		// mapping used by the FREAD fast path
+	size_t		mapSize;
+	uint64_t	bytes;		// file data moved through the handle
+	struct digest * digest;	// running checksums, NULL if not enabled
+	struct preenc * pe;		// pre-escaped image the stream reads from
+	struct cacheEntry * cached;	// cached file data the stream reads from
+	const struct vfsMemFile * mem;	// memory backend file the stream reads from (archive, fleet image)
+	struct storeFile * store;	// backup written to memory, published to the store on close
+};
+extern struct fileHandle Handle[MAXFPTR+1];
+
+// protocol errors the handler recovered from
+struct protoStats {
+	uint32_t	resyncs;		// 0x02 before the previous request was complete
+	uint32_t	unknown;		// unknown request codes
+	uint32_t	badHandles;		// handle arguments out of range
+	uint32_t	rollbacks;		// aborted FWRITEs, partial data removed
+	uint64_t	dropped;		// data bytes of aborted FWRITEs
+	uint32_t	timeouts;		// requests abandoned by the watchdog
+	uint32_t	reclaimed;		// idle handles closed
+	uint32_t	dirClosed;		// unfinished directory listings closed
+	uint32_t	held;			// console bytes held back during a transfer
+	uint32_t	discarded;		// console bytes that did not fit into the queue
+	uint32_t	reconnects;		// the port was lost and reopened
+};
+extern struct protoStats protoStats;
+
+extern int iDescriptor;
+extern uint32_t portTxBytes;
+extern uint32_t portRxBytes;
+extern time_t portLastRx;
+extern char * cwd;
+extern void (*consoleTap)(int c);	// sees the TNC console output, if set
+extern int requestTimeout;
+extern int handleTimeout;
+
+int openSerial(char * port, int speed);
+void restoreSerial(void);
+int escDecode(int * escState, char data);
+void putPort(int data);
+void putcEsc(int data);
+void putDwEsc(uint32_t data);
+void putWEsc(uint16_t data);
+void putBufEsc(char * buf, int len);
+void putsEsc(char * s);
+void putfiEsc(struct FileInfo * fi);
+void setFileInfoTime(struct FileInfo * fi, time_t mtime);
+int sessionLoop(int console, int (*poll)(void));
+void sendCommand(const char * command);
+void protoStatsPrint(FILE * f);
+int protocolIdle(void);		// no request in progress
+void protocolAbandon(void);	// give up the request in progress, the port was lost
+int consoleClear(void);		// no request or transfer in progress, the console may be written
+
+#endif /* OPENRS_H_ */
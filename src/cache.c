@@ -0,0 +1,293 @@
+/*
+ ============================================================================
+ Name        : cache.c
+ Author      : F. Erckenbrecht / dg1yfe
+ Copyright   : GPL
+ Description : Content cache for files the TNC reads, shared by all handles
+ ============================================================================
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "OpenRS.h"
+#include "cache.h"
+#include "vfs.h"
+#include "fastread.h"
+#include "digest.h"
+#include "dlog.h"
+#include "transport.h"
+
+#define CACHE_BUCKETS	256
+
+struct cacheEntry {
+	struct cacheEntry *	next;		// hash chain
+	struct cacheEntry *	newer;		// LRU list
+	struct cacheEntry *	older;
+	dev_t				dev;
+	ino_t				ino;
+	time_t				mtime;
+	long				mtimeNs;
+	int					refs;		// handles reading from the entry
+	struct vfsMemFile	mf;
+};
+
+static struct cacheEntry * bucket[CACHE_BUCKETS];
+static struct cacheEntry * newest = NULL;
+static struct cacheEntry * oldest = NULL;
+static uint64_t budget = 0;			// 0: cache off
+static uint64_t used = 0;
+
+static struct {
+	uint32_t	hits;
+	uint32_t	misses;
+	uint32_t	bypassed;		// too large or not readable
+	uint32_t	evicted;
+	uint64_t	diskBytes;		// read from the disk
+	uint64_t	servedBytes;	// sent from the cache
+} stats;
+
+
+int cacheInit(uint64_t bytes)
+{
+	budget = bytes;
+	return 0;
+}
+
+
+static void lruUnlink(struct cacheEntry * e)
+{
+	if(e->newer)
+		e->newer->older = e->older;
+	else
+		newest = e->older;
+	if(e->older)
+		e->older->newer = e->newer;
+	else
+		oldest = e->newer;
+	e->newer = e->older = NULL;
+}
+
+
+static void lruFront(struct cacheEntry * e)
+{
+	e->older = newest;
+	e->newer = NULL;
+	if(newest)
+		newest->newer = e;
+	newest = e;
+	if(oldest == NULL)
+		oldest = e;
+}
+
+
+static void evict(struct cacheEntry * e)
+{
+	struct cacheEntry ** pp = &bucket[e->ino % CACHE_BUCKETS];
+
+	while(*pp != e)
+		pp = &(*pp)->next;
+	*pp = e->next;
+	lruUnlink(e);
+	used -= e->mf.size;
+	DLOGS(DLOG_DETAIL, "cache: evicted %s", e->mf.name, 0, 0);
+	free(e->mf.data);
+	free(e->mf.name);
+	free(e);
+	stats.evicted++;
+}
+
+
+// make room for size bytes, entries in use stay
+static int reserve(uint64_t size)
+{
+	struct cacheEntry * e = oldest;
+
+	while(used + size > budget && e)
+	{
+		struct cacheEntry * n = e->newer;
+
+		if(e->refs == 0)
+			evict(e);
+		e = n;
+	}
+	return used + size <= budget ? 0 : -1;
+}
+
+
+static struct cacheEntry * load(const char * path, int fd, const struct stat * st)
+{
+	struct cacheEntry * e;
+	uint64_t got = 0;
+
+	if((uint64_t) st->st_size > budget || reserve(st->st_size) != 0)
+		return NULL;
+
+	e = calloc(1, sizeof(*e));
+	if(e == NULL)
+		return NULL;
+	e->mf.data = malloc(st->st_size ? st->st_size : 1);
+	e->mf.name = strdup(path);
+	if(e->mf.data == NULL || e->mf.name == NULL)
+		goto fail;
+
+	while(got < (uint64_t) st->st_size)
+	{
+		ssize_t n = pread(fd, e->mf.data + got, st->st_size - got, got);
+
+		if(n <= 0)
+			goto fail;		// read error or the file shrank
+		got += n;
+	}
+	stats.diskBytes += got;
+
+	e->dev = st->st_dev;
+	e->ino = st->st_ino;
+#ifndef __APPLE__
+	e->mtime = st->st_mtim.tv_sec;
+	e->mtimeNs = st->st_mtim.tv_nsec;
+#else
+	e->mtime = st->st_mtimespec.tv_sec;
+	e->mtimeNs = st->st_mtimespec.tv_nsec;
+#endif
+	e->mf.size = got;
+	e->mf.mtime = e->mtime;
+	e->mf.readOnly = 1;
+	e->next = bucket[e->ino % CACHE_BUCKETS];
+	bucket[e->ino % CACHE_BUCKETS] = e;
+	lruFront(e);
+	used += got;
+	return e;
+
+fail:
+	free(e->mf.data);
+	free(e->mf.name);
+	free(e);
+	return NULL;
+}
+
+
+FILE * cacheOpen(int h, const char * path, const char * mode)
+{
+	struct cacheEntry * e;
+	struct stat st;
+	FILE * f;
+	int fd;
+
+	if(budget == 0 || vfs != &vfsHost || strpbrk(mode, "wa+tT"))
+		return NULL;
+
+	fd = open(path, O_RDONLY);
+	if(fd == -1)
+		return NULL;
+	if(fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+	{
+		close(fd);
+		return NULL;
+	}
+
+	for(e = bucket[st.st_ino % CACHE_BUCKETS]; e; e = e->next)
+	{
+#ifndef __APPLE__
+		long ns = st.st_mtim.tv_nsec;
+#else
+		long ns = st.st_mtimespec.tv_nsec;
+#endif
+		if(e->ino == st.st_ino && e->dev == st.st_dev && e->mf.size == (uint64_t) st.st_size &&
+				e->mtime == st.st_mtime && e->mtimeNs == ns)
+			break;
+	}
+
+	if(e)
+	{
+		stats.hits++;
+		lruUnlink(e);
+		lruFront(e);
+	}
+	else
+	{
+		e = load(path, fd, &st);
+		if(e == NULL)
+		{
+			stats.bypassed++;
+			close(fd);
+			return NULL;
+		}
+		stats.misses++;
+	}
+	close(fd);
+
+	f = vfsStreamOpen(&e->mf, mode);
+	if(f == NULL)
+		return NULL;
+	e->refs++;
+	Handle[h].cached = e;
+	DLOGS(DLOG_REQUEST, "%s served from the cache", path, 0, 0);
+	return f;
+}
+
+
+int cacheRead(int h, uint32_t count)
+{
+	struct cacheEntry * e = Handle[h].cached;
+	FILE * f = File[h];
+	off_t pos;
+	off_t end;
+	uint32_t escaped;
+
+	if(e == NULL || f == NULL || Handle[h].pushback || portRawFd() == -1)
+		return -1;
+
+	pos = ftello(f);
+	if(pos == -1)
+		return -1;
+
+	end = pos + count;
+	if((uint64_t) end > e->mf.size)
+		end = (uint64_t) pos < e->mf.size ? (off_t) e->mf.size : pos;
+
+	escaped = freadSlice(-1, (const unsigned char *) e->mf.data, pos, end);
+
+	// beyond EOF every requested byte is answered with 0x03
+	for(count -= end - pos; count; count--)
+	{
+		putPort(0x03);
+	}
+
+	fseeko(f, end, SEEK_SET);
+	handleData(h, e->mf.data + pos, end - pos);
+	stats.servedBytes += end - pos;
+	DLOG(DLOG_DETAIL, "FREAD from cache: %u bytes, %u escaped", (uint32_t)(end - pos), escaped, 0);
+	return 0;
+}
+
+
+void cacheRelease(int h)
+{
+	struct cacheEntry * e = Handle[h].cached;
+
+	if(e == NULL)
+		return;
+	e->refs--;
+	Handle[h].cached = NULL;
+}
+
+
+void cacheStatsPrint(FILE * f)
+{
+	if(budget == 0)
+		return;
+	fprintf(f, "Cache: %u hits, %u misses, %u not cached, %u evicted, %llu of %llu KiB used\r\n",
+			stats.hits, stats.misses, stats.bypassed, stats.evicted,
+			(unsigned long long) used >> 10, (unsigned long long) budget >> 10);
+	fprintf(f, "Cache: %llu bytes read from disk, %llu bytes served from memory\r\n",
+			(unsigned long long) stats.diskBytes, (unsigned long long) stats.servedBytes);
+}
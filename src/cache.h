@@ -0,0 +1,30 @@
+/*
+ ============================================================================
+ Name        : cache.h
+ Author      : F. Erckenbrecht / dg1yfe
+ Copyright   : GPL
+ Description : Content cache for files the TNC reads, shared by all handles
+ ============================================================================
+ */
+
+#ifndef CACHE_H_
+#define CACHE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * Files opened for reading on the host backend are read into memory once
+ * and served from there to every handle that opens them later. Entries are
+ * keyed by device, inode, size and mtime, so a file that changed is read
+ * again. The least recently used entries without open handles are evicted
+ * when the budget would be exceeded; files larger than the budget are not
+ * cached.
+ */
+int cacheInit(uint64_t budget);
+FILE * cacheOpen(int h, const char * path, const char * mode);
+int cacheRead(int h, uint32_t count);	// 0: request served, -1: use the other paths
+void cacheRelease(int h);
+void cacheStatsPrint(FILE * f);
+
+#endif /* CACHE_H_ */
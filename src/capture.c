@@ -0,0 +1,384 @@
+/*
+ ============================================================================
+ Name        : capture.c
+ Author      : F. Erckenbrecht / dg1yfe
+ Copyright   : GPL
+ Description : Capture of the TNC console output (monitor) to rotating,
+               optionally compressed logs with a time stamp index
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <time.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "OpenRS.h"
+#include "capture.h"
+#include "timer.h"
+#include "rt.h"
+
+#define CAPTURE_LINE	256					// longer lines are split into several records
+#define CAPTURE_QUEUE	(4*1024*1024)		// bytes, power of 2
+#define CAPTURE_IDLE	200					// ms until a line without LF (a prompt) is recorded
+#define CAPTURE_INDEX	65536				// record bytes between index entries
+#define CAPTURE_POLL	20000				// us the writer sleeps when the queue is empty
+
+struct record {
+	int64_t		sec;
+	int32_t		usec;
+	uint32_t	len;
+};
+
+int captureOn = 0;
+
+// session loop side
+static char line[CAPTURE_LINE];
+static size_t lineLen = 0;
+static struct timespec lineTime;
+static struct timer idleTimer;
+static uint64_t lastByte;
+
+// single producer, single consumer queue of records
+static unsigned char * queue;
+static uint64_t head = 0;		// written by the session loop
+static uint64_t tail = 0;		// written by the writer thread
+static uint32_t dropped = 0;
+static pthread_t writer;
+static volatile int stop = 0;
+
+// writer side
+static char * base;
+static unsigned long long rotateBytes;
+static unsigned rotateSecs;
+static int level;
+static FILE * out = NULL;
+static FILE * idx = NULL;
+static char outName[PATH_MAX];
+static time_t outStart;
+static uint64_t rawOff;			// record bytes in the current file
+static uint64_t fileOff;		// bytes written to the current file
+static uint64_t lastIndex;
+static uint64_t records = 0;
+static uint64_t rawTotal = 0;
+static uint64_t fileTotal = 0;
+static uint32_t files = 0;
+
+#ifdef HAVE_ZSTD
+static ZSTD_CCtx * zc = NULL;
+static unsigned char * zbuf;
+static size_t zbufSize;
+#endif
+
+
+static void queueCopy(uint64_t pos, const void * p, size_t n)
+{
+	size_t o = pos & (CAPTURE_QUEUE - 1);
+	size_t k = n < CAPTURE_QUEUE - o ? n : CAPTURE_QUEUE - o;
+
+	memcpy(queue + o, p, k);
+	memcpy(queue, (const unsigned char *) p + k, n - k);
+}
+
+
+static void queueRead(uint64_t pos, void * p, size_t n)
+{
+	size_t o = pos & (CAPTURE_QUEUE - 1);
+	size_t k = n < CAPTURE_QUEUE - o ? n : CAPTURE_QUEUE - o;
+
+	memcpy(p, queue + o, k);
+	memcpy((unsigned char *) p + k, queue, n - k);
+}
+
+
+static void commit(void)
+{
+	struct record r;
+	uint64_t t = __atomic_load_n(&tail, __ATOMIC_ACQUIRE);
+
+	if(CAPTURE_QUEUE - (head - t) < sizeof(r) + lineLen)
+	{
+		dropped++;		// the writer is behind, the serial port must not wait for it
+		lineLen = 0;
+		return;
+	}
+	r.sec = lineTime.tv_sec;
+	r.usec = lineTime.tv_nsec / 1000;
+	r.len = lineLen;
+	queueCopy(head, &r, sizeof(r));
+	queueCopy(head + sizeof(r), line, lineLen);
+	__atomic_store_n(&head, head + sizeof(r) + lineLen, __ATOMIC_RELEASE);
+	lineLen = 0;
+}
+
+
+static void idleExpired(struct timer * t)
+{
+	uint64_t quiet = timerNow() - lastByte;
+
+	if(lineLen == 0)
+		return;
+	if(quiet < CAPTURE_IDLE)
+		timerAdd(t, CAPTURE_IDLE - quiet);
+	else
+		commit();
+}
+
+
+/*
+ * Console byte, outside of protocol frames
+ */
+void captureByte(int c)
+{
+	lastByte = timerNow();
+	if(c == '\r')
+		return;
+	if(c == '\n')
+	{
+		if(lineLen == 0)
+			clock_gettime(CLOCK_REALTIME, &lineTime);
+		commit();
+		return;
+	}
+	if(lineLen == 0)
+	{
+		clock_gettime(CLOCK_REALTIME, &lineTime);
+		if(!timerPending(&idleTimer))
+			timerAdd(&idleTimer, CAPTURE_IDLE);
+	}
+	line[lineLen++] = (char) c;
+	if(lineLen == CAPTURE_LINE)
+		commit();
+}
+
+
+static int emit(const void * p, size_t n, int endFrame)
+{
+#ifdef HAVE_ZSTD
+	if(zc)
+	{
+		ZSTD_inBuffer in = { p, n, 0 };
+		size_t r;
+
+		do
+		{
+			ZSTD_outBuffer o = { zbuf, zbufSize, 0 };
+
+			r = ZSTD_compressStream2(zc, &o, &in, endFrame ? ZSTD_e_end : ZSTD_e_continue);
+			if(ZSTD_isError(r) || fwrite(zbuf, 1, o.pos, out) != o.pos)
+				return -1;
+			fileOff += o.pos;
+		}while(endFrame ? r != 0 : in.pos < in.size);
+		return 0;
+	}
+#endif
+	if(n && fwrite(p, 1, n, out) != n)
+		return -1;
+	fileOff += n;
+	return 0;
+}
+
+
+static void closeFile(void)
+{
+	if(out == NULL)
+		return;
+	emit(NULL, 0, 1);
+	fileTotal += fileOff;
+	fileOff = 0;
+	if(fclose(out) != 0)
+		fprintf(stderr, "Capture: error writing %s\r\n", outName);
+	out = NULL;
+	if(idx)
+		fclose(idx);
+	idx = NULL;
+}
+
+
+static int openFile(time_t t)
+{
+	char idxName[PATH_MAX + 8];
+	char stamp[32];
+	struct tm tm;
+	int k;
+
+	localtime_r(&t, &tm);
+	strftime(stamp, sizeof stamp, "%Y%m%d-%H%M%S", &tm);
+	snprintf(outName, sizeof outName, "%s-%s.log%s", base, stamp, level ? ".zst" : "");
+	// size rotation can start several files within a second
+	for(k = 1; access(outName, F_OK) == 0; k++)
+		snprintf(outName, sizeof outName, "%s-%s-%d.log%s", base, stamp, k, level ? ".zst" : "");
+
+	out = fopen(outName, "wb");
+	snprintf(idxName, sizeof idxName, "%s.idx", outName);
+	idx = out ? fopen(idxName, "w") : NULL;
+	if(out == NULL || idx == NULL)
+	{
+		fprintf(stderr, "Capture: can't create %s\r\n", out ? idxName : outName);
+		if(out)
+			fclose(out);
+		out = NULL;
+		return -1;
+	}
+	setvbuf(out, NULL, _IOFBF, 256 * 1024);
+	outStart = t;
+	rawOff = fileOff = 0;
+	lastIndex = 0;
+	files++;
+#ifdef HAVE_ZSTD
+	if(zc)
+		ZSTD_CCtx_reset(zc, ZSTD_reset_session_only);
+#endif
+	return 0;
+}
+
+
+static void writeRecord(const struct record * r, const unsigned char * p)
+{
+	static const char hex[] = "0123456789abcdef";
+	char buf[32 + 4 * CAPTURE_LINE];
+	int n;
+	uint32_t i;
+
+	if(out && ((rotateBytes && rawOff >= rotateBytes) || (rotateSecs && r->sec - outStart >= rotateSecs)))
+		closeFile();
+	if(out == NULL && openFile(r->sec) != 0)
+		return;
+
+	if(rawOff == 0 || rawOff - lastIndex >= CAPTURE_INDEX)
+	{
+		// a frame boundary, decompression can start here
+		if(rawOff)
+			emit(NULL, 0, 1);
+		fprintf(idx, "%lld.%06d %llu %llu\n", (long long) r->sec, (int) r->usec,
+				(unsigned long long) rawOff, (unsigned long long) fileOff);
+		lastIndex = rawOff;
+	}
+
+	n = snprintf(buf, 32, "%lld.%06d ", (long long) r->sec, (int) r->usec);
+	for(i = 0; i < r->len; i++)
+	{
+		unsigned char c = p[i];
+
+		if((c < 0x20 && c != '\t') || c == 0x7f || c == '\\')
+		{
+			buf[n++] = '\\';
+			if(c == '\\')
+				buf[n++] = '\\';
+			else
+			{
+				buf[n++] = 'x';
+				buf[n++] = hex[c >> 4];
+				buf[n++] = hex[c & 15];
+			}
+		}
+		else
+			buf[n++] = c;
+	}
+	buf[n++] = '\n';
+
+	if(emit(buf, n, 0) != 0)
+		fprintf(stderr, "Capture: error writing %s\r\n", outName);
+	rawOff += n;
+	rawTotal += n;
+	records++;
+}
+
+
+static void * writerThread(void * arg)
+{
+	unsigned char data[CAPTURE_LINE];
+
+	rtHelperThread();
+	while(1)
+	{
+		uint64_t h = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+		int last = stop;
+
+		while(tail != h)
+		{
+			struct record r;
+
+			queueRead(tail, &r, sizeof(r));
+			queueRead(tail + sizeof(r), data, r.len);
+			writeRecord(&r, data);
+			__atomic_store_n(&tail, tail + sizeof(r) + r.len, __ATOMIC_RELEASE);
+		}
+		if(last)
+			break;
+		if(out)
+			fflush(out);
+		usleep(CAPTURE_POLL);
+	}
+	closeFile();
+	return NULL;
+}
+
+
+int captureInit(const char * name, unsigned long long bytes, unsigned secs, int lvl)
+{
+#ifndef HAVE_ZSTD
+	if(lvl)
+	{
+		fprintf(stderr, "This build of OpenRS has no zstd support (HAVE_ZSTD)\r\n");
+		return -1;
+	}
+#else
+	if(lvl)
+	{
+		zc = ZSTD_createCCtx();
+		zbufSize = ZSTD_CStreamOutSize();
+		zbuf = malloc(zbufSize);
+		if(zc == NULL || zbuf == NULL)
+			return -1;
+		ZSTD_CCtx_setParameter(zc, ZSTD_c_compressionLevel, lvl);
+	}
+#endif
+	base = strdup(name);
+	queue = malloc(CAPTURE_QUEUE);
+	if(base == NULL || queue == NULL)
+		return -1;
+	rotateBytes = bytes;
+	rotateSecs = secs;
+	level = lvl;
+	idleTimer.fn = idleExpired;
+
+	if(pthread_create(&writer, NULL, writerThread, NULL) != 0)
+	{
+		perror("pthread_create");
+		return -1;
+	}
+	captureOn = 1;
+	return 0;
+}
+
+
+void captureClose(void)
+{
+	if(!captureOn)
+		return;
+	if(lineLen)
+		commit();
+	captureOn = 0;
+	stop = 1;
+	pthread_join(writer, NULL);
+	timerDel(&idleTimer);
+	captureStatsPrint(stdout);
+}
+
+
+void captureStatsPrint(FILE * f)
+{
+	fprintf(f, "Capture: %llu lines, %llu bytes in %u files, %u lines dropped\r\n",
+			(unsigned long long) records, (unsigned long long) rawTotal, files, dropped);
+	if(level && rawTotal)
+		fprintf(f, "Capture: compressed to %.1f%%\r\n", (fileTotal + fileOff) * 100.0 / rawTotal);
+}
@@ -0,0 +1,33 @@
+/*
+ ============================================================================
+ Name        : capture.h
+ Author      : F. Erckenbrecht / dg1yfe
+ Copyright   : GPL
+ Description : Capture of the TNC console output (monitor) to rotating,
+               optionally compressed logs with a time stamp index
+ ============================================================================
+ */
+
+#ifndef CAPTURE_H_
+#define CAPTURE_H_
+
+#include <stdio.h>
+
+/*
+ * Every console line becomes a record "<sec>.<usec> <line>", control
+ * characters escaped as \xNN. A writer thread appends the records to
+ * <base>-<date>-<time>.log (.log.zst if compressed), a new file is started
+ * after rotateBytes of records or rotateSecs (0: no limit). <file>.idx
+ * lists "<sec>.<usec> <record offset> <file offset>" every 64 KiB;
+ * compressed logs start a new zstd frame there, so decompression can
+ * start at any entry. The session loop never waits for the writer,
+ * records that do not fit into the queue are counted as dropped.
+ */
+int captureInit(const char * base, unsigned long long rotateBytes, unsigned rotateSecs, int level);
+void captureByte(int c);
+void captureClose(void);
+void captureStatsPrint(FILE * f);
+
+extern int captureOn;
+
+#endif /* CAPTURE_H_ */
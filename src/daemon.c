@@ -0,0 +1,464 @@
+/*
+ ============================================================================
+ Name        : daemon.c
+ Author      : F. Erckenbrecht / dg1yfe
+ Copyright   : GPL
+ Description : Keep the port open and take commands from clients on a Unix
+               domain socket
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <termios.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "OpenRS.h"
+#include "daemon.h"
+#include "transport.h"
+#include "timer.h"
+#include "rt.h"
+#include "cache.h"
+#include "store.h"
+
+#define DAEMON_CLIENTS	16
+#define DAEMON_LINE		1024
+#define DAEMON_OUTMAX	(1024*1024)	// console output queued for a client that does not read
+
+enum { CL_FREE, CL_NEW, CL_WAIT, CL_CMD, CL_ATTACH, CL_CLOSE };
+
+struct client {
+	int			fd;
+	int			mode;
+	char		in[DAEMON_LINE];	// request line, then ATTACH keystrokes
+	size_t		inLen;
+	char *		out;
+	size_t		outLen;
+	size_t		outCap;
+	int			quiet;				// CMD: ms
+	char *		text;
+};
+
+static struct client cl[DAEMON_CLIENTS];
+static int listenFd = -1;
+static const char * sockPath;
+static const char * portName;
+static int portBitrate;
+static time_t started;
+static int active = -1;				// client whose CMD is running
+static uint64_t lastOutput;
+static uint32_t commands;
+
+
+static void queue(struct client * c, const void * p, size_t n)
+{
+	if(c->outLen + n > c->outCap)
+	{
+		size_t cap = c->outCap ? c->outCap : 4096;
+		char * o;
+
+		while(cap < c->outLen + n)
+			cap *= 2;
+		if(cap > DAEMON_OUTMAX || (o = realloc(c->out, cap)) == NULL)
+		{
+			c->mode = CL_CLOSE;		// slow reader, drop it
+			c->outLen = 0;
+			return;
+		}
+		c->out = o;
+		c->outCap = cap;
+	}
+	memcpy(c->out + c->outLen, p, n);
+	c->outLen += n;
+}
+
+
+static void dropClient(struct client * c)
+{
+	close(c->fd);
+	free(c->out);
+	free(c->text);
+	if(active == c - cl)
+		active = -1;
+	memset(c, 0, sizeof(*c));
+}
+
+
+/*
+ * TNC console output (consoleTap)
+ */
+static void daemonTap(int ch)
+{
+	char b = (char) ch;
+	int i;
+
+	for(i = 0; i < DAEMON_CLIENTS; i++)
+	{
+		if(cl[i].mode == CL_ATTACH || (cl[i].mode == CL_CMD && i == active))
+			queue(&cl[i], &b, 1);
+	}
+	lastOutput = timerNow();
+}
+
+
+static void status(struct client * c)
+{
+	char * buf = NULL;
+	size_t len = 0;
+	FILE * f = open_memstream(&buf, &len);
+	int open = 0;
+	int attached = 0;
+	int waiting = 0;
+	int i;
+
+	if(f == NULL)
+		return;
+	for(i = 0; i < MAXFPTR; i++)
+	{
+		if(File[i])
+			open++;
+	}
+	for(i = 0; i < DAEMON_CLIENTS; i++)
+	{
+		attached += cl[i].mode == CL_ATTACH;
+		waiting += cl[i].mode == CL_WAIT;
+	}
+	fprintf(f, "Port %s, %d bps, up %ld s, %s\r\n", portName, portBitrate, (long) (time(NULL) - started),
+			protocolIdle() ? "idle" : "request in progress");
+	fprintf(f, "Sent %u bytes, received %u bytes, last data %ld s ago\r\n", portTxBytes, portRxBytes,
+			portLastRx ? (long) (time(NULL) - portLastRx) : -1L);
+	fprintf(f, "%d files open, %u commands run, %d waiting, %d consoles attached\r\n",
+			open, commands, waiting, attached);
+	protoStatsPrint(f);
+	rtStatsPrint(f);
+	cacheStatsPrint(f);
+	storeStatsPrint(f);
+	fclose(f);
+	queue(c, buf, len);
+	free(buf);
+}
+
+
+static void request(struct client * c)
+{
+	char * nl = memchr(c->in, '\n', c->inLen);
+	char * arg;
+	size_t used;
+
+	if(nl == NULL)
+	{
+		if(c->inLen == sizeof(c->in))
+			c->mode = CL_CLOSE;
+		return;
+	}
+	*nl = 0;
+	if(nl > c->in && nl[-1] == '\r')
+		nl[-1] = 0;
+	used = nl + 1 - c->in;
+
+	if(strcmp(c->in, "STATUS") == 0)
+	{
+		status(c);
+		c->mode = CL_CLOSE;
+	}
+	else
+	if(strcmp(c->in, "ATTACH") == 0)
+	{
+		c->mode = CL_ATTACH;
+	}
+	else
+	if(strncmp(c->in, "CMD ", 4) == 0)
+	{
+		c->quiet = (int) strtol(c->in + 4, &arg, 10);
+		if(*arg == ' ')
+			arg++;
+		c->text = strdup(arg);
+		c->mode = c->text ? CL_WAIT : CL_CLOSE;
+	}
+	else
+	{
+		queue(c, "ERROR unknown request\r\n", 23);
+		c->mode = CL_CLOSE;
+	}
+
+	// whatever followed the line are the first keystrokes
+	memmove(c->in, c->in + used, c->inLen - used);
+	c->inLen -= used;
+}
+
+
+static void daemonExit(void)
+{
+	if(listenFd != -1)
+	{
+		close(listenFd);
+		unlink(sockPath);
+	}
+}
+
+
+/*
+ * Called from the session loop
+ */
+static int daemonPoll(void)
+{
+	uint64_t now = timerNow();
+	int fd;
+	int i;
+
+	while((fd = accept(listenFd, NULL, NULL)) != -1)
+	{
+		for(i = 0; i < DAEMON_CLIENTS && cl[i].mode != CL_FREE; i++)
+			;
+		if(i == DAEMON_CLIENTS)
+		{
+			close(fd);
+			continue;
+		}
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		cl[i].fd = fd;
+		cl[i].mode = CL_NEW;
+	}
+
+	for(i = 0; i < DAEMON_CLIENTS; i++)
+	{
+		struct client * c = &cl[i];
+		ssize_t n;
+
+		if(c->mode == CL_FREE)
+			continue;
+
+		if(c->mode != CL_CLOSE && c->inLen < sizeof(c->in))
+		{
+			n = read(c->fd, c->in + c->inLen, sizeof(c->in) - c->inLen);
+			if(n == 0 || (n == -1 && errno != EAGAIN && errno != EINTR))
+			{
+				dropClient(c);
+				continue;
+			}
+			if(n > 0)
+				c->inLen += n;
+		}
+		if(c->mode == CL_NEW)
+			request(c);
+
+		// keystrokes never go out in the middle of a protocol response
+		if(c->mode == CL_ATTACH && c->inLen && protocolIdle())
+		{
+			portConsole(c->in, c->inLen);
+			c->inLen = 0;
+		}
+	}
+
+	// one command at a time, the next one starts when the console is quiet
+	if(active == -1 && protocolIdle())
+	{
+		for(i = 0; i < DAEMON_CLIENTS; i++)
+		{
+			if(cl[i].mode == CL_WAIT)
+			{
+				active = i;
+				cl[i].mode = CL_CMD;
+				lastOutput = now;
+				commands++;
+				sendCommand(cl[i].text);
+				break;
+			}
+		}
+	}
+	if(active != -1)
+	{
+		struct client * c = &cl[active];
+		int busy = !protocolIdle();
+
+		for(i = 0; i < MAXFPTR && !busy; i++)
+			busy = File[i] != NULL;
+		if(busy)
+			lastOutput = now;
+		else
+		if(now - lastOutput >= (uint64_t) c->quiet)
+		{
+			c->mode = CL_CLOSE;
+			active = -1;
+		}
+	}
+
+	for(i = 0; i < DAEMON_CLIENTS; i++)
+	{
+		struct client * c = &cl[i];
+
+		if(c->mode == CL_FREE)
+			continue;
+		if(c->outLen)
+		{
+			ssize_t n = write(c->fd, c->out, c->outLen);
+
+			if(n == -1 && errno != EAGAIN && errno != EINTR)
+			{
+				dropClient(c);
+				continue;
+			}
+			if(n > 0)
+			{
+				memmove(c->out, c->out + n, c->outLen - n);
+				c->outLen -= n;
+			}
+		}
+		if(c->mode == CL_CLOSE && c->outLen == 0)
+			dropClient(c);
+	}
+	return 0;
+}
+
+
+static int sockAddr(const char * path, struct sockaddr_un * sa)
+{
+	memset(sa, 0, sizeof(*sa));
+	sa->sun_family = AF_UNIX;
+	if(strlen(path) >= sizeof(sa->sun_path))
+	{
+		fprintf(stderr, "Socket path %s is too long\r\n", path);
+		return -1;
+	}
+	strcpy(sa->sun_path, path);
+	return 0;
+}
+
+
+int daemonRun(const char * path, const char * port, int bitrate)
+{
+	struct sockaddr_un sa;
+
+	if(sockAddr(path, &sa) != 0)
+		return 1;
+	listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(listenFd == -1)
+	{
+		perror("socket");
+		return 1;
+	}
+	// a socket left behind by a daemon that is gone is replaced
+	{
+		int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+
+		if(probe != -1 && connect(probe, (struct sockaddr *) &sa, sizeof sa) == 0)
+		{
+			fprintf(stderr, "A daemon is already listening on %s\r\n", path);
+			return 1;
+		}
+		if(probe != -1)
+			close(probe);
+	}
+	unlink(path);
+	if(bind(listenFd, (struct sockaddr *) &sa, sizeof sa) != 0 || listen(listenFd, 8) != 0)
+	{
+		fprintf(stderr, "Can't listen on %s (%s)\r\n", path, strerror(errno));
+		return 1;
+	}
+	fcntl(listenFd, F_SETFL, fcntl(listenFd, F_GETFL) | O_NONBLOCK);
+	signal(SIGPIPE, SIG_IGN);
+
+	sockPath = path;
+	portName = port;
+	portBitrate = bitrate;
+	started = time(NULL);
+	atexit(daemonExit);
+	consoleTap = daemonTap;
+
+	printf("Serving %s on %s\r\n", port, path);
+	fflush(stdout);
+	return sessionLoop(0, daemonPoll);
+}
+
+
+int daemonClient(const char * path, int status, int quiet, int argc, char * argv[])
+{
+	struct sockaddr_un sa;
+	struct termios org, raw;
+	char buf[4096];
+	int attach = !status && argc == 0;
+	int restore = 0;
+	int fd;
+	int n;
+	int i;
+
+	if(sockAddr(path, &sa) != 0)
+		return 2;
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(fd == -1 || connect(fd, (struct sockaddr *) &sa, sizeof sa) != 0)
+	{
+		fprintf(stderr, "Can't connect to %s (%s)\r\n", path, strerror(errno));
+		return 2;
+	}
+
+	if(status)
+		n = snprintf(buf, sizeof buf, "STATUS\n");
+	else
+	if(attach)
+		n = snprintf(buf, sizeof buf, "ATTACH\n");
+	else
+	{
+		n = snprintf(buf, sizeof buf, "CMD %d", quiet);
+		for(i = 0; i < argc && n < (int) sizeof(buf) - 1; i++)
+			n += snprintf(buf + n, sizeof(buf) - n, " %s", argv[i]);
+		if(n < (int) sizeof(buf) - 1)
+			n += snprintf(buf + n, sizeof(buf) - n, "\n");
+	}
+	if(n >= (int) sizeof(buf) || write(fd, buf, n) != n)
+	{
+		fprintf(stderr, "Can't send the request\r\n");
+		return 2;
+	}
+
+	if(attach && isatty(0) && tcgetattr(0, &org) == 0)
+	{
+		raw = org;
+		cfmakeraw(&raw);
+		tcsetattr(0, TCSANOW, &raw);
+		restore = 1;
+		fprintf(stderr, "Attached to %s, exit with CTRL-C\r\n", path);
+	}
+
+	while(1)
+	{
+		struct pollfd p[2] = { { fd, POLLIN, 0 }, { 0, POLLIN, 0 } };
+
+		if(poll(p, attach ? 2 : 1, -1) < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			break;
+		}
+		if(p[0].revents)
+		{
+			n = read(fd, buf, sizeof buf);
+			if(n <= 0 || write(1, buf, n) != n)
+				break;
+		}
+		if(attach && p[1].revents)
+		{
+			n = read(0, buf, sizeof buf);
+			if(n <= 0 || (restore && memchr(buf, 0x03, n)))
+				break;
+			if(write(fd, buf, n) != n)
+				break;
+		}
+	}
+
+	if(restore)
+	{
+		tcsetattr(0, TCSANOW, &org);
+		fprintf(stderr, "\r\n");
+	}
+	close(fd);
+	return 0;
+}
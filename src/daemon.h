@@ -0,0 +1,30 @@
+/*
+ ============================================================================
+ Name        : daemon.h
+ Author      : F. Erckenbrecht / dg1yfe
+ Copyright   : GPL
+ Description : Keep the port open and take commands from clients on a Unix
+               domain socket
+ ============================================================================
+ */
+
+#ifndef DAEMON_H_
+#define DAEMON_H_
+
+/*
+ * A client sends one line:
+ *
+ *   CMD <quiet ms> <text>   type text on the TNC console and receive the
+ *                           console output until it has been quiet for
+ *                           <quiet ms> and no file request is running
+ *   ATTACH                  interactive console, raw bytes both ways
+ *   STATUS                  port, traffic, open files and statistics
+ *
+ * Commands of several clients are run one after the other. The client
+ * sends the words in argv as CMD, STATUS if status is set and ATTACH if
+ * there are no words.
+ */
+int daemonRun(const char * path, const char * port, int bitrate);	// port is open
+int daemonClient(const char * path, int status, int quiet, int argc, char * argv[]);
+
+#endif /* DAEMON_H_ */
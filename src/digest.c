@@ -0,0 +1,327 @@
+/*
+ ============================================================================
+ Name        : digest.c
+ Author      : F. Erckenbrecht / dg1yfe
+ Copyright   : GPL
+ Description : CRC32C / SHA-256 of the file data moved through a handle,
+               computed while it is transferred
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#endif
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+#include "OpenRS.h"
+#include "digest.h"
+#include "dlog.h"
+
+struct digest {
+	uint32_t		crc;
+	int				moved;		// repositioned, checksums are of the transfer
+	char			mode[8];
+	struct sha256 *	sha;
+	char			name[];
+};
+
+static int enabled = 0;
+static int useSha = 0;
+static FILE * manifest = NULL;
+static uint32_t crcTable[8][256];
+static uint32_t (*crcUpdate)(uint32_t crc, const unsigned char * p, size_t n);
+
+
+/*
+ * Slicing-by-8, used if the CPU has no CRC32C instruction
+ */
+static uint32_t crc32cSw(uint32_t crc, const unsigned char * p, size_t n)
+{
+	for(; n >= 8; n -= 8, p += 8)
+	{
+		uint32_t lo = crc ^ (p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24));
+		uint32_t hi = p[4] | (p[5] << 8) | (p[6] << 16) | ((uint32_t) p[7] << 24);
+
+		crc = crcTable[7][lo & 0xff] ^ crcTable[6][(lo >> 8) & 0xff] ^
+			crcTable[5][(lo >> 16) & 0xff] ^ crcTable[4][lo >> 24] ^
+			crcTable[3][hi & 0xff] ^ crcTable[2][(hi >> 8) & 0xff] ^
+			crcTable[1][(hi >> 16) & 0xff] ^ crcTable[0][hi >> 24];
+	}
+	while(n--)
+		crc = crcTable[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32cHw(uint32_t crc, const unsigned char * p, size_t n)
+{
+#ifdef __x86_64__
+	uint64_t c = crc;
+
+	for(; n >= 8; n -= 8, p += 8)
+	{
+		uint64_t v;
+
+		memcpy(&v, p, 8);
+		c = _mm_crc32_u64(c, v);
+	}
+	crc = (uint32_t) c;
+#endif
+	for(; n >= 4; n -= 4, p += 4)
+	{
+		uint32_t v;
+
+		memcpy(&v, p, 4);
+		crc = _mm_crc32_u32(crc, v);
+	}
+	while(n--)
+		crc = _mm_crc32_u8(crc, *p++);
+	return crc;
+}
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+static uint32_t crc32cHw(uint32_t crc, const unsigned char * p, size_t n)
+{
+	for(; n >= 8; n -= 8, p += 8)
+	{
+		uint64_t v;
+
+		memcpy(&v, p, 8);
+		crc = __crc32cd(crc, v);
+	}
+	while(n--)
+		crc = __crc32cb(crc, *p++);
+	return crc;
+}
+#endif
+
+
+static void crcInit(void)
+{
+	int i, j;
+
+	for(i = 0; i < 256; i++)
+	{
+		uint32_t c = i;
+
+		for(j = 0; j < 8; j++)
+			c = (c >> 1) ^ (c & 1 ? 0x82f63b78 : 0);
+		crcTable[0][i] = c;
+	}
+	for(i = 0; i < 256; i++)
+	{
+		for(j = 1; j < 8; j++)
+			crcTable[j][i] = crcTable[0][crcTable[j-1][i] & 0xff] ^ (crcTable[j-1][i] >> 8);
+	}
+
+	crcUpdate = crc32cSw;
+#if defined(__x86_64__) || defined(__i386__)
+	if(__builtin_cpu_supports("sse4.2"))
+		crcUpdate = crc32cHw;
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+	crcUpdate = crc32cHw;
+#endif
+}
+
+
+uint32_t crc32c(uint32_t crc, const void * p, size_t n)
+{
+	if(crcUpdate == NULL)
+		crcInit();
+	return ~crcUpdate(~crc, p, n);
+}
+
+
+static const uint32_t shaK[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR(x, n)	(((x) >> (n)) | ((x) << (32 - (n))))
+
+
+static void shaBlock(struct sha256 * s, const unsigned char * p)
+{
+	uint32_t w[64];
+	uint32_t a, b, c, d, e, f, g, h;
+	int i;
+
+	for(i = 0; i < 16; i++)
+		w[i] = ((uint32_t) p[4*i] << 24) | (p[4*i+1] << 16) | (p[4*i+2] << 8) | p[4*i+3];
+	for(; i < 64; i++)
+	{
+		uint32_t s0 = ROR(w[i-15], 7) ^ ROR(w[i-15], 18) ^ (w[i-15] >> 3);
+		uint32_t s1 = ROR(w[i-2], 17) ^ ROR(w[i-2], 19) ^ (w[i-2] >> 10);
+
+		w[i] = w[i-16] + s0 + w[i-7] + s1;
+	}
+
+	a = s->h[0]; b = s->h[1]; c = s->h[2]; d = s->h[3];
+	e = s->h[4]; f = s->h[5]; g = s->h[6]; h = s->h[7];
+	for(i = 0; i < 64; i++)
+	{
+		uint32_t t1 = h + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) + ((e & f) ^ (~e & g)) + shaK[i] + w[i];
+		uint32_t t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+
+		h = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+	s->h[0] += a; s->h[1] += b; s->h[2] += c; s->h[3] += d;
+	s->h[4] += e; s->h[5] += f; s->h[6] += g; s->h[7] += h;
+}
+
+
+void sha256Init(struct sha256 * s)
+{
+	static const uint32_t h0[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+
+	memcpy(s->h, h0, sizeof(h0));
+	s->len = 0;
+	s->fill = 0;
+}
+
+
+void sha256Update(struct sha256 * s, const void * data, size_t n)
+{
+	const unsigned char * p = data;
+
+	s->len += n;
+	if(s->fill)
+	{
+		size_t k = 64 - s->fill < n ? 64 - s->fill : n;
+
+		memcpy(s->buf + s->fill, p, k);
+		s->fill += k;
+		p += k;
+		n -= k;
+		if(s->fill < 64)
+			return;
+		shaBlock(s, s->buf);
+		s->fill = 0;
+	}
+	for(; n >= 64; n -= 64, p += 64)
+		shaBlock(s, p);
+	memcpy(s->buf, p, n);
+	s->fill = n;
+}
+
+
+void sha256Final(struct sha256 * s, char hex[65])
+{
+	uint64_t bits = s->len * 8;
+	unsigned char pad[72] = { 0x80 };
+	size_t n = (s->fill < 56 ? 56 : 120) - s->fill;
+	int i;
+
+	for(i = 0; i < 8; i++)
+		pad[n + i] = bits >> (56 - 8 * i);
+	sha256Update(s, pad, n + 8);
+	for(i = 0; i < 8; i++)
+		sprintf(hex + 8 * i, "%08x", s->h[i]);
+}
+
+
+int digestInit(const char * path, int sha256)
+{
+	crc32c(0, NULL, 0);
+	enabled = 1;
+	useSha = sha256;
+	if(path)
+	{
+		manifest = fopen(path, "a");
+		if(manifest == NULL)
+			return -1;
+		setvbuf(manifest, NULL, _IOLBF, 0);
+	}
+	return 0;
+}
+
+
+void digestOpen(int h, const char * name, const char * mode)
+{
+	struct digest * d;
+
+	digestClose(h);
+	if(!enabled)
+		return;
+
+	d = malloc(sizeof(*d) + strlen(name) + 1);
+	if(d == NULL)
+		return;
+	d->crc = ~0U;
+	d->moved = 0;
+	snprintf(d->mode, sizeof(d->mode), "%s", mode);
+	strcpy(d->name, name);
+	d->sha = NULL;
+	if(useSha)
+	{
+		d->sha = malloc(sizeof(*d->sha));
+		if(d->sha)
+			sha256Init(d->sha);
+	}
+	Handle[h].digest = d;
+}
+
+
+void digestUpdate(struct digest * d, const void * p, size_t n)
+{
+	d->crc = crcUpdate(d->crc, p, n);
+	if(d->sha)
+		sha256Update(d->sha, p, n);
+}
+
+
+void digestSeek(int h)
+{
+	if(Handle[h].digest)
+		Handle[h].digest->moved = 1;
+}
+
+
+void digestClose(int h)
+{
+	struct digest * d = Handle[h].digest;
+	char sha[65] = "-";
+	char date[32];
+	time_t now;
+	struct tm tm;
+
+	if(d == NULL)
+		return;
+	Handle[h].digest = NULL;
+
+	if(d->sha)
+		sha256Final(d->sha, sha);
+	printf("File %s closed, %llu bytes, CRC32C %08x%s%s%s\r\n", d->name,
+			(unsigned long long) Handle[h].bytes, ~d->crc,
+			d->sha ? ", SHA-256 " : "", d->sha ? sha : "",
+			d->moved ? " (repositioned)" : "");
+	DLOGS(DLOG_REQUEST, "digest %s: crc32c %08x, %u bytes", d->name, ~d->crc, (uint32_t) Handle[h].bytes);
+
+	if(manifest)
+	{
+		now = time(NULL);
+		localtime_r(&now, &tm);
+		strftime(date, sizeof date, "%Y-%m-%dT%H:%M:%S", &tm);
+		fprintf(manifest, "%08x %s %llu %s%s %s %s\n", ~d->crc, sha,
+				(unsigned long long) Handle[h].bytes, d->mode, d->moved ? "*" : "", date, d->name);
+	}
+	free(d->sha);
+	free(d);
+}
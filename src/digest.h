@@ -0,0 +1,61 @@
+/*
+ ============================================================================
+ Name        : digest.h
+ Author      : F. Erckenbrecht / dg1yfe
+ Copyright   : GPL
+ Description : CRC32C / SHA-256 of the file data moved through a handle,
+               computed while it is transferred
+ ============================================================================
+ */
+
+#ifndef DIGEST_H_
+#define DIGEST_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "OpenRS.h"
+#include "store.h"
+
+struct digest;
+
+struct sha256 {
+	uint32_t		h[8];
+	uint64_t		len;
+	unsigned char	buf[64];
+	size_t			fill;
+};
+
+/*
+ * Checksums are off until digestInit() is called. The results of every
+ * closed handle are printed and appended to the manifest (if not NULL):
+ *
+ *   <crc32c> <sha256 or -> <bytes> <mode> <date> <name>
+ *
+ * A '*' behind the mode marks a handle that was repositioned (FSEEK,
+ * UNGETC), its checksums cover the bytes as transferred, not the file.
+ */
+int digestInit(const char * manifest, int sha256);
+void digestOpen(int h, const char * name, const char * mode);
+void digestUpdate(struct digest * d, const void * p, size_t n);
+void digestSeek(int h);
+void digestClose(int h);
+
+uint32_t crc32c(uint32_t crc, const void * p, size_t n);
+void sha256Init(struct sha256 * s);
+void sha256Update(struct sha256 * s, const void * data, size_t n);
+void sha256Final(struct sha256 * s, char hex[65]);	// lower case hex, NUL terminated
+
+/*
+ * Account file data read from or written to handle h
+ */
+static inline void handleData(int h, const void * p, size_t n)
+{
+	Handle[h].bytes += n;
+	if(__builtin_expect(Handle[h].digest != NULL, 0))
+		digestUpdate(Handle[h].digest, p, n);
+	if(__builtin_expect(Handle[h].store != NULL, 0))
+		storeUpdate(Handle[h].store, p, n);
+}
+
+#endif /* DIGEST_H_ */
@@ -0,0 +1,369 @@
+/*
+ ============================================================================
+ Name        : dirscan.c
+ Author      : F. Erckenbrecht / dg1yfe
+ Copyright   : GPL
+ Description : Pipelined directory enumeration for FINDFIRST / FINDNEXT
+ ============================================================================
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sys/syscall.h>
+#endif
+
+#include "OpenRS.h"
+#include "dirscan.h"
+#include "rt.h"
+#include "nameidx.h"
+
+
+static void fillFileInfo(struct FileInfo * fi, const char * name, int isDir, uint64_t size, time_t mtime)
+{
+	memset(fi, 0, sizeof(*fi));
+	setFileInfoTime(fi, mtime);
+	if(isDir)
+	{
+		fi->attr = 0x10;
+	}
+	fi->filesize = (uint32_t) size;
+	nameAlias(name, fi->filename);
+}
+
+
+#ifdef __linux__
+
+#define DIRSCAN_THREADS	4		// concurrent stat calls
+#define DIRSCAN_WINDOW	256		// entries stat'ed ahead of the TNC
+
+struct linux_dirent64 {
+	uint64_t		d_ino;
+	int64_t			d_off;
+	unsigned short	d_reclen;
+	unsigned char	d_type;
+	char			d_name[];
+};
+
+struct dirEntry {
+	char *			name;
+	int				ready;
+	struct FileInfo	fi;
+};
+
+struct dirScan {
+	int					fd;
+	pthread_t			reader;
+	pthread_t			worker[DIRSCAN_THREADS];
+	int					nWorker;
+	int					readerRunning;
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	struct dirEntry *	entry;
+	size_t				count;		// names read so far
+	size_t				size;		// entries allocated
+	size_t				nextStat;	// next entry to stat
+	size_t				nextOut;	// next entry to hand to the TNC
+	int					eof;		// all names read
+	int					stop;
+};
+
+
+static void * dirScanReader(void * arg)
+{
+	struct dirScan * ds = arg;
+	char buf[32768];
+	long n;
+
+	rtHelperThread();
+
+	while(!ds->stop && (n = syscall(SYS_getdents64, ds->fd, buf, sizeof buf)) > 0)
+	{
+		long pos;
+
+		pthread_mutex_lock(&ds->lock);
+		for(pos = 0; pos < n;)
+		{
+			struct linux_dirent64 * d = (struct linux_dirent64 *) &buf[pos];
+			char * name;
+
+			pos += d->d_reclen;
+			if(ds->count == ds->size)
+			{
+				size_t size = ds->size ? ds->size * 2 : 256;
+				struct dirEntry * e = realloc(ds->entry, size * sizeof(*e));
+				if(e == NULL)
+					break;
+				ds->entry = e;
+				ds->size = size;
+			}
+			name = strdup(d->d_name);
+			if(name == NULL)
+				break;
+			ds->entry[ds->count].name = name;
+			ds->entry[ds->count].ready = 0;
+			ds->count++;
+		}
+		pthread_cond_broadcast(&ds->cond);
+		pthread_mutex_unlock(&ds->lock);
+	}
+
+	pthread_mutex_lock(&ds->lock);
+	ds->eof = 1;
+	pthread_cond_broadcast(&ds->cond);
+	pthread_mutex_unlock(&ds->lock);
+	return NULL;
+}
+
+
+static void * dirScanWorker(void * arg)
+{
+	struct dirScan * ds = arg;
+
+	rtHelperThread();
+	pthread_mutex_lock(&ds->lock);
+	while(1)
+	{
+		size_t idx;
+		char * name;
+		struct FileInfo fi;
+#ifdef STATX_TYPE
+		struct statx stx;
+#else
+		struct stat st;
+#endif
+
+		while(!ds->stop &&
+				(ds->nextStat >= ds->count || ds->nextStat >= ds->nextOut + DIRSCAN_WINDOW))
+		{
+			if(ds->eof && ds->nextStat >= ds->count)
+				break;
+			pthread_cond_wait(&ds->cond, &ds->lock);
+		}
+		if(ds->stop || ds->nextStat >= ds->count)
+			break;
+
+		idx = ds->nextStat++;
+		name = ds->entry[idx].name;
+		pthread_mutex_unlock(&ds->lock);
+
+#ifdef STATX_TYPE
+		// only what ends up in struct FileInfo, don't force a NFS revalidation
+		if(statx(ds->fd, name, AT_STATX_DONT_SYNC, STATX_TYPE | STATX_SIZE | STATX_MTIME, &stx) == 0)
+		{
+			fillFileInfo(&fi, name, S_ISDIR(stx.stx_mode), stx.stx_size, stx.stx_mtime.tv_sec);
+		}
+#else
+		if(fstatat(ds->fd, name, &st, 0) == 0)
+		{
+			fillFileInfo(&fi, name, S_ISDIR(st.st_mode), st.st_size, st.st_mtim.tv_sec);
+		}
+#endif
+		else
+		{
+			memset(&fi, 0, sizeof(fi));
+			nameAlias(name, fi.filename);
+		}
+
+		pthread_mutex_lock(&ds->lock);
+		ds->entry[idx].fi = fi;
+		ds->entry[idx].ready = 1;
+		pthread_cond_broadcast(&ds->cond);
+	}
+	pthread_mutex_unlock(&ds->lock);
+	return NULL;
+}
+
+
+struct dirScan * dirScanStart(const char * path)
+{
+	struct dirScan * ds;
+	int i;
+
+	ds = calloc(1, sizeof(*ds));
+	if(ds == NULL)
+		return NULL;
+
+	ds->fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if(ds->fd == -1)
+	{
+		free(ds);
+		return NULL;
+	}
+	pthread_mutex_init(&ds->lock, NULL);
+	pthread_cond_init(&ds->cond, NULL);
+
+	if(pthread_create(&ds->reader, NULL, dirScanReader, ds) != 0)
+	{
+		// no threads available, read the names right here
+		dirScanReader(ds);
+	}
+	else
+	{
+		ds->readerRunning = 1;
+	}
+
+	for(i = 0; i < DIRSCAN_THREADS; i++)
+	{
+		if(pthread_create(&ds->worker[ds->nWorker], NULL, dirScanWorker, ds) == 0)
+			ds->nWorker++;
+	}
+
+	return ds;
+}
+
+
+int dirScanNext(struct dirScan * ds, struct FileInfo * fi)
+{
+	int r = -1;
+
+	if(ds == NULL)
+		return -1;
+
+	pthread_mutex_lock(&ds->lock);
+	while(1)
+	{
+		if(ds->nextOut < ds->count && ds->entry[ds->nextOut].ready)
+		{
+			*fi = ds->entry[ds->nextOut].fi;
+			ds->nextOut++;
+			// window moved, let the workers continue
+			pthread_cond_broadcast(&ds->cond);
+			r = 0;
+			break;
+		}
+		if(ds->eof && ds->nextOut >= ds->count)
+			break;
+		if(ds->nWorker == 0 && ds->nextOut < ds->count)
+		{
+			// no worker threads, stat synchronously
+			struct stat st;
+			char * name = ds->entry[ds->nextOut].name;
+
+			if(fstatat(ds->fd, name, &st, 0) == 0)
+				fillFileInfo(&ds->entry[ds->nextOut].fi, name, S_ISDIR(st.st_mode), st.st_size, st.st_mtim.tv_sec);
+			else
+				fillFileInfo(&ds->entry[ds->nextOut].fi, name, 0, 0, 0);
+			ds->entry[ds->nextOut].ready = 1;
+			continue;
+		}
+		pthread_cond_wait(&ds->cond, &ds->lock);
+	}
+	pthread_mutex_unlock(&ds->lock);
+	return r;
+}
+
+
+void dirScanStop(struct dirScan * ds)
+{
+	int i;
+	size_t n;
+
+	if(ds == NULL)
+		return;
+
+	pthread_mutex_lock(&ds->lock);
+	ds->stop = 1;
+	pthread_cond_broadcast(&ds->cond);
+	pthread_mutex_unlock(&ds->lock);
+
+	if(ds->readerRunning)
+		pthread_join(ds->reader, NULL);
+	for(i = 0; i < ds->nWorker; i++)
+		pthread_join(ds->worker[i], NULL);
+
+	for(n = 0; n < ds->count; n++)
+		free(ds->entry[n].name);
+	free(ds->entry);
+	close(ds->fd);
+	pthread_cond_destroy(&ds->cond);
+	pthread_mutex_destroy(&ds->lock);
+	free(ds);
+}
+
+#else
+
+/*
+ * Fallback without getdents64/statx: plain readdir and stat per entry
+ */
+struct dirScan {
+	DIR *	dirp;
+	char *	path;
+};
+
+
+struct dirScan * dirScanStart(const char * path)
+{
+	struct dirScan * ds;
+
+	ds = calloc(1, sizeof(*ds));
+	if(ds == NULL)
+		return NULL;
+
+	ds->dirp = opendir(path);
+	ds->path = strdup(path);
+	if(ds->dirp == NULL || ds->path == NULL)
+	{
+		if(ds->dirp)
+			closedir(ds->dirp);
+		free(ds->path);
+		free(ds);
+		return NULL;
+	}
+	return ds;
+}
+
+
+int dirScanNext(struct dirScan * ds, struct FileInfo * fi)
+{
+	struct dirent * dir;
+	struct stat st;
+	char * name;
+
+	if(ds == NULL || (dir = readdir(ds->dirp)) == NULL)
+		return -1;
+
+	name = malloc(strlen(ds->path) + strlen(dir->d_name) + 2);
+	if(name == NULL)
+		return -1;
+	sprintf(name, "%s/%s", ds->path, dir->d_name);
+
+	if(stat(name, &st) == 0)
+	{
+#ifdef __APPLE__
+		fillFileInfo(fi, dir->d_name, S_ISDIR(st.st_mode), st.st_size, st.st_mtimespec.tv_sec);
+#else
+		fillFileInfo(fi, dir->d_name, S_ISDIR(st.st_mode), st.st_size, st.st_mtim.tv_sec);
+#endif
+	}
+	else
+	{
+		memset(fi, 0, sizeof(*fi));
+		nameAlias(dir->d_name, fi->filename);
+	}
+	free(name);
+	return 0;
+}
+
+
+void dirScanStop(struct dirScan * ds)
+{
+	if(ds == NULL)
+		return;
+	closedir(ds->dirp);
+	free(ds->path);
+	free(ds);
+}
+
+#endif
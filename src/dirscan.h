@@ -0,0 +1,28 @@
+/*
+ ============================================================================
+ Name        : dirscan.h
+ Author      : F. Erckenbrecht / dg1yfe
+ Copyright   : GPL
+ Description : Pipelined directory enumeration for FINDFIRST / FINDNEXT
+ ============================================================================
+ */
+
+#ifndef DIRSCAN_H_
+#define DIRSCAN_H_
+
+#include "OpenRS.h"
+
+/*
+ * dirScanStart() returns immediately and scans the directory in the
+ * background: one thread reads the names (getdents64), a small pool of
+ * threads stats them (statx, size/mtime/type only). dirScanNext() hands
+ * out the entries in directory order and only blocks if the entry has not
+ * been stat'ed yet.
+ */
+struct dirScan;
+
+struct dirScan * dirScanStart(const char * path);
+int dirScanNext(struct dirScan * ds, struct FileInfo * fi);	// 0: entry, -1: end of directory
+void dirScanStop(struct dirScan * ds);
+
+#endif /* DIRSCAN_H_ */
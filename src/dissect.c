@@ -0,0 +1,942 @@
+/*
+ ============================================================================
+ Name        : dissect.c
+ Author      : F. Erckenbrecht / dg1yfe
+ Copyright   : GPL
+ Description : Offline dissector for wire captures (-T): one record per
+               request, kept in an index that queries run on
+ ============================================================================
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "OpenRS.h"
+#include "dissect.h"
+#include "wire.h"
+#include "trace.h"
+#include "fastread.h"
+
+#define DIX_MAGIC	"ORSDIX1"
+#define DIX_EXT		".dix"
+#define DIX_NAME	32
+#define MAX_TERMS	16
+#define CMD_NONE	0xff
+
+enum { ARG_END, ARG_STR1, ARG_STR2, ARG_DW, ARG_W, ARG_FD, ARG_DATA };
+enum { RSP_NONE, RSP_W, RSP_DW, RSP_READ, RSP_GETS, RSP_FIND };
+enum { DIX_OK, DIX_ABANDONED, DIX_INCOMPLETE };
+enum { D_IDLE, D_CMD, D_ARGS, D_RESPONSE };
+
+// arguments in the order protocolHandler() reads them, and the response
+static const struct {
+	char	args[4];
+	char	rsp;
+} layout[] = {
+	[CMD_FOPEN]		= { { ARG_STR1, ARG_STR2 }, RSP_DW },
+	[CMD_FREAD]		= { { ARG_DW, ARG_FD }, RSP_READ },
+	[CMD_FWRITE]	= { { ARG_FD, ARG_DATA }, RSP_NONE },
+	[CMD_FCLOSE]	= { { ARG_FD }, RSP_W },
+	[CMD_FGETC]		= { { ARG_FD }, RSP_W },
+	[CMD_FPUTC]		= { { ARG_FD, ARG_W }, RSP_W },
+	[CMD_FGETS]		= { { ARG_FD, ARG_W }, RSP_GETS },
+	[CMD_FPUTS]		= { { ARG_FD, ARG_STR1 }, RSP_W },
+	[CMD_FINDFIRST]	= { { ARG_STR1, ARG_W }, RSP_FIND },
+	[CMD_FINDNEXT]	= { { ARG_END }, RSP_FIND },
+	[CMD_REMOVE]	= { { ARG_STR1 }, RSP_NONE },
+	[CMD_RENAME]	= { { ARG_STR1, ARG_STR2 }, RSP_NONE },
+	[CMD_FTELL]		= { { ARG_FD }, RSP_DW },
+	[CMD_FSEEK]		= { { ARG_FD, ARG_DW, ARG_W }, RSP_W },
+	[CMD_UNGETC]	= { { ARG_W, ARG_STR1 }, RSP_W },
+};
+
+static const char * statusName[] = { "ok", "abandoned", "incomplete" };
+
+struct dixHeader {
+	char		magic[8];
+	uint64_t	capSize;		// the capture the index was made from
+	int64_t		capMtime;
+	uint64_t	count;			// records
+	uint64_t	rxConsole;		// console bytes outside of requests
+	uint64_t	txConsole;
+	uint32_t	abandoned;
+	uint32_t	unknown;
+	struct wireHeader wire;
+};
+
+struct dixRecord {
+	uint64_t	start;		// usec since the epoch, the 0x02
+	uint64_t	off;		// capture offset of the wire record with the 0x02
+	uint32_t	dur;		// usec to the last byte of the response
+	uint32_t	host;		// usec from the last argument byte to the last response byte
+	uint32_t	arg;		// FREAD count, FSEEK offset, FPUTC/FGETS/UNGETC word, FINDFIRST attribute
+	int32_t		result;		// DWORD or WORD response, FREAD data bytes
+	uint32_t	data;		// file data moved
+	uint32_t	rx;			// bytes on the wire from the TNC
+	uint32_t	tx;			// and to it
+	uint16_t	handle;		// 0: none
+	uint8_t		cmd;
+	uint8_t		status;
+	char		name[DIX_NAME];	// file name, of the handle if not in the request
+};
+
+struct decoder {
+	FILE *		out;
+	struct dixHeader hdr;
+	struct dixRecord rec;
+	int			state;
+	int			rxEsc;
+	int			txEsc;
+	int			arg;		// index into layout[].args
+	int			n;			// bytes of the current argument or response field
+	uint32_t	val;
+	int			ack;		// 0x03 for the command seen
+	int			phase;		// of the response
+	uint32_t	items;		// FREAD bytes answered
+	uint64_t	argsDone;
+	uint64_t	last;		// time of the last byte of the request
+	char		str[PATH_MAX];
+	size_t		strLen;
+	char		names[MAXFPTR+1][DIX_NAME];	// by handle, from FOPEN
+};
+
+struct term {
+	int			field;
+	int			op;
+	double		value;
+	uint32_t	cmdMask;
+	char		pattern[64];
+};
+
+enum { F_CMD, F_NAME, F_STATUS, F_TIME, F_MS, F_HOSTMS, F_HANDLE, F_COUNT, F_RESULT, F_BYTES, F_RX, F_TX };
+enum { OP_EQ, OP_NE, OP_LT, OP_LE, OP_GT, OP_GE };
+
+static const char * fieldName[] = { "cmd", "name", "status", "time", "ms", "hostms",
+		"handle", "count", "result", "bytes", "rx", "tx" };
+
+
+// keep the end of long names, that is where the file name is
+static void nameSet(char * d, const char * s, size_t len)
+{
+	size_t l = len;
+
+	if(l >= DIX_NAME)
+	{
+		s += l - (DIX_NAME - 1);
+		l = DIX_NAME - 1;
+	}
+	memcpy(d, s, l);
+	d[l] = 0;
+}
+
+
+static void finish(struct decoder * d, int status)
+{
+	struct dixRecord * rec = &d->rec;
+
+	rec->status = status;
+	rec->dur = d->last - rec->start;
+	rec->host = d->argsDone ? d->last - d->argsDone : 0;
+	if(rec->cmd == CMD_FOPEN && status == DIX_OK && rec->result > 0 && rec->result <= MAXFPTR)
+	{
+		rec->handle = rec->result;
+		strcpy(d->names[rec->handle], rec->name);
+	}
+	if(status == DIX_ABANDONED)
+		d->hdr.abandoned++;
+	fwrite(rec, sizeof(*rec), 1, d->out);
+	d->hdr.count++;
+	if(rec->cmd == CMD_FCLOSE && rec->handle <= MAXFPTR)
+		d->names[rec->handle][0] = 0;
+	d->state = D_IDLE;
+}
+
+
+static void argStart(struct decoder * d)
+{
+	d->n = 0;
+	d->val = 0;
+	d->strLen = 0;
+	d->str[0] = 0;
+}
+
+
+static void argsComplete(struct decoder * d, uint64_t t)
+{
+	d->argsDone = t;
+	d->state = D_RESPONSE;
+	d->phase = 0;
+	d->n = 0;
+	d->val = 0;
+	d->items = 0;
+	if(d->ack && (layout[d->rec.cmd].rsp == RSP_NONE ||
+			(layout[d->rec.cmd].rsp == RSP_READ && d->rec.arg == 0)))
+		finish(d, DIX_OK);
+}
+
+
+static void argDone(struct decoder * d, uint64_t t)
+{
+	struct dixRecord * rec = &d->rec;
+	int type = layout[rec->cmd].args[d->arg];
+
+	switch(type)
+	{
+	case ARG_STR1:
+		if(rec->cmd == CMD_FPUTS)
+			rec->data = d->strLen;
+		else
+			nameSet(rec->name, d->str, strlen(d->str));
+		break;
+	case ARG_STR2:
+		if(rec->cmd == CMD_RENAME)
+			nameSet(rec->name, d->str, strlen(d->str));
+		break;
+	case ARG_DW:
+		rec->arg = d->val;
+		break;
+	case ARG_W:
+		if(rec->cmd != CMD_FSEEK)
+			rec->arg = d->val;
+		break;
+	case ARG_FD:
+		rec->handle = d->val >= 1 && d->val <= MAXFPTR ? d->val : 0xffff;
+		if(rec->handle <= MAXFPTR)
+			memcpy(rec->name, d->names[rec->handle], DIX_NAME);
+		break;
+	}
+	argStart(d);
+	if(layout[rec->cmd].args[++d->arg] == ARG_END)
+		argsComplete(d, t);
+}
+
+
+// a byte from the TNC, same decisions as protocolHandler()
+static void rxByte(struct decoder * d, char c, uint64_t t, uint64_t off)
+{
+	int r;
+
+	if(d->state != D_IDLE)
+	{
+		d->rec.rx++;
+		d->last = t;
+	}
+	r = escDecode(&d->rxEsc, c);
+	if(r == -1)
+		return;
+
+	if(r == -2 && c == 0x02)
+	{
+		if(d->state != D_IDLE)
+		{
+			d->rec.rx--;		// the 0x02 belongs to the next request
+			finish(d, DIX_ABANDONED);
+		}
+		memset(&d->rec, 0, sizeof(d->rec));
+		d->rec.cmd = CMD_NONE;		// until the command byte arrives
+		d->rec.start = t;
+		d->rec.off = off;
+		d->rec.rx = 1;
+		d->last = t;
+		d->argsDone = 0;
+		d->ack = 0;
+		d->state = D_CMD;
+		return;
+	}
+
+	switch(d->state)
+	{
+	case D_IDLE:
+		if(r >= 0)
+			d->hdr.rxConsole++;
+		break;
+	case D_CMD:
+		if(r >= CMD_FOPEN && r <= CMD_UNGETC)
+		{
+			d->rec.cmd = r;
+			d->arg = 0;
+			argStart(d);
+			d->state = D_ARGS;
+			if(layout[r].args[0] == ARG_END)
+				argsComplete(d, t);
+		}
+		else
+		{
+			d->hdr.unknown++;
+			d->state = D_IDLE;
+		}
+		break;
+	case D_ARGS:
+		switch(layout[d->rec.cmd].args[d->arg])
+		{
+		case ARG_STR1:
+		case ARG_STR2:
+			if(r == -2)
+				argDone(d, t);
+			else
+			{
+				if(d->strLen < sizeof(d->str) - 1)
+					d->str[d->strLen] = r;
+				d->str[++d->strLen < sizeof(d->str) ? d->strLen : sizeof(d->str) - 1] = 0;
+			}
+			break;
+		case ARG_DW:
+		case ARG_FD:
+		case ARG_W:
+			if(r != -2)
+			{
+				d->val = (d->val << 8) | (uint8_t) r;
+				if(++d->n == (layout[d->rec.cmd].args[d->arg] == ARG_W ? 2 : 4))
+					argDone(d, t);
+			}
+			break;
+		case ARG_DATA:
+			if(r == -2)
+				argsComplete(d, t);
+			else
+				d->rec.data++;
+			break;
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+
+// a byte to the TNC: the acknowledge, then the response
+static void txByte(struct decoder * d, char c, uint64_t t)
+{
+	struct dixRecord * rec = &d->rec;
+	int rsp;
+	int r;
+
+	if(d->state == D_IDLE || d->state == D_CMD || (d->ack && d->state != D_RESPONSE))
+	{
+		d->hdr.txConsole++;		// typed on the console
+		return;
+	}
+	rec->tx++;
+	d->last = t;
+	r = escDecode(&d->txEsc, c);
+	if(r == -1)
+		return;
+
+	if(!d->ack)
+	{
+		if(r == -2 && c == 0x03)
+		{
+			d->ack = 1;
+			if(d->state == D_RESPONSE && (layout[rec->cmd].rsp == RSP_NONE ||
+					(layout[rec->cmd].rsp == RSP_READ && rec->arg == 0)))
+				finish(d, DIX_OK);
+		}
+		return;
+	}
+
+	rsp = layout[rec->cmd].rsp;
+	switch(rsp)
+	{
+	case RSP_W:
+	case RSP_DW:
+		if(r < 0)
+			break;
+		d->val = (d->val << 8) | (uint8_t) r;
+		if(++d->n == (rsp == RSP_W ? 2 : 4))
+		{
+			rec->result = rsp == RSP_W ? (int16_t) d->val : (int32_t) d->val;
+			finish(d, DIX_OK);
+		}
+		break;
+	case RSP_READ:
+		if(r >= 0)
+			rec->data++;
+		rec->result = rec->data;
+		if(++d->items == rec->arg)
+			finish(d, DIX_OK);
+		break;
+	case RSP_GETS:
+	case RSP_FIND:
+		if(d->phase == 0)
+		{
+			if(r < 0)
+				break;
+			d->val = (d->val << 8) | (uint8_t) r;
+			if(++d->n < 2)
+				break;
+			rec->result = (int16_t) d->val;
+			d->n = 0;
+			d->phase = 1;
+			if((rsp == RSP_GETS && rec->result != 1) || (rsp == RSP_FIND && rec->result != 0))
+				finish(d, DIX_OK);
+		}
+		else
+		if(rsp == RSP_GETS)
+		{
+			if(r == -2)
+				finish(d, DIX_OK);
+			else
+				rec->data++;
+		}
+		else
+		{
+			// struct FileInfo as putfiEsc() sends it, the name is in the last 14 bytes
+			if(r < 0)
+				break;
+			if(d->n >= 10)
+				d->str[d->n - 10] = r;
+			if(++d->n == 24)
+			{
+				d->str[14] = 0;
+				if(rec->cmd == CMD_FINDNEXT || rec->name[0] == 0 || strpbrk(rec->name, "*?"))
+					nameSet(rec->name, d->str, strlen(d->str));
+				finish(d, DIX_OK);
+			}
+		}
+		break;
+	}
+}
+
+
+/*
+ * File data (FREAD response, FWRITE argument) without escapes is counted
+ * in one go, the bytes that need a decision go through rxByte()/txByte().
+ * Returns the bytes taken.
+ */
+static size_t dataRun(struct decoder * d, int tx, const unsigned char * p, size_t len, uint64_t t)
+{
+	size_t n;
+
+	if(tx)
+	{
+		if(d->state != D_RESPONSE || !d->ack || d->txEsc || layout[d->rec.cmd].rsp != RSP_READ)
+			return 0;
+		if(len > d->rec.arg - d->items)
+			len = d->rec.arg - d->items;
+	}
+	else
+	if(d->state != D_ARGS || d->rxEsc || layout[d->rec.cmd].args[d->arg] != ARG_DATA)
+		return 0;
+
+	n = findEscape(p, len);
+	if(n == 0)
+		return 0;
+	d->rec.data += n;
+	d->last = t;
+	if(tx)
+	{
+		d->rec.tx += n;
+		d->rec.result = d->rec.data;
+		d->items += n;
+		if(d->items == d->rec.arg)
+			finish(d, DIX_OK);
+	}
+	else
+		d->rec.rx += n;
+	return n;
+}
+
+
+static char * indexName(const char * file, char * buf, size_t len)
+{
+	snprintf(buf, len, "%s" DIX_EXT, file);
+	return buf;
+}
+
+
+// the index is usable if it was made from the capture as it is now
+static int indexValid(const char * file)
+{
+	struct dixHeader hdr;
+	struct stat cs;
+	struct stat is;
+	char name[PATH_MAX];
+	FILE * f;
+	int ok = 0;
+
+	if(stat(file, &cs) != 0 || stat(indexName(file, name, sizeof name), &is) != 0)
+		return 0;
+	f = fopen(name, "rb");
+	if(f == NULL)
+		return 0;
+	if(fread(&hdr, sizeof hdr, 1, f) == 1 && memcmp(hdr.magic, DIX_MAGIC, sizeof hdr.magic) == 0 &&
+			hdr.capSize == (uint64_t) cs.st_size && hdr.capMtime == cs.st_mtime &&
+			(uint64_t) is.st_size == sizeof hdr + hdr.count * sizeof(struct dixRecord))
+		ok = 1;
+	fclose(f);
+	return ok;
+}
+
+
+static int indexBuild(const char * file)
+{
+	char name[PATH_MAX];
+	char tmp[PATH_MAX + 8];
+	struct decoder * d;
+	unsigned char * m;
+	struct stat st;
+	uint64_t off;
+	int fd;
+	int r = -1;
+
+	fd = open(file, O_RDONLY);
+	if(fd == -1 || fstat(fd, &st) != 0)
+	{
+		fprintf(stderr, "%s: %s\r\n", file, strerror(errno));
+		return -1;
+	}
+	if((size_t) st.st_size < sizeof(struct wireHeader))
+	{
+		fprintf(stderr, "%s: no capture\r\n", file);
+		close(fd);
+		return -1;
+	}
+	m = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(m == MAP_FAILED)
+	{
+		fprintf(stderr, "%s: %s\r\n", file, strerror(errno));
+		return -1;
+	}
+	madvise(m, st.st_size, MADV_SEQUENTIAL);
+	if(memcmp(m, WIRE_MAGIC, 8) != 0)
+	{
+		fprintf(stderr, "%s: no capture\r\n", file);
+		munmap(m, st.st_size);
+		return -1;
+	}
+
+	d = calloc(1, sizeof(*d));
+	snprintf(tmp, sizeof tmp, "%s.tmp", indexName(file, name, sizeof name));
+	if(d)
+		d->out = fopen(tmp, "wb");
+	if(d == NULL || d->out == NULL)
+	{
+		fprintf(stderr, "Could not create %s (%s)\r\n", tmp, strerror(errno));
+		free(d);
+		munmap(m, st.st_size);
+		return -1;
+	}
+	setvbuf(d->out, NULL, _IOFBF, 1 << 20);
+
+	memcpy(d->hdr.magic, DIX_MAGIC, sizeof d->hdr.magic);
+	d->hdr.capSize = st.st_size;
+	d->hdr.capMtime = st.st_mtime;
+	memcpy(&d->hdr.wire, m, sizeof d->hdr.wire);
+	fwrite(&d->hdr, sizeof d->hdr, 1, d->out);
+
+	off = sizeof(struct wireHeader);
+	while(off + sizeof(struct wireRecord) <= (uint64_t) st.st_size)
+	{
+		struct wireRecord wr;
+		const char * p;
+		uint32_t len;
+		uint32_t i;
+
+		memcpy(&wr, m + off, sizeof wr);
+		len = wr.len & ~WIRE_TX;
+		if(off + sizeof wr + len > (uint64_t) st.st_size)
+			break;		// cut off, the capture is still being written
+		p = (const char *) m + off + sizeof wr;
+		for(i = 0; i < len; i++)
+		{
+			i += dataRun(d, wr.len & WIRE_TX, (const unsigned char *) p + i, len - i, wr.usec);
+			if(i == len)
+				break;
+			if(wr.len & WIRE_TX)
+				txByte(d, p[i], wr.usec);
+			else
+				rxByte(d, p[i], wr.usec, off);
+		}
+		off += sizeof wr + len;
+	}
+	if(d->state != D_IDLE)
+		finish(d, DIX_INCOMPLETE);
+
+	rewind(d->out);
+	fwrite(&d->hdr, sizeof d->hdr, 1, d->out);
+	if(fclose(d->out) == 0 && rename(tmp, name) == 0)
+		r = 0;
+	else
+	{
+		fprintf(stderr, "Could not write %s (%s)\r\n", name, strerror(errno));
+		unlink(tmp);
+	}
+	free(d);
+	munmap(m, st.st_size);
+	return r;
+}
+
+
+// indexes that are missing or out of date are made, one process per capture
+static int indexAll(int nFiles, char ** files)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int running = 0;
+	int failed = 0;
+	int status;
+	int i;
+
+	if(cpus < 1)
+		cpus = 1;
+	for(i = 0; i < nFiles; i++)
+	{
+		pid_t pid;
+
+		if(indexValid(files[i]))
+			continue;
+		if(running == cpus)
+		{
+			if(wait(&status) > 0 && (!WIFEXITED(status) || WEXITSTATUS(status) != 0))
+				failed++;
+			running--;
+		}
+		fprintf(stderr, "Indexing %s\r\n", files[i]);
+		pid = fork();
+		if(pid == 0)
+			_exit(indexBuild(files[i]) == 0 ? 0 : 1);
+		if(pid == -1)
+		{
+			if(indexBuild(files[i]) != 0)
+				failed++;
+		}
+		else
+			running++;
+	}
+	while(running--)
+	{
+		if(wait(&status) > 0 && (!WIFEXITED(status) || WEXITSTATUS(status) != 0))
+			failed++;
+	}
+	return failed;
+}
+
+
+static int parseTime(const char * s, double * v)
+{
+	struct tm tm;
+	char * e;
+
+	memset(&tm, 0, sizeof tm);
+	e = strptime(s, "%Y-%m-%dT%H:%M:%S", &tm);
+	if(e == NULL)
+	{
+		memset(&tm, 0, sizeof tm);
+		e = strptime(s, "%Y-%m-%dT%H:%M", &tm);
+	}
+	if(e && *e == 0)
+	{
+		tm.tm_isdst = -1;
+		*v = mktime(&tm);
+		return 0;
+	}
+	*v = strtod(s, &e);
+	return *e == 0 && e != s ? 0 : -1;
+}
+
+
+static int parseTerm(const char * s, struct term * t)
+{
+	static const char * ops[] = { "=", "!=", "<", "<=", ">", ">=" };
+	size_t l = strcspn(s, "=!<>");
+	const char * v;
+	int f;
+
+	memset(t, 0, sizeof(*t));
+	for(f = 0; f < (int) (sizeof(fieldName) / sizeof(fieldName[0])); f++)
+	{
+		if(strlen(fieldName[f]) == l && strncasecmp(s, fieldName[f], l) == 0)
+			break;
+	}
+	if(f == (int) (sizeof(fieldName) / sizeof(fieldName[0])))
+		return -1;
+	t->field = f;
+
+	v = s + l;
+	for(t->op = OP_GE; t->op >= OP_EQ; t->op--)
+	{
+		if(strncmp(v, ops[t->op], strlen(ops[t->op])) == 0)
+			break;
+	}
+	if(t->op < OP_EQ)
+		return -1;
+	v += strlen(ops[t->op]);
+
+	switch(f)
+	{
+	case F_CMD:
+	{
+		char list[128];
+		char * save;
+		char * n;
+
+		if(t->op > OP_NE)
+			return -1;
+		snprintf(list, sizeof list, "%s", v);
+		for(n = strtok_r(list, ",", &save); n; n = strtok_r(NULL, ",", &save))
+		{
+			int c;
+
+			for(c = CMD_FOPEN; c <= CMD_UNGETC; c++)
+			{
+				if(strcasecmp(n, traceCmdName(c)) == 0)
+					break;
+			}
+			if(c > CMD_UNGETC)
+				return -1;
+			t->cmdMask |= 1u << c;
+		}
+		return t->cmdMask ? 0 : -1;
+	}
+	case F_NAME:
+		if(t->op > OP_NE)
+			return -1;
+		snprintf(t->pattern, sizeof t->pattern, "%s", v);
+		return 0;
+	case F_STATUS:
+		if(t->op > OP_NE)
+			return -1;
+		for(t->value = 0; t->value < 3; t->value++)
+		{
+			if(strcasecmp(v, statusName[(int) t->value]) == 0)
+				return 0;
+		}
+		return -1;
+	case F_TIME:
+		return parseTime(v, &t->value);
+	default:
+	{
+		char * e;
+
+		t->value = strtod(v, &e);
+		return *e == 0 && e != v ? 0 : -1;
+	}
+	}
+}
+
+
+static double fieldValue(const struct dixRecord * r, int field)
+{
+	switch(field)
+	{
+	case F_TIME:	return r->start / 1e6;
+	case F_MS:		return r->dur / 1e3;
+	case F_HOSTMS:	return r->host / 1e3;
+	case F_HANDLE:	return r->handle;
+	case F_COUNT:	return r->arg;
+	case F_RESULT:	return r->result;
+	case F_BYTES:	return r->data;
+	case F_RX:		return r->rx;
+	case F_TX:		return r->tx;
+	default:		return r->status;
+	}
+}
+
+
+static int match(const struct dixRecord * r, const struct term * t, int nTerms)
+{
+	int i;
+
+	for(i = 0; i < nTerms; i++, t++)
+	{
+		double v;
+		int ok;
+
+		if(t->field == F_CMD || t->field == F_NAME)
+		{
+			if(t->field == F_CMD)
+				ok = r->cmd <= CMD_UNGETC && ((t->cmdMask >> r->cmd) & 1);
+			else
+				ok = fnmatch(t->pattern, r->name, FNM_CASEFOLD) == 0;
+			if(t->op == OP_NE)
+				ok = !ok;
+		}
+		else
+		{
+			v = fieldValue(r, t->field);
+			switch(t->op)
+			{
+			case OP_NE: ok = v != t->value; break;
+			case OP_LT: ok = v < t->value; break;
+			case OP_LE: ok = v <= t->value; break;
+			case OP_GT: ok = v > t->value; break;
+			case OP_GE: ok = v >= t->value; break;
+			default: ok = v == t->value; break;
+			}
+		}
+		if(!ok)
+			return 0;
+	}
+	return 1;
+}
+
+
+static void printRecord(const struct dixRecord * r)
+{
+	char when[32];
+	time_t sec = r->start / 1000000;
+	struct tm tm;
+
+	localtime_r(&sec, &tm);
+	strftime(when, sizeof when, "%Y-%m-%d %H:%M:%S", &tm);
+	printf("%s.%06u %-9s", when, (unsigned) (r->start % 1000000), traceCmdName(r->cmd));
+	if(r->handle == 0xffff)
+		printf(" h ?  ");
+	else
+	if(r->handle)
+		printf(" h %-3u", r->handle);
+	else
+		printf("      ");
+	switch(r->cmd)
+	{
+	case CMD_FREAD:
+		printf(" %u of %u bytes", r->data, r->arg);
+		break;
+	case CMD_FWRITE:
+		printf(" %u bytes", r->data);
+		break;
+	case CMD_FGETS:
+	case CMD_FPUTS:
+		printf(" %u bytes -> %d", r->data, r->result);
+		break;
+	case CMD_NONE:
+		break;
+	default:
+		printf(" -> %d", r->result);
+		break;
+	}
+	printf("  %.3f ms (host %.3f ms)  rx %u tx %u  %s", r->dur / 1e3, r->host / 1e3, r->rx, r->tx, r->name);
+	if(r->status != DIX_OK)
+		printf(" [%s]", statusName[r->status]);
+	printf("\r\n");
+}
+
+
+static int queryIndex(const char * file, const struct term * t, int nTerms, double from, double to)
+{
+	char name[PATH_MAX];
+	const struct dixHeader * hdr;
+	const struct dixRecord * rec;
+	uint64_t matched = 0;
+	uint64_t bytes = 0;
+	uint64_t total = 0;
+	uint32_t max = 0;
+	struct stat st;
+	size_t lo;
+	size_t hi;
+	void * m;
+	int fd;
+
+	fd = open(indexName(file, name, sizeof name), O_RDONLY);
+	if(fd == -1 || fstat(fd, &st) != 0)
+	{
+		fprintf(stderr, "%s: %s\r\n", name, strerror(errno));
+		return -1;
+	}
+	m = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(m == MAP_FAILED)
+	{
+		fprintf(stderr, "%s: %s\r\n", name, strerror(errno));
+		return -1;
+	}
+	hdr = m;
+	rec = (const struct dixRecord *) (hdr + 1);
+
+	printf("%s: %.48s at %u bit/s, %llu requests, %u abandoned, %llu/%llu console bytes from/to the TNC\r\n",
+			file, hdr->wire.port, hdr->wire.speed, (unsigned long long) hdr->count, hdr->abandoned,
+			(unsigned long long) hdr->rxConsole, (unsigned long long) hdr->txConsole);
+
+	// the records are in time order, a time range is found by bisection
+	lo = 0;
+	hi = hdr->count;
+	while(lo < hi)
+	{
+		size_t mid = lo + (hi - lo) / 2;
+
+		if(rec[mid].start / 1e6 < from)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for(; lo < hdr->count && rec[lo].start / 1e6 <= to; lo++)
+	{
+		if(!match(&rec[lo], t, nTerms))
+			continue;
+		printRecord(&rec[lo]);
+		matched++;
+		bytes += rec[lo].data;
+		total += rec[lo].dur;
+		if(rec[lo].dur > max)
+			max = rec[lo].dur;
+	}
+	printf("%s: %llu requests matched, %llu data bytes, %.3f ms average, %.3f ms max\r\n", file,
+			(unsigned long long) matched, (unsigned long long) bytes,
+			matched ? total / 1e3 / matched : 0.0, max / 1e3);
+	munmap(m, st.st_size);
+	return 0;
+}
+
+
+int dissectRun(const char * query, int nFiles, char ** files)
+{
+	struct term t[MAX_TERMS];
+	double from = 0;
+	double to = 1e300;
+	char * q = strdup(query);
+	char * save;
+	char * s;
+	int nTerms = 0;
+	int failed;
+	int i;
+
+	if(q == NULL)
+		return 1;
+	for(s = strtok_r(q, " \t", &save); s; s = strtok_r(NULL, " \t", &save))
+	{
+		if(nTerms == MAX_TERMS || parseTerm(s, &t[nTerms]) != 0)
+		{
+			fprintf(stderr, "Bad query term %s\r\n", s);
+			free(q);
+			return 1;
+		}
+		if(t[nTerms].field == F_TIME)
+		{
+			if(t[nTerms].op == OP_GT || t[nTerms].op == OP_GE || t[nTerms].op == OP_EQ)
+				from = t[nTerms].value > from ? t[nTerms].value : from;
+			if(t[nTerms].op == OP_LT || t[nTerms].op == OP_LE || t[nTerms].op == OP_EQ)
+				to = t[nTerms].value < to ? t[nTerms].value : to;
+		}
+		nTerms++;
+	}
+	free(q);
+
+	if(nFiles == 0)
+	{
+		fprintf(stderr, "No capture given\r\n");
+		return 1;
+	}
+	fflush(stdout);
+	failed = indexAll(nFiles, files);
+	for(i = 0; i < nFiles; i++)
+	{
+		// captures that could not be indexed have been reported
+		if(indexValid(files[i]) && queryIndex(files[i], t, nTerms, from, to) != 0)
+			failed++;
+	}
+	return failed ? 2 : 0;
+}
@@ -0,0 +1,29 @@
+/*
+ ============================================================================
+ Name        : dissect.h
+ Author      : F. Erckenbrecht / dg1yfe
+ Copyright   : GPL
+ Description : Offline dissector for wire captures (-T): one record per
+               request, kept in an index that queries run on
+ ============================================================================
+ */
+
+#ifndef DISSECT_H_
+#define DISSECT_H_
+
+/*
+ * The requests of a capture are decoded with the framing and argument
+ * layouts of the protocol handler: command, handle, file name, argument,
+ * response, data and wire bytes, duration. The records are written to
+ * <capture>.dix once (again if the capture changed, one process per
+ * capture), a query reads only the index.
+ *
+ * query is a list of terms that all have to match, e.g.
+ * "cmd=fread handle=3 ms>200": cmd=<name>[,<name>...], name=<pattern>,
+ * status=ok|abandoned|incomplete and <field><op><value> with the fields
+ * time (epoch seconds or YYYY-MM-DDTHH:MM[:SS]), ms, hostms, handle,
+ * count, result, bytes, rx, tx and the operators = != < <= > >=.
+ */
+int dissectRun(const char * query, int nFiles, char ** files);
+
+#endif /* DISSECT_H_ */
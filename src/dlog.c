@@ -0,0 +1,219 @@
+/*
+ ============================================================================
+ Name        : dlog.c
+ Author      : F. Erckenbrecht / dg1yfe
+ Copyright   : GPL
+ Description : Binary in-memory debug log with deferred formatting
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "dlog.h"
+
+#define DLOG_T_TEXT		0
+#define DLOG_T_BYTE		1
+
+struct dlogRecord {
+	_Atomic uint64_t	seq;		// index+1 of the record, 0 while being written
+	uint64_t			ts;			// ns, CLOCK_MONOTONIC
+	const char *		fmt;
+	uint32_t			arg[3];
+	uint8_t				type;
+	uint8_t				level;
+	uint8_t				hasStr;
+	char				str[DLOG_STRLEN];
+};
+
+volatile sig_atomic_t dlogLevel = DLOG_OFF;
+volatile sig_atomic_t dlogDumpRequested = 0;
+
+static struct dlogRecord * ring = NULL;
+static uint64_t ringMask;
+static _Atomic uint64_t ringHead = 0;
+static uint64_t ringTail = 0;		// first record not rendered yet
+
+
+static uint64_t dlogNow(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+int dlogInit(int level, unsigned int records)
+{
+	unsigned int n;
+
+	// round up to a power of two, so the index can be masked
+	for(n = 64; n < records; n <<= 1)
+		;
+
+	ring = calloc(n, sizeof(struct dlogRecord));
+	if(ring == NULL)
+	{
+		dlogLevel = DLOG_OFF;
+		return -1;
+	}
+	ringMask = n - 1;
+
+	if(level > DLOG_MAX)
+		level = DLOG_MAX;
+	dlogLevel = level;
+	return 0;
+}
+
+
+void dlogFree(void)
+{
+	dlogLevel = DLOG_OFF;
+	free(ring);
+	ring = NULL;
+}
+
+
+static struct dlogRecord * dlogClaim(uint64_t * idx)
+{
+	struct dlogRecord * rec;
+
+	*idx = atomic_fetch_add_explicit(&ringHead, 1, memory_order_relaxed);
+	rec = &ring[*idx & ringMask];
+	atomic_store_explicit(&rec->seq, 0, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	rec->ts = dlogNow();
+	return rec;
+}
+
+
+void dlogWrite(int level, const char * fmt, const char * str, uint32_t a0, uint32_t a1, uint32_t a2)
+{
+	struct dlogRecord * rec;
+	uint64_t idx;
+
+	if(ring == NULL)
+		return;
+
+	rec = dlogClaim(&idx);
+	rec->type = DLOG_T_TEXT;
+	rec->level = level;
+	rec->fmt = fmt;
+	rec->arg[0] = a0;
+	rec->arg[1] = a1;
+	rec->arg[2] = a2;
+	rec->hasStr = str != NULL;
+	if(str)
+	{
+		strncpy(rec->str, str, DLOG_STRLEN-1);
+		rec->str[DLOG_STRLEN-1] = 0;
+	}
+	atomic_store_explicit(&rec->seq, idx+1, memory_order_release);
+}
+
+
+void dlogByte(uint8_t data, int framing)
+{
+	struct dlogRecord * rec;
+	uint64_t idx;
+
+	if(ring == NULL)
+		return;
+
+	rec = dlogClaim(&idx);
+	rec->type = DLOG_T_BYTE;
+	rec->level = DLOG_BYTES;
+	rec->arg[0] = data;
+	rec->arg[1] = framing;
+	atomic_store_explicit(&rec->seq, idx+1, memory_order_release);
+}
+
+
+/*
+ * Render all records written since the last dump. Records that were
+ * overwritten or are being written while we look at them are skipped.
+ */
+void dlogDump(FILE * f)
+{
+	uint64_t head;
+	uint64_t idx;
+	uint64_t lost;
+	int bc = 0;
+
+	dlogDumpRequested = 0;
+	if(ring == NULL)
+		return;
+
+	head = atomic_load_explicit(&ringHead, memory_order_acquire);
+	lost = 0;
+	if(head - ringTail > ringMask + 1)
+	{
+		lost = head - ringTail - (ringMask + 1);
+		ringTail = head - (ringMask + 1);
+	}
+	if(lost)
+	{
+		fprintf(f, "\r\n[dlog: %llu records overwritten]\r\n", (unsigned long long) lost);
+	}
+
+	for(idx = ringTail; idx != head; idx++)
+	{
+		struct dlogRecord * src = &ring[idx & ringMask];
+		struct dlogRecord rec;
+
+		if(atomic_load_explicit(&src->seq, memory_order_acquire) != idx+1)
+			continue;
+		memcpy(&rec, src, sizeof(rec));
+		atomic_thread_fence(memory_order_acquire);
+		if(atomic_load_explicit(&src->seq, memory_order_relaxed) != idx+1)
+			continue;
+
+		if(rec.type == DLOG_T_BYTE)
+		{
+			if(rec.arg[1])
+			{
+				fprintf(f, "\r\n%02X\r\n", rec.arg[0]);
+				bc = 0;
+			}
+			else
+			{
+				if(bc++ % 16 == 0)
+				{
+					fprintf(f, "\r\n");
+				}
+				fprintf(f, "%02hhx ", (uint8_t) rec.arg[0]);
+			}
+			continue;
+		}
+
+		if(bc)
+		{
+			fprintf(f, "\r\n");
+			bc = 0;
+		}
+		fprintf(f, "[%llu.%06llu] ",
+				(unsigned long long)(rec.ts / 1000000000),
+				(unsigned long long)((rec.ts / 1000) % 1000000));
+		if(rec.hasStr)
+		{
+			rec.str[DLOG_STRLEN-1] = 0;
+			fprintf(f, rec.fmt, rec.str, rec.arg[0], rec.arg[1]);
+		}
+		else
+		{
+			fprintf(f, rec.fmt, rec.arg[0], rec.arg[1], rec.arg[2]);
+		}
+		fprintf(f, "\r\n");
+	}
+	if(bc)
+	{
+		fprintf(f, "\r\n");
+	}
+	ringTail = head;
+	fflush(f);
+}
@@ -0,0 +1,60 @@
+/*
+ ============================================================================
+ Name        : dlog.h
+ Author      : F. Erckenbrecht / dg1yfe
+ Copyright   : GPL
+ Description : Binary in-memory debug log with deferred formatting
+ ============================================================================
+ */
+
+#ifndef DLOG_H_
+#define DLOG_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <signal.h>
+
+/*
+ * Log records are written into a lock-free ring as binary records (format
+ * string pointer, up to three numeric arguments, one short string). They are
+ * only formatted when the ring is rendered: on SIGUSR1, at exit or by calling
+ * dlogDump(). While logging is disabled each DLOG*() costs one load and one
+ * (predicted not taken) branch.
+ */
+enum { DLOG_OFF, DLOG_REQUEST, DLOG_DETAIL, DLOG_BYTES, DLOG_MAX = DLOG_BYTES };
+
+#define DLOG_STRLEN		40
+
+extern volatile sig_atomic_t dlogLevel;
+extern volatile sig_atomic_t dlogDumpRequested;
+
+int dlogInit(int level, unsigned int records);
+void dlogWrite(int level, const char * fmt, const char * str, uint32_t a0, uint32_t a1, uint32_t a2);
+void dlogByte(uint8_t data, int framing);
+void dlogDump(FILE * f);
+void dlogFree(void);
+
+#define DLOG_ON(level)		__builtin_expect(dlogLevel >= (level), 0)
+
+/* numeric arguments only, format uses up to three integer conversions */
+#define DLOG(level, fmt, a0, a1, a2)					\
+	do {												\
+		if(DLOG_ON(level))								\
+			dlogWrite(level, fmt, NULL, a0, a1, a2);	\
+	} while(0)
+
+/* string argument first (%s), then up to two integer conversions */
+#define DLOGS(level, fmt, s, a0, a1)					\
+	do {												\
+		if(DLOG_ON(level))								\
+			dlogWrite(level, fmt, s, a0, a1, 0);		\
+	} while(0)
+
+/* raw protocol byte, rendered as hexdump */
+#define DLOG_BYTE(c, framing)							\
+	do {												\
+		if(DLOG_ON(DLOG_BYTES))							\
+			dlogByte(c, framing);						\
+	} while(0)
+
+#endif /* DLOG_H_ */
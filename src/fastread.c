@@ -0,0 +1,264 @@
+/*
+ ============================================================================
+ Name        : fastread.c
+ Author      : F. Erckenbrecht / dg1yfe
+ Copyright   : GPL
+ Description : FREAD fast path, file data goes to the port with sendfile()
+               and only the bytes that need escaping pass user space
+ ============================================================================
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <errno.h>
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#include "OpenRS.h"
+#include "fastread.h"
+#include "vfs.h"
+#include "digest.h"
+#include "dlog.h"
+#include "transport.h"
+
+#define SENDFILE_MIN	256		// shorter runs are written from the mapping
+
+#define ONES	0x0101010101010101ULL
+#define HIGHS	0x8080808080808080ULL
+#define HASZERO(v)	(((v) - ONES) & ~(v) & HIGHS)
+
+
+/*
+ * Offset of the first 0x02, 0x03 or 0x10 in p, len if there is none.
+ * Checks eight bytes at a time.
+ */
+size_t findEscape(const unsigned char * p, size_t len)
+{
+	size_t i = 0;
+
+	for(; i + 8 <= len; i += 8)
+	{
+		uint64_t v;
+
+		memcpy(&v, p + i, 8);
+		if(HASZERO(v ^ (ONES * 0x02)) | HASZERO(v ^ (ONES * 0x03)) | HASZERO(v ^ (ONES * 0x10)))
+			break;
+	}
+	for(; i < len; i++)
+	{
+		if(p[i] == 0x02 || p[i] == 0x03 || p[i] == 0x10)
+			break;
+	}
+	return i;
+}
+
+
+int portSendRun(int out, int fd, off_t off, const unsigned char * p, size_t n)
+{
+	int retries = 0;
+
+	while(n)
+	{
+		ssize_t w = -1;
+
+#ifdef __linux__
+		if(n >= SENDFILE_MIN && fd != -1)
+		{
+			off_t o = off;
+
+			// page cache -> tty, the data is not copied through user space
+			w = sendfile(out, fd, &o, n);
+			if(w == -1 && (errno == EINVAL || errno == ENOSYS))
+			{
+				w = write(out, p, n);
+			}
+		}
+		else
+#endif
+		{
+			w = write(out, p, n);
+		}
+
+		if(w > 0)
+		{
+			off += w;
+			p += w;
+			n -= w;
+			portTxBytes += w;
+			retries = 0;
+		}
+		else
+		if(w == -1 && (errno == EAGAIN || errno == EINTR) && retries++ < 100)
+		{
+			usleep(1000);
+		}
+		else
+		if(w == -1 && hotplugWait && portGone(errno))
+		{
+			return 0;		// the rest is discarded, the request is abandoned
+		}
+		else
+		{
+			return -1;
+		}
+	}
+	return 0;
+}
+
+
+void freadFastRelease(int h)
+{
+	if(Handle[h].map)
+	{
+		munmap(Handle[h].map, Handle[h].mapSize);
+		Handle[h].map = NULL;
+		Handle[h].mapSize = 0;
+	}
+	Handle[h].mem = NULL;
+}
+
+
+/*
+ * Send m[pos..end) escaped. Clean runs go out with sendfile() from fd
+ * (-1: m is not backed by a file), returns the number of escaped bytes.
+ */
+uint32_t freadSlice(int fd, const unsigned char * m, off_t pos, off_t end)
+{
+	uint32_t escaped = 0;
+	int out;
+	off_t p;
+
+	// pending output goes first, RFC 2217 needs every byte filtered
+	out = portRawFd();
+
+	for(p = pos; p < end;)
+	{
+		off_t q;
+
+		q = p + findEscape(m + p, end - p);
+		if(q > p)
+		{
+			portFlush();		// escaped bytes before this run
+			if(portSendRun(out, fd, p, m + p, q - p) != 0)
+			{
+				perror("Unrecoverable Error while writing to serial port. Exiting...\r\n");
+				exit(errno);
+			}
+		}
+		if(q < end)
+		{
+			putcEsc(m[q++]);
+			escaped++;
+		}
+		p = q;
+	}
+	return escaped;
+}
+
+
+/*
+ * FREAD of a memory backend file, its data is sent in place
+ */
+static int freadMem(int h, uint32_t count)
+{
+	const struct vfsMemFile * mf = Handle[h].mem;
+	FILE * f = File[h];
+	off_t pos;
+	off_t end;
+	uint32_t escaped;
+
+	if(portRawFd() == -1)
+		return -1;
+
+	pos = ftello(f);
+	if(pos == -1)
+		return -1;
+
+	end = pos + count;
+	if((uint64_t) end > mf->size)
+		end = (uint64_t) pos < mf->size ? (off_t) mf->size : pos;
+
+	escaped = freadSlice(-1, (const unsigned char *) mf->data, pos, end);
+
+	// beyond EOF every requested byte is answered with 0x03
+	for(count -= end - pos; count; count--)
+	{
+		putPort(0x03);
+	}
+
+	fseeko(f, end, SEEK_SET);
+	handleData(h, mf->data + pos, end - pos);
+	DLOG(DLOG_DETAIL, "FREAD from memory: %u bytes, %u escaped", (uint32_t)(end - pos), escaped, 0);
+	return 0;
+}
+
+
+int freadFast(int h, uint32_t count)
+{
+	FILE * f = File[h];
+	struct stat st;
+	off_t pos;
+	off_t end;
+	int fd;
+	uint32_t escaped;
+
+	if(f == NULL || Handle[h].pushback)
+		return -1;
+	if(Handle[h].mem)
+		return freadMem(h, count);
+
+	fd = fileno(f);
+	if(fd == -1 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+		return -1;		// stream of a non-host backend
+
+	if(fflush(f) != 0)
+		return -1;
+	pos = ftello(f);
+	if(pos == -1)
+		return -1;
+
+	// (re)map if the file is new to us or has grown
+	if(Handle[h].map == NULL || Handle[h].mapSize != (size_t) st.st_size)
+	{
+		freadFastRelease(h);
+		if(st.st_size > 0)
+		{
+			void * m = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+			if(m == MAP_FAILED)
+				return -1;		// e.g. opened for writing only
+			Handle[h].map = m;
+			Handle[h].mapSize = st.st_size;
+		}
+	}
+
+	if(portRawFd() == -1)
+		return -1;
+
+	end = pos + count;
+	if(end > st.st_size)
+		end = pos < st.st_size ? st.st_size : pos;
+
+	escaped = freadSlice(fd, (const unsigned char *) Handle[h].map, pos, end);
+
+	// beyond EOF every requested byte is answered with 0x03
+	for(count -= end - pos; count; count--)
+	{
+		putPort(0x03);
+	}
+
+	// keep the stream position in sync for FTELL / FSEEK / FGETC
+	fseeko(f, end, SEEK_SET);
+	handleData(h, Handle[h].map + pos, end - pos);
+	DLOG(DLOG_DETAIL, "FREAD fast path: %u bytes, %u escaped", (uint32_t)(end - pos), escaped, 0);
+	return 0;
+}
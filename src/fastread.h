@@ -0,0 +1,23 @@
+/*
+ ============================================================================
+ Name        : fastread.h
+ Author      : F. Erckenbrecht / dg1yfe
+ Copyright   : GPL
+ Description : FREAD fast path, file data goes to the port with sendfile()
+               and only the bytes that need escaping pass user space
+ ============================================================================
+ */
+
+#ifndef FASTREAD_H_
+#define FASTREAD_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+int freadFast(int h, uint32_t count);	// 0: request served, -1: use the stdio path
+void freadFastRelease(int h);
+size_t findEscape(const unsigned char * p, size_t len);
+uint32_t freadSlice(int fd, const unsigned char * m, off_t pos, off_t end);
+int portSendRun(int out, int fd, off_t off, const unsigned char * p, size_t n);
+
+#endif /* FASTREAD_H_ */
@@ -0,0 +1,353 @@
+/*
+ ============================================================================
+ Name        : fleet.c
+ Author      : F. Erckenbrecht / dg1yfe
+ Copyright   : GPL
+ Description : Flash several TNCs in parallel from one shared image
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "OpenRS.h"
+#include "fleet.h"
+#include "vfs.h"
+#include "transport.h"
+#include "wire.h"
+
+#define FLEET_MAX		64
+#define FLEET_QUIET		5		// s without open files and data after the image was served
+#define FLEET_TIMEOUT	120		// s without any data from the TNC
+
+enum { UNIT_START, UNIT_WAIT, UNIT_XFER, UNIT_FLASH, UNIT_DONE, UNIT_FAILED };
+
+static const char * unitState[] = { "start", "waiting", "transfer", "flashing", "done", "FAILED" };
+
+// one per TNC, in memory shared with the child serving it
+struct fleetUnit {
+	char		port[PATH_MAX];
+	pid_t		pid;
+	int			state;
+	uint64_t	served;
+	time_t		start;
+	time_t		end;
+	char		msg[64];
+};
+
+static struct fleetUnit * unit;
+static struct fleetUnit * self;
+static int nUnit;
+static uint64_t imageSize;
+static time_t lastActive;
+
+
+static void unitFinish(struct fleetUnit * u, int state, const char * msg)
+{
+	u->state = state;
+	u->end = time(NULL);
+	strncpy(u->msg, msg, sizeof(u->msg)-1);
+}
+
+
+/*
+ * Called from the session loop of a child
+ */
+static int fleetPoll(void)
+{
+	uint64_t served = 0;
+	int open = 0;
+	int i;
+	time_t now = time(NULL);
+
+	for(i = 0; i < MAXFPTR; i++)
+	{
+		served += Handle[i].bytes;
+		if(File[i])
+			open++;
+	}
+	self->served = served;
+
+	if(open)
+	{
+		self->state = UNIT_XFER;
+		lastActive = now;
+		return 0;
+	}
+	if(self->state == UNIT_XFER)
+	{
+		self->state = UNIT_FLASH;
+		lastActive = now;
+	}
+	if(portLastRx > lastActive)
+		lastActive = portLastRx;
+
+	if(self->state == UNIT_FLASH && now - lastActive >= FLEET_QUIET)
+	{
+		if(served >= imageSize)
+		{
+			unitFinish(self, UNIT_DONE, "image served");
+			return 1;
+		}
+		unitFinish(self, UNIT_FAILED, "image closed before it was served completely");
+		return 2;
+	}
+	if(now - lastActive > FLEET_TIMEOUT)
+	{
+		unitFinish(self, UNIT_FAILED, "timeout, no data from TNC");
+		return 2;
+	}
+	return 0;
+}
+
+
+static void fleetChild(int idx, int bitrate, char * command)
+{
+	char logName[64];
+	static char wireUnit[PATH_MAX];
+	int fd;
+
+	self = &unit[idx];
+
+	// console output and diagnostics of this TNC go to its own log
+	snprintf(logName, sizeof logName, "fleet-%d.log", idx+1);
+	fd = open(logName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(fd != -1)
+	{
+		dup2(fd, 1);
+		dup2(fd, 2);
+		close(fd);
+	}
+	fd = open("/dev/null", O_RDONLY);
+	if(fd != -1)
+	{
+		dup2(fd, 0);
+		close(fd);
+	}
+
+	// a wire capture per TNC, <file>.<n>
+	if(wireName)
+	{
+		snprintf(wireUnit, sizeof wireUnit, "%s.%d", wireName, idx+1);
+		wireName = wireUnit;
+	}
+	if(portOpen(self->port, bitrate) != 0)
+	{
+		unitFinish(self, UNIT_FAILED, "can't open port");
+		exit(2);
+	}
+	self->start = time(NULL);
+	self->state = UNIT_WAIT;
+	lastActive = self->start;
+
+	sendCommand(command);
+	exit(sessionLoop(0, fleetPoll) == 1 ? 0 : 1);
+}
+
+
+static int addPort(const char * port)
+{
+	if((size_t) snprintf(unit[nUnit].port, sizeof unit[nUnit].port, "%s", port) >= sizeof unit[nUnit].port)
+	{
+		fprintf(stderr, "Port name too long: %.40s...\r\n", port);
+		return -1;
+	}
+	nUnit++;
+	return 0;
+}
+
+
+static int fleetPorts(char * ports)
+{
+	char line[PATH_MAX];
+	char * s;
+	FILE * f;
+
+	nUnit = 0;
+	if(ports[0] == '@')
+	{
+		f = fopen(ports+1, "r");
+		if(f == NULL)
+			return -1;
+		while(nUnit < FLEET_MAX && fgets(line, sizeof line, f))
+		{
+			line[strcspn(line, "\r\n")] = 0;
+			if(line[0] == 0 || line[0] == '#')
+				continue;
+			if(addPort(line) != 0)
+			{
+				fclose(f);
+				return -1;
+			}
+		}
+		fclose(f);
+		return nUnit;
+	}
+
+	for(s = strtok(ports, ","); s && nUnit < FLEET_MAX; s = strtok(NULL, ","))
+	{
+		if(addPort(s) != 0)
+			return -1;
+	}
+	return nUnit;
+}
+
+
+static void fleetShow(int redraw)
+{
+	time_t now = time(NULL);
+	int i;
+
+	if(redraw)
+		printf("\033[%dA", nUnit);
+
+	for(i = 0; i < nUnit; i++)
+	{
+		struct fleetUnit * u = &unit[i];
+		time_t t = (u->end ? u->end : now) - u->start;
+
+		printf("\033[K[%2d] %-24s %-9s %9llu/%llu %3d%% %6.0f B/s %s\r\n",
+				i+1, u->port, unitState[u->state],
+				(unsigned long long) u->served, (unsigned long long) imageSize,
+				imageSize ? (int)(u->served * 100 / imageSize) : 0,
+				u->start && t > 0 ? (double) u->served / t : 0.0,
+				u->msg);
+	}
+	fflush(stdout);
+}
+
+
+int fleetRun(char * ports, int bitrate, char * command)
+{
+	struct vfsBackend * b;
+	struct stat st;
+	char image[PATH_MAX];
+	char * name;
+	size_t len;
+	void * map;
+	int fd;
+	int i;
+	int running;
+	int failed;
+	int tty = isatty(1);
+
+	// the image is the last word of the command
+	len = command ? strlen(command) : 0;
+	while(len && command[len-1] == ' ')
+		len--;
+	name = command ? command + len : NULL;
+	while(name && name > command && name[-1] != ' ')
+		name--;
+	if(name == NULL || name == command || len == 0)
+	{
+		fprintf(stderr, "Fleet mode needs a TNC command naming the image, e.g. 'flash epflash.bin'\r\n");
+		return 1;
+	}
+	snprintf(image, sizeof image, "%.*s", (int)(command + len - name), name);
+
+	unit = mmap(NULL, FLEET_MAX * sizeof(*unit), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if(unit == MAP_FAILED)
+	{
+		perror("mmap");
+		return 1;
+	}
+	memset(unit, 0, FLEET_MAX * sizeof(*unit));
+	if(fleetPorts(ports) <= 0)
+	{
+		fprintf(stderr, "No ports given for fleet mode\r\n");
+		return 1;
+	}
+
+	// map the image once, all children serve it from the same pages
+	fd = open(image, O_RDONLY);
+	if(fd == -1 || fstat(fd, &st) != 0)
+	{
+		fprintf(stderr, "Can't open image %s (%s)\r\n", image, strerror(errno));
+		return 1;
+	}
+	imageSize = st.st_size;
+	map = imageSize ? mmap(NULL, imageSize, PROT_READ, MAP_SHARED, fd, 0) : NULL;
+	close(fd);
+	if(map == MAP_FAILED)
+	{
+		perror("mmap");
+		return 1;
+	}
+	b = vfsMemCreate(1);
+	name = strrchr(image, '/');
+	if(b == NULL || vfsMemAdd(b, name ? name+1 : image, map, imageSize, st.st_mtime, 0) == NULL)
+	{
+		fprintf(stderr, "Can't serve image %s\r\n", image);
+		return 1;
+	}
+	vfs = b;
+
+	printf("Flashing %d TNCs with %s (%llu bytes), logs in fleet-<n>.log\r\n",
+			nUnit, image, (unsigned long long) imageSize);
+	fflush(stdout);
+
+	for(i = 0; i < nUnit; i++)
+	{
+		pid_t pid = fork();
+
+		if(pid == 0)
+		{
+			fleetChild(i, bitrate, command);
+		}
+		if(pid == -1)
+		{
+			unitFinish(&unit[i], UNIT_FAILED, "fork failed");
+			continue;
+		}
+		unit[i].pid = pid;
+	}
+
+	if(tty)
+		fleetShow(0);
+	do
+	{
+		usleep(500000);
+		running = 0;
+		for(i = 0; i < nUnit; i++)
+		{
+			int status;
+
+			if(unit[i].pid > 0)
+			{
+				if(waitpid(unit[i].pid, &status, WNOHANG) == unit[i].pid)
+				{
+					unit[i].pid = 0;
+					if(unit[i].state != UNIT_DONE && unit[i].state != UNIT_FAILED)
+						unitFinish(&unit[i], UNIT_FAILED, "terminated");
+				}
+				else
+					running++;
+			}
+		}
+		if(tty)
+			fleetShow(1);
+	}while(running);
+
+	failed = 0;
+	printf("\r\nResult:\r\n");
+	for(i = 0; i < nUnit; i++)
+	{
+		printf("[%2d] %-24s %s %s\r\n", i+1, unit[i].port,
+				unit[i].state == UNIT_DONE ? "ok    " : "FAILED", unit[i].msg);
+		if(unit[i].state != UNIT_DONE)
+			failed++;
+	}
+	printf("%d of %d TNCs done.\r\n", nUnit - failed, nUnit);
+	return failed;
+}
@@ -0,0 +1,20 @@
+/*
+ ============================================================================
+ Name        : fleet.h
+ Author      : F. Erckenbrecht / dg1yfe
+ Copyright   : GPL
+ Description : Flash several TNCs in parallel from one shared image
+ ============================================================================
+ */
+
+#ifndef FLEET_H_
+#define FLEET_H_
+
+/*
+ * ports: comma separated list of ports or @file with one port per line
+ * command: TNC command, its last argument names the image to serve
+ * Returns the number of units that failed.
+ */
+int fleetRun(char * ports, int bitrate, char * command);
+
+#endif /* FLEET_H_ */
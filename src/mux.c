@@ -0,0 +1,874 @@
+/*
+ ============================================================================
+ Name        : mux.c
+ Author      : F. Erckenbrecht / dg1yfe
+ Copyright   : GPL
+ Description : Text UI showing the consoles of several daemons as tabs or
+               panes, with scrollback and search
+ ============================================================================
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <stdint.h>
+#include <termios.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "OpenRS.h"
+#include "mux.h"
+
+#define MUX_SESSIONS	16
+#define MUX_LINES		4096		// scrollback lines per session
+#define MUX_COLS		256			// longer lines wrap
+#define MUX_FRAME		40			// ms between screen updates
+#define MUX_RETRY		2000		// ms between reconnects to a daemon
+#define MUX_PREFIX		0x01		// CTRL-A
+
+enum { KEY_NORMAL, KEY_PREFIX, KEY_SCROLL, KEY_SEARCH };
+enum { ATTR_NORMAL, ATTR_REVERSE };
+
+struct line {
+	uint16_t	len;
+	char		text[MUX_COLS + 1];
+};
+
+struct session {
+	char			path[PATH_MAX];
+	char			name[24];
+	int				fd;				// -1: not connected
+	uint64_t		retry;
+	struct line *	line;			// ring of MUX_LINES
+	uint64_t		head;			// number of the line being written
+	int				cr;				// CR seen, a following LF is part of it
+	uint64_t		scroll;			// lines the view is scrolled back
+	int64_t			mark;			// line of the last search hit, -1: none
+	int				dirty;
+	int				activity;		// output while not visible
+};
+
+static struct session ses[MUX_SESSIONS];
+static int nSes = 0;
+static int focus = 0;
+static int split = 0;
+static int keyState = KEY_NORMAL;
+static char query[64];
+static size_t queryLen = 0;
+static char message[80];
+static int uiDirty = 1;
+static int quit = 0;
+
+static int rows;
+static int cols;
+static char * front;				// what the terminal shows
+static char * back;					// the next frame
+static unsigned char * frontAttr;
+static unsigned char * backAttr;
+static int curRow;
+static int curCol;
+static volatile sig_atomic_t resized = 1;
+
+static char * out;
+static size_t outLen;
+static size_t outCap;
+
+
+static uint64_t nowMs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+static void emit(const char * p, size_t n)
+{
+	if(outLen + n > outCap)
+	{
+		size_t cap = outCap ? outCap : 16384;
+		char * o;
+
+		while(cap < outLen + n)
+			cap *= 2;
+		o = realloc(out, cap);
+		if(o == NULL)
+			return;
+		out = o;
+		outCap = cap;
+	}
+	memcpy(out + outLen, p, n);
+	outLen += n;
+}
+
+
+static void emitf(const char * fmt, int a, int b)
+{
+	char buf[32];
+	int n = snprintf(buf, sizeof buf, fmt, a, b);
+
+	emit(buf, n);
+}
+
+
+static void flushOut(void)
+{
+	size_t done = 0;
+
+	while(done < outLen)
+	{
+		ssize_t w = write(1, out + done, outLen - done);
+
+		if(w > 0)
+			done += w;
+		else
+		if(w == -1 && (errno == EINTR || errno == EAGAIN))
+			usleep(1000);
+		else
+			break;
+	}
+	outLen = 0;
+}
+
+
+/*
+ * Scrollback
+ */
+static struct line * lineAt(struct session * s, uint64_t n)
+{
+	return &s->line[n % MUX_LINES];
+}
+
+
+static uint64_t oldest(struct session * s)
+{
+	return s->head >= MUX_LINES ? s->head - MUX_LINES + 1 : 0;
+}
+
+
+static void newLine(struct session * s)
+{
+	struct line * l;
+
+	s->head++;
+	l = lineAt(s, s->head);
+	l->len = 0;
+	l->text[0] = 0;
+	if(s->scroll && s->scroll < s->head - oldest(s))
+		s->scroll++;		// the view stays where it is
+	if(s->mark != -1 && (uint64_t) s->mark < oldest(s))
+		s->mark = -1;
+}
+
+
+static void putText(struct session * s, const char * p, size_t n)
+{
+	size_t i;
+
+	for(i = 0; i < n; i++)
+	{
+		unsigned char c = p[i];
+		struct line * l = lineAt(s, s->head);
+
+		if(c == '\n' && s->cr)
+		{
+			s->cr = 0;
+			continue;
+		}
+		s->cr = c == '\r';
+		if(c == '\r' || c == '\n')
+		{
+			newLine(s);
+			continue;
+		}
+		if(c == 0x08)
+		{
+			if(l->len)
+				l->text[--l->len] = 0;
+			continue;
+		}
+		if(c == '\t')
+		{
+			do
+				l->text[l->len++] = ' ';
+			while(l->len % 8 && l->len < MUX_COLS);
+		}
+		else
+		if(c < 0x20 || c == 0x7f)
+			continue;
+		else
+			l->text[l->len++] = c < 0x80 ? c : '?';	// one column per byte
+		l->text[l->len] = 0;
+		if(l->len == MUX_COLS)
+			newLine(s);
+	}
+	s->dirty = 1;
+}
+
+
+static void notice(struct session * s, const char * text)
+{
+	if(lineAt(s, s->head)->len)
+		newLine(s);
+	putText(s, text, strlen(text));
+	newLine(s);
+}
+
+
+/*
+ * Daemon connections
+ */
+static void attach(struct session * s)
+{
+	struct sockaddr_un sa;
+	int fd;
+
+	s->retry = nowMs() + MUX_RETRY;
+	memset(&sa, 0, sizeof sa);
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, s->path);		// length checked by addSession()
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(fd == -1)
+		return;
+	if(connect(fd, (struct sockaddr *) &sa, sizeof sa) != 0 || write(fd, "ATTACH\n", 7) != 7)
+	{
+		close(fd);
+		return;
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	s->fd = fd;
+	notice(s, "--- attached ---");
+	uiDirty = 1;
+}
+
+
+static void detach(struct session * s)
+{
+	close(s->fd);
+	s->fd = -1;
+	s->retry = nowMs() + MUX_RETRY;
+	notice(s, "--- daemon gone, reconnecting ---");
+	uiDirty = 1;
+}
+
+
+static void sendKeys(const char * p, size_t n)
+{
+	struct session * s = &ses[focus];
+
+	if(s->fd == -1 || n == 0)
+		return;
+	// keystrokes are few, the daemon reads them every loop
+	while(n)
+	{
+		ssize_t w = write(s->fd, p, n);
+
+		if(w > 0)
+		{
+			p += w;
+			n -= w;
+		}
+		else
+		if(w == -1 && (errno == EAGAIN || errno == EINTR))
+			usleep(1000);
+		else
+		{
+			detach(s);
+			return;
+		}
+	}
+	s->scroll = 0;
+}
+
+
+/*
+ * Screen
+ */
+static void winch(int sig)
+{
+	resized = 1;
+}
+
+
+static void resize(void)
+{
+	struct winsize ws;
+	size_t n;
+
+	resized = 0;
+	if(ioctl(1, TIOCGWINSZ, &ws) == 0 && ws.ws_row > 2 && ws.ws_col > 10)
+	{
+		rows = ws.ws_row;
+		cols = ws.ws_col;
+	}
+	else
+	{
+		rows = 24;
+		cols = 80;
+	}
+	n = (size_t) rows * cols;
+	front = realloc(front, n);
+	back = realloc(back, n);
+	frontAttr = realloc(frontAttr, n);
+	backAttr = realloc(backAttr, n);
+	if(front == NULL || back == NULL || frontAttr == NULL || backAttr == NULL)
+	{
+		fprintf(stderr, "Out of memory\r\n");
+		exit(1);
+	}
+	// the terminal is cleared, the next frame is drawn in full
+	memset(front, ' ', n);
+	memset(frontAttr, ATTR_NORMAL, n);
+	emit("\033[0m\033[2J", 8);
+	uiDirty = 1;
+}
+
+
+static void text(int row, int col, int width, const char * s, int attr)
+{
+	char * p = back + (size_t) row * cols;
+	unsigned char * a = backAttr + (size_t) row * cols;
+
+	for(; width > 0 && col < cols; col++, width--)
+	{
+		p[col] = *s ? *s++ : ' ';
+		a[col] = attr;
+	}
+}
+
+
+static void drawTabs(void)
+{
+	char buf[96];
+	int col = 0;
+	int i;
+
+	text(0, 0, cols, "", ATTR_REVERSE);
+	for(i = 0; i < nSes && col < cols; i++)
+	{
+		struct session * s = &ses[i];
+
+		snprintf(buf, sizeof buf, " %d:%s%s ", i + 1, s->name,
+				s->fd == -1 ? "!" : s->activity ? "+" : "");
+		text(0, col, strlen(buf), buf, i == focus ? ATTR_NORMAL : ATTR_REVERSE);
+		col += strlen(buf);
+	}
+
+	if(keyState == KEY_SEARCH)
+		snprintf(buf, sizeof buf, "/%s", query);
+	else
+	if(message[0])
+		snprintf(buf, sizeof buf, "%s", message);
+	else
+	if(keyState == KEY_SCROLL)
+		snprintf(buf, sizeof buf, "scroll -%llu", (unsigned long long) ses[focus].scroll);
+	else
+	if(keyState == KEY_PREFIX)
+		snprintf(buf, sizeof buf, "CTRL-A");
+	else
+		buf[0] = 0;
+	if(buf[0] && (int) strlen(buf) + 1 < cols - col)
+		text(0, cols - strlen(buf) - 1, strlen(buf), buf, ATTR_REVERSE);
+}
+
+
+static void drawPane(struct session * s, int top, int height, int title)
+{
+	uint64_t bottom;
+	uint64_t n;
+	int row;
+
+	if(title)
+	{
+		char buf[PATH_MAX + 32];
+
+		snprintf(buf, sizeof buf, "[%d] %s%s", (int)(s - ses) + 1, s->path,
+				s->fd == -1 ? " (not connected)" : "");
+		text(top, 0, cols, buf, s == &ses[focus] ? ATTR_NORMAL : ATTR_REVERSE);
+		top++;
+		height--;
+	}
+	if(height <= 0)
+		return;
+
+	bottom = s->head - (s->scroll < s->head - oldest(s) ? s->scroll : s->head - oldest(s));
+	n = bottom + 1 >= (uint64_t) height ? bottom + 1 - height : 0;
+	if(n < oldest(s))
+		n = oldest(s);
+	for(row = top; row < top + height; row++, n++)
+	{
+		if(n <= bottom)
+		{
+			struct line * l = lineAt(s, n);
+
+			text(row, 0, cols, l->text, (int64_t) n == s->mark ? ATTR_REVERSE : ATTR_NORMAL);
+			if(s == &ses[focus] && n == s->head && s->scroll == 0)
+			{
+				curRow = row;
+				curCol = l->len < cols ? l->len : cols - 1;
+			}
+		}
+		else
+			text(row, 0, cols, "", ATTR_NORMAL);
+	}
+	s->dirty = 0;
+}
+
+
+static void render(void)
+{
+	int row;
+	int i;
+
+	curRow = -1;
+	// what is on screen now is no activity, the tab bar must not show it
+	for(i = 0; i < nSes; i++)
+	{
+		if(split || i == focus)
+			ses[i].activity = 0;
+	}
+	drawTabs();
+	if(split)
+	{
+		int h = (rows - 1) / nSes;
+		int top = 1;
+
+		for(i = 0; i < nSes; i++)
+		{
+			int height = i == nSes - 1 ? rows - top : h;
+
+			drawPane(&ses[i], top, height, 1);
+			top += height;
+		}
+	}
+	else
+		drawPane(&ses[focus], 1, rows - 1, 0);
+
+	// only the cells that changed go to the terminal
+	emit("\033[?25l", 6);
+	for(row = 0; row < rows; row++)
+	{
+		size_t o = (size_t) row * cols;
+		int first = 0;
+		int last = cols - 1;
+		int attr = -1;
+		int col;
+
+		while(first < cols && front[o + first] == back[o + first] && frontAttr[o + first] == backAttr[o + first])
+			first++;
+		if(first == cols)
+			continue;
+		while(front[o + last] == back[o + last] && frontAttr[o + last] == backAttr[o + last])
+			last--;
+
+		emitf("\033[%d;%dH", row + 1, first + 1);
+		for(col = first; col <= last; col++)
+		{
+			if(backAttr[o + col] != attr)
+			{
+				attr = backAttr[o + col];
+				emit(attr == ATTR_REVERSE ? "\033[7m" : "\033[0m", 4);
+			}
+			emit(back + o + col, 1);
+		}
+		emit("\033[0m", 4);
+		memcpy(front + o + first, back + o + first, last - first + 1);
+		memcpy(frontAttr + o + first, backAttr + o + first, last - first + 1);
+	}
+	if(curRow >= 0)
+	{
+		emitf("\033[%d;%dH", curRow + 1, curCol + 1);
+		emit("\033[?25h", 6);
+	}
+	flushOut();
+	uiDirty = 0;
+}
+
+
+/*
+ * Keys
+ */
+static int paneHeight(void)
+{
+	return split ? (rows - 1) / nSes - 1 : rows - 1;
+}
+
+
+static void scrollBy(struct session * s, int64_t n)
+{
+	uint64_t max = s->head - oldest(s);
+
+	if(n < 0 && (uint64_t) -n > s->scroll)
+		s->scroll = 0;
+	else
+		s->scroll += n;
+	if(s->scroll > max)
+		s->scroll = max;
+	uiDirty = 1;
+}
+
+
+static void search(struct session * s)
+{
+	int64_t from = s->mark != -1 ? s->mark - 1 : (int64_t)(s->head - s->scroll);
+	int64_t n;
+
+	for(n = from; n >= (int64_t) oldest(s); n--)
+	{
+		if(strcasestr(lineAt(s, n)->text, query))
+		{
+			int64_t scroll = (int64_t) s->head - n - paneHeight() / 2;
+
+			s->mark = n;
+			s->scroll = 0;
+			scrollBy(s, scroll > 0 ? scroll : 0);
+			message[0] = 0;
+			return;
+		}
+	}
+	snprintf(message, sizeof message, "not found: %s", query);
+	uiDirty = 1;
+}
+
+
+static void startSearch(void)
+{
+	keyState = KEY_SEARCH;
+	queryLen = 0;
+	query[0] = 0;
+	ses[focus].mark = -1;
+	uiDirty = 1;
+}
+
+
+static void scrollKeys(const unsigned char * p, size_t n, size_t * i)
+{
+	struct session * s = &ses[focus];
+	int page = paneHeight() > 1 ? paneHeight() - 1 : 1;
+	unsigned char c = p[*i];
+
+	message[0] = 0;
+	// cursor and page keys (ESC [ A, ESC [ 5 ~ ...) arrive in one read
+	if(c == 0x1b && *i + 1 < n && p[*i + 1] == '[')
+	{
+		unsigned char k = *i + 2 < n ? p[*i + 2] : 0;
+
+		*i += 2;
+		if(k == '5' || k == '6')
+		{
+			if(*i + 1 < n && p[*i + 1] == '~')
+				(*i)++;
+			scrollBy(s, k == '5' ? page : -page);
+		}
+		else
+		if(k == 'A' || k == 'B')
+			scrollBy(s, k == 'A' ? 1 : -1);
+		return;
+	}
+	switch(c)
+	{
+	case 'k':
+		scrollBy(s, 1);
+		break;
+	case 'j':
+		scrollBy(s, -1);
+		break;
+	case 'b':
+		scrollBy(s, page);
+		break;
+	case ' ':
+	case 'f':
+		scrollBy(s, -page);
+		break;
+	case 'g':
+		scrollBy(s, MUX_LINES);
+		break;
+	case 'G':
+		s->scroll = 0;
+		uiDirty = 1;
+		break;
+	case '/':
+		startSearch();
+		break;
+	case 'n':
+		if(queryLen)
+			search(s);
+		break;
+	case 'q':
+	case 0x1b:
+	case 0x03:
+		keyState = KEY_NORMAL;
+		s->scroll = 0;
+		s->mark = -1;
+		uiDirty = 1;
+		break;
+	}
+}
+
+
+static void keys(const unsigned char * p, size_t n)
+{
+	size_t i;
+	size_t run = 0;		// keys for the session, sent together
+
+	for(i = 0; i < n; i++)
+	{
+		unsigned char c = p[i];
+
+		switch(keyState)
+		{
+		case KEY_NORMAL:
+			if(c == MUX_PREFIX || c == 0x03)
+			{
+				sendKeys((const char *) p + i - run, run);
+				run = 0;
+				if(c == 0x03)
+					quit = 1;		// as the -C client
+				else
+					keyState = KEY_PREFIX;
+				uiDirty = 1;
+			}
+			else
+				run++;
+			break;
+
+		case KEY_PREFIX:
+			keyState = KEY_NORMAL;
+			uiDirty = 1;
+			if(c >= '1' && c <= '9' && c - '1' < nSes)
+				focus = c - '1';
+			else
+			switch(c)
+			{
+			case 'n':
+				focus = (focus + 1) % nSes;
+				break;
+			case 'p':
+				focus = (focus + nSes - 1) % nSes;
+				break;
+			case 's':
+				split = !split;
+				break;
+			case '[':
+				keyState = KEY_SCROLL;
+				break;
+			case '/':
+				startSearch();
+				break;
+			case 'q':
+			case 0x03:
+				quit = 1;
+				break;
+			case MUX_PREFIX:
+				sendKeys((const char *) &c, 1);
+				break;
+			}
+			break;
+
+		case KEY_SCROLL:
+			scrollKeys(p, n, &i);
+			break;
+
+		case KEY_SEARCH:
+			uiDirty = 1;
+			if(c == '\r' || c == '\n')
+			{
+				keyState = KEY_SCROLL;
+				if(queryLen)
+					search(&ses[focus]);
+			}
+			else
+			if(c == 0x1b || c == 0x03)
+				keyState = KEY_SCROLL;
+			else
+			if((c == 0x08 || c == 0x7f) && queryLen)
+				query[--queryLen] = 0;
+			else
+			if(c >= 0x20 && c < 0x7f && queryLen < sizeof(query) - 1)
+			{
+				query[queryLen++] = c;
+				query[queryLen] = 0;
+			}
+			break;
+		}
+	}
+	sendKeys((const char *) p + n - run, run);
+}
+
+
+static int addSession(const char * path)
+{
+	struct session * s;
+	const char * b = strrchr(path, '/');
+	char * dot;
+
+	if(nSes == MUX_SESSIONS)
+		return -1;
+	if(strlen(path) >= sizeof(((struct sockaddr_un *) 0)->sun_path))
+	{
+		fprintf(stderr, "Socket path %s is too long\r\n", path);
+		return -1;
+	}
+	s = &ses[nSes];
+	s->line = calloc(MUX_LINES, sizeof(struct line));
+	if(s->line == NULL)
+		return -1;
+	strncpy(s->path, path, sizeof(s->path) - 1);
+	strncpy(s->name, b ? b + 1 : path, sizeof(s->name) - 1);
+	if((dot = strrchr(s->name, '.')) != NULL && dot != s->name)
+		*dot = 0;
+	s->fd = -1;
+	s->mark = -1;
+	nSes++;
+	return 0;
+}
+
+
+int muxRun(char * sockets)
+{
+	struct termios org;
+	struct termios raw;
+	uint64_t lastFrame = 0;
+	char line[PATH_MAX];
+	char * s;
+	int i;
+
+	if(sockets[0] == '@')
+	{
+		FILE * f = fopen(sockets + 1, "r");
+
+		if(f == NULL)
+		{
+			fprintf(stderr, "Can't open %s (%s)\r\n", sockets + 1, strerror(errno));
+			return 2;
+		}
+		while(fgets(line, sizeof line, f))
+		{
+			line[strcspn(line, "\r\n")] = 0;
+			if(line[0] && line[0] != '#')
+				addSession(line);
+		}
+		fclose(f);
+	}
+	else
+	{
+		for(s = strtok(sockets, ","); s; s = strtok(NULL, ","))
+			addSession(s);
+	}
+	if(nSes == 0)
+	{
+		fprintf(stderr, "No daemon sockets given\r\n");
+		return 2;
+	}
+	for(i = 0; i < nSes; i++)
+	{
+		attach(&ses[i]);
+		if(ses[i].fd == -1)
+			notice(&ses[i], "--- no daemon, retrying ---");
+	}
+
+	if(tcgetattr(0, &org) != 0)
+	{
+		fprintf(stderr, "The console needs a terminal\r\n");
+		return 2;
+	}
+	raw = org;
+	cfmakeraw(&raw);
+	tcsetattr(0, TCSANOW, &raw);
+	signal(SIGWINCH, winch);
+	signal(SIGPIPE, SIG_IGN);
+	emit("\033[?1049h", 8);		// alternate screen
+
+	while(!quit)
+	{
+		struct pollfd p[MUX_SESSIONS + 1];
+		uint64_t now = nowMs();
+		int timeout = MUX_RETRY;
+		int dirty = uiDirty;
+
+		if(resized)
+			resize();
+
+		for(i = 0; i < nSes; i++)
+		{
+			dirty |= ses[i].dirty && (split || i == focus);
+			if(ses[i].fd == -1 && now >= ses[i].retry)
+				attach(&ses[i]);
+		}
+		if(dirty)
+		{
+			// the screen is updated at most every MUX_FRAME ms, reading never waits for it
+			if(now - lastFrame >= MUX_FRAME)
+			{
+				render();
+				lastFrame = now;
+			}
+			else
+				timeout = MUX_FRAME - (now - lastFrame);
+		}
+
+		p[0].fd = 0;
+		p[0].events = POLLIN;
+		for(i = 0; i < nSes; i++)
+		{
+			p[i + 1].fd = ses[i].fd;
+			p[i + 1].events = POLLIN;
+		}
+		if(poll(p, nSes + 1, timeout) < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			break;
+		}
+
+		for(i = 0; i < nSes; i++)
+		{
+			char buf[65536];
+			ssize_t n;
+
+			if(ses[i].fd == -1 || p[i + 1].revents == 0)
+				continue;
+			n = read(ses[i].fd, buf, sizeof buf);
+			if(n > 0)
+			{
+				putText(&ses[i], buf, n);
+				if(!split && i != focus && !ses[i].activity)
+					ses[i].activity = uiDirty = 1;
+			}
+			else
+			if(n == 0 || (errno != EAGAIN && errno != EINTR))
+				detach(&ses[i]);
+		}
+		if(p[0].revents)
+		{
+			unsigned char buf[4096];
+			ssize_t n = read(0, buf, sizeof buf);
+
+			if(n <= 0)
+				break;
+			keys(buf, n);
+		}
+	}
+
+	emit("\033[0m\033[?25h\033[?1049l", 19);
+	flushOut();
+	tcsetattr(0, TCSANOW, &org);
+	for(i = 0; i < nSes; i++)
+	{
+		if(ses[i].fd != -1)
+			close(ses[i].fd);
+		free(ses[i].line);
+	}
+	return 0;
+}
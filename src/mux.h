@@ -0,0 +1,29 @@
+/*
+ ============================================================================
+ Name        : mux.h
+ Author      : F. Erckenbrecht / dg1yfe
+ Copyright   : GPL
+ Description : Text UI showing the consoles of several daemons as tabs or
+               panes, with scrollback and search
+ ============================================================================
+ */
+
+#ifndef MUX_H_
+#define MUX_H_
+
+/*
+ * sockets is a comma separated list of daemon sockets (-S) or @file with
+ * one socket per line. Every daemon is attached to; the serial ports stay
+ * with the daemons, a slow screen never holds up a TNC. Keys go to the
+ * session in front, CTRL-A starts a command:
+ *
+ *   n / p / 1..9   next, previous, n-th session
+ *   s              all sessions as panes / one session
+ *   [              scrollback: arrows, PgUp/PgDn, g/G, / search, n next, q
+ *   /              search the scrollback
+ *   q              quit (also CTRL-C)
+ *   CTRL-A         send CTRL-A
+ */
+int muxRun(char * sockets);
+
+#endif /* MUX_H_ */
@@ -0,0 +1,435 @@
+/*
+ ============================================================================
+ Name        : nameidx.c
+ Author      : F. Erckenbrecht / dg1yfe
+ Copyright   : GPL
+ Description : Case-insensitive index of the served directories, maps the
+               DOS style names of the TNC to host file names
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#include "OpenRS.h"
+#include "nameidx.h"
+#include "dlog.h"
+
+#define NAMEIDX_DIRS	16		// directories indexed at the same time
+
+#ifdef __linux__
+#define WATCH_MASK	(IN_CREATE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+#endif
+
+struct nameEntry {
+	struct nameEntry *	next;
+	uint32_t			hash;
+	char *				key;		// lower case name or 8.3 alias
+	char *				real;		// host name
+};
+
+struct nameDir {
+	char *				path;		// relative to the served directory, "" for itself
+	int					wd;			// inotify watch, -1: none
+	int					stale;		// rebuild before the next lookup
+	time_t				mtime;		// of the directory, without inotify
+	uint64_t			used;
+	struct nameEntry **	bucket;
+	size_t				buckets;	// power of 2
+	size_t				count;
+};
+
+static struct nameDir dirs[NAMEIDX_DIRS];
+static int inotifyFd = -2;		// -2: not initialized, -1: not available
+static uint64_t useClock = 0;
+
+
+static uint32_t hashStr(const char * s)
+{
+	uint32_t h = 2166136261u;
+
+	while(*s)
+	{
+		h ^= (unsigned char) *s++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+
+static void lower(char * d, const char * s, size_t len)
+{
+	size_t i;
+
+	for(i = 0; i + 1 < len && s[i]; i++)
+		d[i] = tolower((unsigned char) s[i]);
+	d[i] = 0;
+}
+
+
+static int validChar(int c)
+{
+	return isalnum(c) || (c > 0x7f) || strchr("!#$%&'()-@^_`{}~", c) != NULL;
+}
+
+
+void nameAlias(const char * name, char alias[13])
+{
+	const char * dot = strrchr(name, '.');
+	size_t baseLen;
+	size_t extLen;
+	char base[3];
+	char ext[4];
+	size_t i;
+	size_t n;
+
+	if(dot == name)
+		dot = NULL;		// a leading dot is part of the name
+	baseLen = dot ? (size_t)(dot - name) : strlen(name);
+	extLen = dot ? strlen(dot + 1) : 0;
+
+	if(strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+	{
+		strcpy(alias, name);
+		return;
+	}
+
+	// a valid 8.3 name stays as it is
+	if(baseLen >= 1 && baseLen <= 8 && extLen <= 3 && (!dot || extLen))
+	{
+		for(i = 0; name[i] && (validChar((unsigned char) name[i]) || name + i == dot); i++)
+			;
+		if(name[i] == 0)
+		{
+			lower(alias, name, 13);
+			return;
+		}
+	}
+
+	for(i = n = 0; i < baseLen && n < 2; i++)
+	{
+		if(validChar((unsigned char) name[i]))
+			base[n++] = tolower((unsigned char) name[i]);
+	}
+	if(n == 0)
+		base[n++] = '_';
+	base[n] = 0;
+
+	for(i = n = 0; dot && dot[1 + i] && n < 3; i++)
+	{
+		if(validChar((unsigned char) dot[1 + i]))
+			ext[n++] = tolower((unsigned char) dot[1 + i]);
+	}
+	ext[n] = 0;
+
+	snprintf(alias, 13, "%s%04x~1%s%s", base, (unsigned) (hashStr(name) & 0xffff), n ? "." : "", ext);
+}
+
+
+static struct nameEntry * lookup(struct nameDir * d, const char * key)
+{
+	uint32_t h = hashStr(key);
+	struct nameEntry * e;
+
+	if(d->buckets == 0)
+		return NULL;
+	for(e = d->bucket[h & (d->buckets - 1)]; e; e = e->next)
+	{
+		if(e->hash == h && strcmp(e->key, key) == 0)
+			return e;
+	}
+	return NULL;
+}
+
+
+static void tableAdd(struct nameDir * d, const char * key, const char * real)
+{
+	struct nameEntry * e = lookup(d, key);
+	size_t i;
+
+	if(e)
+	{
+		// "a.txt" and "A.txt" on a case sensitive file system: the lower case one wins
+		if(strcmp(real, key) == 0 && strcmp(e->real, key) != 0)
+		{
+			char * r = strdup(real);
+
+			if(r)
+			{
+				free(e->real);
+				e->real = r;
+			}
+		}
+		return;
+	}
+
+	if(d->count >= d->buckets)
+	{
+		size_t buckets = d->buckets ? d->buckets * 2 : 64;
+		struct nameEntry ** b = calloc(buckets, sizeof(*b));
+
+		if(b == NULL)
+			return;
+		for(i = 0; i < d->buckets; i++)
+		{
+			while(d->bucket[i])
+			{
+				e = d->bucket[i];
+				d->bucket[i] = e->next;
+				e->next = b[e->hash & (buckets - 1)];
+				b[e->hash & (buckets - 1)] = e;
+			}
+		}
+		free(d->bucket);
+		d->bucket = b;
+		d->buckets = buckets;
+	}
+
+	e = calloc(1, sizeof(*e));
+	if(e == NULL)
+		return;
+	e->key = strdup(key);
+	e->real = strdup(real);
+	if(e->key == NULL || e->real == NULL)
+	{
+		free(e->key);
+		free(e->real);
+		free(e);
+		return;
+	}
+	e->hash = hashStr(key);
+	e->next = d->bucket[e->hash & (d->buckets - 1)];
+	d->bucket[e->hash & (d->buckets - 1)] = e;
+	d->count++;
+}
+
+
+static void entryAdd(struct nameDir * d, const char * real)
+{
+	char key[NAME_MAX + 1];
+	char alias[13];
+
+	lower(key, real, sizeof key);
+	tableAdd(d, key, real);
+	nameAlias(real, alias);
+	if(strcmp(alias, key) != 0)
+		tableAdd(d, alias, real);
+}
+
+
+static void dirClear(struct nameDir * d)
+{
+	size_t i;
+
+	for(i = 0; i < d->buckets; i++)
+	{
+		while(d->bucket[i])
+		{
+			struct nameEntry * e = d->bucket[i];
+
+			d->bucket[i] = e->next;
+			free(e->key);
+			free(e->real);
+			free(e);
+		}
+	}
+	d->count = 0;
+}
+
+
+static void dirBuild(struct nameDir * d)
+{
+	const char * path = *d->path ? d->path : ".";
+	struct dirent * de;
+	struct stat st;
+	DIR * dir;
+
+	dirClear(d);
+	d->stale = 0;
+#ifdef __linux__
+	// watch first, a file created during the scan must not be missed
+	if(d->wd == -1 && inotifyFd >= 0)
+		d->wd = inotify_add_watch(inotifyFd, path, WATCH_MASK);
+	d->stale = d->wd == -1;		// not watched, e.g. the directory is missing
+#endif
+	if(stat(path, &st) == 0)
+		d->mtime = st.st_mtime;
+
+	dir = opendir(path);
+	if(dir == NULL)
+		return;
+	while((de = readdir(dir)) != NULL)
+	{
+		if(strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0)
+			entryAdd(d, de->d_name);
+	}
+	closedir(dir);
+	DLOGS(DLOG_DETAIL, "name index: %s", path, 0, 0);
+}
+
+
+static struct nameDir * dirGet(const char * path)
+{
+	struct nameDir * d = NULL;
+	int i;
+
+	for(i = 0; i < NAMEIDX_DIRS; i++)
+	{
+		if(dirs[i].path && strcmp(dirs[i].path, path) == 0)
+		{
+			d = &dirs[i];
+			break;
+		}
+		// a free slot or the one not used for the longest time
+		if(d == NULL || (d->path && (dirs[i].path == NULL || dirs[i].used < d->used)))
+			d = &dirs[i];
+	}
+
+	if(d->path == NULL || strcmp(d->path, path) != 0)
+	{
+		char * p = strdup(path);
+
+		if(p == NULL)
+			return NULL;
+#ifdef __linux__
+		if(d->path && d->wd >= 0)
+			inotify_rm_watch(inotifyFd, d->wd);
+#endif
+		free(d->path);
+		d->path = p;
+		d->wd = -1;
+		d->stale = 1;
+	}
+
+#ifndef __linux__
+	{
+		struct stat st;
+
+		if(stat(*path ? path : ".", &st) == 0 && st.st_mtime != d->mtime)
+			d->stale = 1;
+	}
+#endif
+	if(d->stale)
+		dirBuild(d);
+	d->used = ++useClock;
+	return d;
+}
+
+
+// apply the changes inotify reported since the last lookup
+static void drain(void)
+{
+#ifdef __linux__
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	ssize_t n;
+
+	if(inotifyFd == -2)
+		inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if(inotifyFd < 0)
+	{
+		int i;
+
+		// no inotify (e.g. the watch limit is reached): rebuild for every lookup
+		for(i = 0; i < NAMEIDX_DIRS; i++)
+			dirs[i].stale = 1;
+		return;
+	}
+
+	while((n = read(inotifyFd, buf, sizeof buf)) > 0)
+	{
+		char * p;
+
+		for(p = buf; p < buf + n;)
+		{
+			struct inotify_event * ev = (struct inotify_event *) p;
+			int i;
+
+			p += sizeof(*ev) + ev->len;
+			for(i = 0; i < NAMEIDX_DIRS; i++)
+			{
+				struct nameDir * d = &dirs[i];
+
+				if(ev->mask & IN_Q_OVERFLOW)
+					d->stale = 1;
+				if(d->path == NULL || d->wd != ev->wd)
+					continue;
+				if(ev->mask & IN_IGNORED)
+				{
+					d->wd = -1;
+					d->stale = 1;
+				}
+				else
+				if((ev->mask & (IN_CREATE | IN_MOVED_TO)) && ev->len && !d->stale)
+					entryAdd(d, ev->name);
+				else
+				if(ev->mask & (IN_DELETE | IN_MOVED_FROM | IN_DELETE_SELF | IN_MOVE_SELF))
+					d->stale = 1;	// aliases may belong to other names now, rebuild
+			}
+		}
+	}
+#endif
+}
+
+
+int nameResolve(const char * path, char * real, size_t len)
+{
+	char dir[PATH_MAX];
+	char key[NAME_MAX + 1];
+	size_t n = 0;
+	int found = 1;
+
+	if(len)
+		*real = 0;
+	drain();
+	dir[0] = 0;
+	while(*path)
+	{
+		const char * end = strchr(path, '/');
+		size_t l = end ? (size_t)(end - path) : strlen(path);
+		const char * comp = path;
+		struct nameEntry * e = NULL;
+
+		path += l;
+		while(*path == '/')
+			path++;
+		if(l == 0 || l > NAME_MAX || (l == 1 && *comp == '.'))
+			continue;
+
+		memcpy(key, comp, l);
+		key[l] = 0;
+		if(found && strcmp(key, "..") != 0)
+		{
+			struct nameDir * d = dirGet(dir);
+
+			lower(key, key, sizeof key);
+			e = d ? lookup(d, key) : NULL;
+			if(e == NULL)
+				found = 0;		// the rest is taken as given
+		}
+		if(e == NULL)
+		{
+			memcpy(key, comp, l);
+			key[l] = 0;
+		}
+		if(n + l + 2 > sizeof dir)
+			return -1;
+		n += snprintf(dir + n, sizeof dir - n, "%s%s", n ? "/" : "", e ? e->real : key);
+	}
+	if(n + 1 > len)
+		return -1;
+	memcpy(real, dir, n + 1);
+	return found ? 0 : -1;
+}
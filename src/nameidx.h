@@ -0,0 +1,30 @@
+/*
+ ============================================================================
+ Name        : nameidx.h
+ Author      : F. Erckenbrecht / dg1yfe
+ Copyright   : GPL
+ Description : Case-insensitive index of the served directories, maps the
+               DOS style names of the TNC to host file names
+ ============================================================================
+ */
+
+#ifndef NAMEIDX_H_
+#define NAMEIDX_H_
+
+#include <stddef.h>
+
+/*
+ * Every directory a name is looked up in gets a hash table of its entries,
+ * keyed by the lower case name and by the 8.3 alias of names that are no
+ * valid 8.3 names. The table is kept up to date with inotify (elsewhere the
+ * directory mtime is checked), a lookup does not touch the file system.
+ *
+ * nameResolve() translates each component of path (relative, '/'
+ * separated) to the host name, 0 if the entry exists, -1 if not.
+ * nameAlias() is the name a listing shows for name: name itself in lower
+ * case if it is a valid 8.3 name, otherwise "<2 chars><4 hex>~1.<ext>".
+ */
+int nameResolve(const char * path, char * real, size_t len);
+void nameAlias(const char * name, char alias[13]);
+
+#endif /* NAMEIDX_H_ */
@@ -0,0 +1,428 @@
+/*
+ ============================================================================
+ Name        : preenc.c
+ Author      : F. Erckenbrecht / dg1yfe
+ Copyright   : GPL
+ Description : Pre-escaped images: a file stored escaped for the TNC
+               protocol, FREAD sends slices of it without per byte work
+ ============================================================================
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "OpenRS.h"
+#include "preenc.h"
+#include "fastread.h"
+#include "digest.h"
+#include "transport.h"
+#include "vfs.h"
+#include "dlog.h"
+
+#define HEADER_SIZE	40
+
+struct preenc {
+	int						h;			// handle the stream belongs to
+	int						fd;
+	unsigned char *			map;
+	size_t					mapSize;
+	const unsigned char *	index;
+	const unsigned char *	data;
+	off_t					dataOff;	// of the escaped data in the file
+	uint64_t				rawSize;
+	uint64_t				encSize;
+	unsigned				stride;
+	uint32_t				entries;
+	uint64_t				pos;		// stream position, raw and escaped
+	uint64_t				encPos;
+};
+
+
+static uint64_t rd64(const unsigned char * p)
+{
+	uint64_t v = 0;
+	int i;
+
+	for(i = 7; i >= 0; i--)
+		v = (v << 8) | p[i];
+	return v;
+}
+
+
+static void wr64(unsigned char * p, uint64_t v)
+{
+	int i;
+
+	for(i = 0; i < 8; i++, v >>= 8)
+		p[i] = (unsigned char) v;
+}
+
+
+static uint32_t rd32(const unsigned char * p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+
+static void wr32(unsigned char * p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+
+/*
+ * Escaped offset of raw offset pos: index entry, then at most one stride
+ */
+static uint64_t encOffset(struct preenc * pe, uint64_t pos)
+{
+	uint64_t k = pos >> pe->stride;
+	uint64_t r = k << pe->stride;
+	uint64_t e = rd64(pe->index + 8 * k);
+
+	for(; r < pos; r++)
+		e += pe->data[e] == 0x10 ? 2 : 1;
+	return e;
+}
+
+
+int preencEncode(const char * path)
+{
+	char out[PATH_MAX - 8];
+	char tmp[PATH_MAX];
+	unsigned char hdr[HEADER_SIZE];
+	unsigned char * idx;
+	unsigned char * raw;
+	struct stat st;
+	uint32_t entries;
+	uint64_t enc = 0;
+	uint64_t i;
+	FILE * f;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if(fd == -1 || fstat(fd, &st) != 0)
+	{
+		fprintf(stderr, "Can't open %s (%s)\r\n", path, strerror(errno));
+		return -1;
+	}
+	raw = st.st_size ? mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0) : NULL;
+	close(fd);
+	if(raw == MAP_FAILED)
+	{
+		perror("mmap");
+		return -1;
+	}
+
+	entries = (uint32_t) ((st.st_size >> PREENC_STRIDE) + 1);
+	idx = malloc(8 * (size_t) entries);
+	snprintf(out, sizeof out, "%s" PREENC_EXT, path);
+	snprintf(tmp, sizeof tmp, "%s.tmp", out);
+	f = fopen(tmp, "wb");
+	if(idx == NULL || f == NULL)
+	{
+		fprintf(stderr, "Can't write %s (%s)\r\n", tmp, strerror(errno));
+		return -1;
+	}
+
+	// header and index are written again once the offsets are known
+	fseeko(f, HEADER_SIZE + 8 * (off_t) entries, SEEK_SET);
+	for(i = 0; i < (uint64_t) st.st_size; i++)
+	{
+		unsigned char c = raw[i];
+
+		if((i & ((1 << PREENC_STRIDE) - 1)) == 0)
+			wr64(idx + 8 * (i >> PREENC_STRIDE), enc);
+		if(c == 0x02 || c == 0x03 || c == 0x10)
+		{
+			putc(0x10, f);
+			enc++;
+		}
+		putc(c, f);
+		enc++;
+	}
+	if((i & ((1 << PREENC_STRIDE) - 1)) == 0)
+		wr64(idx + 8 * (i >> PREENC_STRIDE), enc);
+
+	memcpy(hdr, "ORSE", 4);
+	hdr[4] = 1;
+	hdr[5] = PREENC_STRIDE;
+	hdr[6] = hdr[7] = 0;
+	wr64(hdr + 8, st.st_size);
+	wr64(hdr + 16, enc);
+	wr64(hdr + 24, st.st_mtime);
+	wr32(hdr + 32, crc32c(0, raw, st.st_size));
+	wr32(hdr + 36, entries);
+	fseeko(f, 0, SEEK_SET);
+	fwrite(hdr, 1, sizeof hdr, f);
+	fwrite(idx, 8, entries, f);
+	free(idx);
+	if(raw)
+		munmap(raw, st.st_size);
+
+	if(fclose(f) != 0 || rename(tmp, out) != 0)
+	{
+		fprintf(stderr, "Can't write %s (%s)\r\n", out, strerror(errno));
+		return -1;
+	}
+	printf("%s: %llu bytes, %llu escaped (+%.1f%%)\r\n", out, (unsigned long long) st.st_size,
+			(unsigned long long) enc, st.st_size ? (enc - st.st_size) * 100.0 / st.st_size : 0.0);
+	return 0;
+}
+
+
+static ssize_t peRead(void * cookie, char * buf, size_t size)
+{
+	struct preenc * pe = cookie;
+	size_t n = 0;
+
+	while(n < size && pe->pos < pe->rawSize)
+	{
+		const unsigned char * p = pe->data + pe->encPos;
+
+		if(*p == 0x10)
+		{
+			buf[n++] = p[1];
+			pe->encPos += 2;
+			pe->pos++;
+		}
+		else
+		{
+			size_t k = size - n;
+			const unsigned char * e;
+
+			if(k > pe->rawSize - pe->pos)
+				k = pe->rawSize - pe->pos;
+			e = memchr(p, 0x10, k);
+			if(e)
+				k = e - p;
+			memcpy(buf + n, p, k);
+			n += k;
+			pe->encPos += k;
+			pe->pos += k;
+		}
+	}
+	return n;
+}
+
+
+static ssize_t peWrite(void * cookie, const char * buf, size_t size)
+{
+	errno = EROFS;
+	return -1;
+}
+
+
+static int peSeek(void * cookie, int64_t * offset, int whence)
+{
+	struct preenc * pe = cookie;
+	int64_t pos;
+
+	switch(whence)
+	{
+	case SEEK_SET:
+		pos = *offset;
+		break;
+	case SEEK_CUR:
+		pos = pe->pos + *offset;
+		break;
+	case SEEK_END:
+		pos = pe->rawSize + *offset;
+		break;
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+	if(pos < 0)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	pe->pos = pos;
+	pe->encPos = encOffset(pe, (uint64_t) pos < pe->rawSize ? (uint64_t) pos : pe->rawSize);
+	*offset = pos;
+	return 0;
+}
+
+
+static int peClose(void * cookie)
+{
+	struct preenc * pe = cookie;
+
+	if(Handle[pe->h].pe == pe)
+		Handle[pe->h].pe = NULL;
+	munmap(pe->map, pe->mapSize);
+	close(pe->fd);
+	free(pe);
+	return 0;
+}
+
+
+#ifdef __APPLE__
+static int peReadBsd(void * cookie, char * buf, int size)
+{
+	return peRead(cookie, buf, size);
+}
+
+
+static int peWriteBsd(void * cookie, const char * buf, int size)
+{
+	return peWrite(cookie, buf, size);
+}
+
+
+static fpos_t peSeekBsd(void * cookie, fpos_t offset, int whence)
+{
+	int64_t o = offset;
+
+	if(peSeek(cookie, &o, whence) != 0)
+		return -1;
+	return o;
+}
+#endif
+
+
+FILE * preencOpen(int h, const char * path, const char * mode)
+{
+	char name[PATH_MAX];
+	struct preenc * pe;
+	struct stat st;
+	struct stat rst;
+	const unsigned char * m;
+	FILE * f;
+
+	if(vfs != &vfsHost || strpbrk(mode, "wa+tT"))
+		return NULL;
+
+	snprintf(name, sizeof name, "%s" PREENC_EXT, path);
+	pe = calloc(1, sizeof(*pe));
+	if(pe == NULL)
+		return NULL;
+	pe->fd = open(name, O_RDONLY);
+	if(pe->fd == -1 || fstat(pe->fd, &st) != 0 || st.st_size < HEADER_SIZE)
+		goto fail;
+	pe->mapSize = st.st_size;
+	pe->map = mmap(NULL, pe->mapSize, PROT_READ, MAP_SHARED, pe->fd, 0);
+	if(pe->map == MAP_FAILED)
+	{
+		pe->map = NULL;
+		goto fail;
+	}
+
+	m = pe->map;
+	pe->stride = m[5];
+	pe->rawSize = rd64(m + 8);
+	pe->encSize = rd64(m + 16);
+	pe->entries = rd32(m + 36);
+	pe->dataOff = HEADER_SIZE + 8 * (off_t) pe->entries;
+	if(memcmp(m, "ORSE", 4) != 0 || m[4] != 1 || pe->stride > 30 ||
+		pe->entries != (pe->rawSize >> pe->stride) + 1 ||
+		(uint64_t) st.st_size != pe->dataOff + pe->encSize)
+	{
+		fprintf(stderr, "%s is not a valid pre-escaped image, ignored\r\n", name);
+		goto fail;
+	}
+
+	// a stale image must not be served in place of a newer file
+	if(stat(path, &rst) == 0 && ((uint64_t) rst.st_size != pe->rawSize || (uint64_t) rst.st_mtime != rd64(m + 24)))
+	{
+		fprintf(stderr, "%s does not match %s, ignored\r\n", name, path);
+		goto fail;
+	}
+
+	pe->index = m + HEADER_SIZE;
+	pe->data = m + pe->dataOff;
+	pe->h = h;
+
+#ifdef __APPLE__
+	f = funopen(pe, peReadBsd, peWriteBsd, peSeekBsd, peClose);
+#else
+	{
+		cookie_io_functions_t io = { peRead, peWrite, peSeek, peClose };
+		f = fopencookie(pe, mode, io);
+	}
+#endif
+	if(f == NULL)
+		goto fail;
+	Handle[h].pe = pe;
+	DLOGS(DLOG_REQUEST, "%s served pre-escaped", name, 0, 0);
+	return f;
+
+fail:
+	if(pe->map)
+		munmap(pe->map, pe->mapSize);
+	if(pe->fd != -1)
+		close(pe->fd);
+	free(pe);
+	return NULL;
+}
+
+
+int preencRead(int h, uint32_t count)
+{
+	struct preenc * pe = Handle[h].pe;
+	FILE * f = File[h];
+	off_t pos;
+	uint64_t end;
+	uint64_t e0, e1;
+	int out;
+
+	// checksums need the raw bytes, ungetc() data is in the stream buffer
+	if(pe == NULL || f == NULL || Handle[h].pushback || Handle[h].digest)
+		return -1;
+
+	pos = ftello(f);
+	if(pos == -1)
+		return -1;
+
+	// after an FSEEK past EOF there is nothing to send, the position stays
+	if((uint64_t) pos > pe->rawSize)
+		pos = pe->rawSize;
+	end = pos + count;
+	if(end > pe->rawSize)
+		end = pe->rawSize;
+	e0 = encOffset(pe, pos);
+	e1 = encOffset(pe, end);
+
+	if(e1 > e0)
+	{
+		out = portRawFd();
+		if(out != -1)
+		{
+			if(portSendRun(out, pe->fd, pe->dataOff + e0, pe->data + e0, e1 - e0) != 0)
+			{
+				perror("Unrecoverable Error while writing to serial port. Exiting...\r\n");
+				exit(errno);
+			}
+		}
+		else
+		{
+			portWrite(pe->data + e0, e1 - e0);
+			portTxBytes += e1 - e0;
+		}
+	}
+
+	// beyond EOF every requested byte is answered with 0x03
+	for(count -= end - pos; count; count--)
+	{
+		putPort(0x03);
+	}
+
+	if(end > (uint64_t) pos)
+		fseeko(f, end, SEEK_SET);
+	Handle[h].bytes += end - pos;
+	DLOG(DLOG_DETAIL, "FREAD pre-escaped: %u bytes, %u on the wire", (uint32_t) (end - pos), (uint32_t) (e1 - e0), 0);
+	return 0;
+}
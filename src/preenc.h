@@ -0,0 +1,36 @@
+/*
+ ============================================================================
+ Name        : preenc.h
+ Author      : F. Erckenbrecht / dg1yfe
+ Copyright   : GPL
+ Description : Pre-escaped images: a file stored escaped for the TNC
+               protocol, FREAD sends slices of it without per byte work
+ ============================================================================
+ */
+
+#ifndef PREENC_H_
+#define PREENC_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define PREENC_EXT		".rse"
+#define PREENC_STRIDE	12		// log2 of the raw bytes between index entries
+
+/*
+ * <file>.rse, little endian:
+ *
+ *    0  "ORSE", version, stride (log2), 2 reserved
+ *    8  raw size, escaped size, raw mtime (64 bit each)
+ *   32  CRC32C of the raw data, number of index entries (32 bit each)
+ *   40  index: escaped offset of raw offset n << stride (64 bit each)
+ *       escaped data, 0x02 / 0x03 / 0x10 preceded by 0x10 as putcEsc() does
+ *
+ * A TNC read request for <file> is served from <file>.rse if it exists
+ * and matches the size and mtime of <file> (or <file> is missing).
+ */
+int preencEncode(const char * path);
+FILE * preencOpen(int h, const char * path, const char * mode);
+int preencRead(int h, uint32_t count);	// 0: request served, -1: use the other paths
+
+#endif /* PREENC_H_ */
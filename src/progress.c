@@ -0,0 +1,247 @@
+/*
+ ============================================================================
+ Name        : progress.c
+ Author      : F. Erckenbrecht / dg1yfe
+ Copyright   : GPL
+ Description : Live status of the open handles: bytes moved, rate, line
+               efficiency and ETA
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+
+#include "OpenRS.h"
+#include "progress.h"
+
+#define PROGRESS_INTERVAL	0.5		// s between updates
+#define PROGRESS_STALL		2.0		// s without data until a transfer is shown as stalled
+
+struct progress {
+	int			active;
+	char		name[64];
+	uint64_t	size;		// 0: unknown
+	double		start;
+	double		lastData;	// last time bytes moved
+	uint64_t	lastBytes;
+	double		rate;		// smoothed bytes/s
+};
+
+static int enabled = 0;
+static int toConsole = 0;
+static char * statusName = NULL;
+static double lineRate;		// bytes/s, 8N1
+static struct progress P[MAXFPTR];
+static double lastUpdate = 0;
+static uint32_t lastWire;
+static double overhead = 0;
+static int shown = 0;		// a status line is on the console
+
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static const char * hms(char * buf, size_t len, double s)
+{
+	long t = (long) (s + 0.5);
+
+	if(t >= 3600)
+		snprintf(buf, len, "%ld:%02ld:%02ld", t / 3600, (t / 60) % 60, t % 60);
+	else
+		snprintf(buf, len, "%ld:%02ld", t / 60, t % 60);
+	return buf;
+}
+
+
+/*
+ * Length of a snprintf() result that is actually in buf (len > 0)
+ */
+static int fitted(int n, size_t len)
+{
+	if(n < 0)
+		return 0;
+	return (size_t) n < len ? n : (int) len - 1;
+}
+
+
+static int render(char * buf, size_t len, int h, double t)
+{
+	struct progress * p = &P[h];
+	uint64_t bytes = Handle[h].bytes;
+	double avg = t > p->start ? bytes / (t - p->start) : 0;
+	char a[32];
+	int n;
+
+	if(p->size)
+		n = snprintf(buf, len, "%s %llu/%llu %d%%", p->name, (unsigned long long) bytes,
+				(unsigned long long) p->size, (int) (bytes * 100 / p->size));
+	else
+		n = snprintf(buf, len, "%s %llu", p->name, (unsigned long long) bytes);
+	n = fitted(n, len);
+
+	n += snprintf(buf + n, len - n, ", %.0f B/s (avg %.0f), eff %.0f%%, ovh %.0f%%",
+			p->rate, avg, p->rate * 100 / lineRate, overhead > 0 ? overhead * 100 : 0);
+	n = fitted(n, len);
+
+	if(t - p->lastData >= PROGRESS_STALL)
+		n += snprintf(buf + n, len - n, ", stalled %s", hms(a, sizeof a, t - p->lastData));
+	else
+	if(p->size && p->rate > 0 && bytes < p->size)
+		n += snprintf(buf + n, len - n, ", ETA %s", hms(a, sizeof a, (p->size - bytes) / p->rate));
+	return fitted(n, len);
+}
+
+
+static void writeStatus(double t)
+{
+	char tmp[PATH_MAX];
+	char line[256];
+	FILE * f;
+	int h;
+
+	snprintf(tmp, sizeof tmp, "%s.tmp", statusName);
+	f = fopen(tmp, "w");
+	if(f == NULL)
+		return;
+	for(h = 0; h < MAXFPTR; h++)
+	{
+		if(P[h].active)
+		{
+			render(line, sizeof line, h, t);
+			fprintf(f, "%d %s\n", h + 1, line);
+		}
+	}
+	fclose(f);
+	rename(tmp, statusName);		// readers never see a partial file
+}
+
+
+int progressInit(int console, const char * statusFile, int bitrate)
+{
+	enabled = 1;
+	toConsole = console;
+	lineRate = bitrate > 0 ? bitrate / 10.0 : 1;
+	if(statusFile)
+	{
+		statusName = strdup(statusFile);
+		if(statusName == NULL)
+			return -1;
+	}
+	return 0;
+}
+
+
+void progressOpen(int h, const char * name, uint64_t size)
+{
+	struct progress * p = &P[h];
+
+	if(!enabled)
+		return;
+	progressClose(h);
+	snprintf(p->name, sizeof p->name, "%s", name);
+	p->size = size;
+	p->start = p->lastData = now();
+	p->lastBytes = 0;
+	p->rate = 0;
+	p->active = 1;
+}
+
+
+void progressClose(int h)
+{
+	struct progress * p = &P[h];
+	double t;
+	char a[16];
+
+	if(!p->active)
+		return;
+	p->active = 0;
+
+	t = now() - p->start;
+	if(toConsole)
+	{
+		fprintf(stderr, "%s%s: %llu bytes in %s, %.0f B/s, eff %.0f%%\r\n",
+				shown ? "\r\033[K" : "", p->name, (unsigned long long) Handle[h].bytes,
+				hms(a, sizeof a, t), t > 0 ? Handle[h].bytes / t : 0,
+				t > 0 ? Handle[h].bytes / t * 100 / lineRate : 0);
+		shown = 0;
+	}
+	if(statusName)
+		writeStatus(now());
+}
+
+
+/*
+ * Called from the session loop, does nothing until the next update is due
+ */
+void progressUpdate(void)
+{
+	char line[512];
+	double t;
+	double dt;
+	uint32_t wire;
+	uint64_t payload = 0;
+	int active = 0;
+	int n = 0;
+	int h;
+
+	if(!enabled)
+		return;
+	t = now();
+	dt = t - lastUpdate;
+	if(dt < PROGRESS_INTERVAL)
+		return;
+
+	for(h = 0; h < MAXFPTR; h++)
+	{
+		struct progress * p = &P[h];
+		uint64_t d;
+
+		if(!p->active)
+			continue;
+		active++;
+		d = Handle[h].bytes - p->lastBytes;
+		p->lastBytes = Handle[h].bytes;
+		if(d)
+			p->lastData = t;
+		payload += d;
+		// smoothed over a few seconds, one slow request does not make it jump
+		p->rate = lastUpdate ? p->rate * 0.7 + d / dt * 0.3 : d / dt;
+	}
+
+	// everything on the line in both directions versus the file data in it
+	wire = portTxBytes + portRxBytes;
+	if(payload && lastUpdate)
+		overhead = overhead * 0.7 + ((double) (uint32_t) (wire - lastWire) / payload - 1) * 0.3;
+	lastWire = wire;
+	lastUpdate = t;
+
+	if(!active)
+		return;
+
+	if(toConsole)
+	{
+		for(h = 0; h < MAXFPTR && n < (int) sizeof(line) - 128; h++)
+		{
+			if(P[h].active)
+			{
+				if(n)
+					n = fitted(n + snprintf(line + n, sizeof(line) - n, " | "), sizeof line);
+				n += render(line + n, sizeof(line) - n, h, t);
+			}
+		}
+		fprintf(stderr, "\r\033[K%s", line);
+		shown = 1;
+	}
+	if(statusName)
+		writeStatus(t);
+}
@@ -0,0 +1,28 @@
+/*
+ ============================================================================
+ Name        : progress.h
+ Author      : F. Erckenbrecht / dg1yfe
+ Copyright   : GPL
+ Description : Live status of the open handles: bytes moved, rate, line
+               efficiency and ETA
+ ============================================================================
+ */
+
+#ifndef PROGRESS_H_
+#define PROGRESS_H_
+
+#include <stdint.h>
+
+/*
+ * Status is off until progressInit() is called. It is written as a
+ * single line to stderr (tty) and/or rewritten into statusFile, twice a
+ * second. Efficiency is the payload rate relative to the raw line rate
+ * (bitrate/10 bytes/s); overhead is what escaping and protocol framing add
+ * on the wire on top of the payload.
+ */
+int progressInit(int console, const char * statusFile, int bitrate);
+void progressOpen(int h, const char * name, uint64_t size);
+void progressClose(int h);
+void progressUpdate(void);
+
+#endif /* PROGRESS_H_ */
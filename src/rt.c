@@ -0,0 +1,215 @@
+/*
+ ============================================================================
+ Name        : rt.c
+ Author      : F. Erckenbrecht / dg1yfe
+ Copyright   : GPL
+ Description : Real-time mode: scheduling policy, memory locking, CPU
+               affinity and the wakeup latency of the session loop
+ ============================================================================
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#ifdef __linux__
+#include <malloc.h>
+#include <sys/ioctl.h>
+#include <linux/serial.h>
+#endif
+
+#include "OpenRS.h"
+#include "rt.h"
+#include "dlog.h"
+
+#define RT_STACK	(256*1024)		// stack touched before locking
+#define RT_HEAP		(1024*1024)		// heap kept mapped and locked for later allocations
+#define RT_NICE		-10				// if SCHED_FIFO is not permitted
+
+// upper bounds of the latency histogram, us
+static const unsigned bucket[] = { 50, 200, 1000, 5000, 20000 };
+#define NBUCKET	(sizeof(bucket) / sizeof(bucket[0]) + 1)
+
+static int enabled = 0;
+static uint32_t wakeups;
+static uint64_t latSum;
+static uint32_t latMax;
+static uint32_t hist[NBUCKET];
+#ifdef __linux__
+static cpu_set_t allCpus;
+static int pinned = 0;
+#endif
+
+
+static void prefaultStack(void)
+{
+	volatile unsigned char stack[RT_STACK];
+	size_t i;
+
+	for(i = 0; i < sizeof(stack); i += 4096)
+		stack[i] = 0;
+}
+
+
+int rtInit(int prio, int cpu)
+{
+	char policy[64];
+	char memory[64];
+	char affinity[32] = "";
+	struct sched_param sp;
+	int err;
+
+	enabled = 1;
+
+#ifdef __linux__
+	sched_getaffinity(0, sizeof(allCpus), &allCpus);
+	if(cpu >= 0)
+	{
+		cpu_set_t set;
+
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		if(sched_setaffinity(0, sizeof(set), &set) != 0)
+		{
+			fprintf(stderr, "Can't pin to CPU %d (%s)\r\n", cpu, strerror(errno));
+			return -1;
+		}
+		pinned = 1;
+		snprintf(affinity, sizeof affinity, ", CPU %d", cpu);
+	}
+#else
+	if(cpu >= 0)
+		fprintf(stderr, "CPU affinity is not supported on this system, ignored\r\n");
+#endif
+
+	memset(&sp, 0, sizeof sp);
+	sp.sched_priority = prio;
+	err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp);
+	if(err == 0)
+		snprintf(policy, sizeof policy, "SCHED_FIFO %d", prio);
+	else
+	if(setpriority(PRIO_PROCESS, 0, RT_NICE) == 0)
+		snprintf(policy, sizeof policy, "nice %d (SCHED_FIFO: %s)", RT_NICE, strerror(err));
+	else
+		snprintf(policy, sizeof policy, "normal (SCHED_FIFO: %s)", strerror(err));
+
+	// fault everything in now, a page fault during a transfer costs as much as a preemption
+#ifdef __linux__
+	mallopt(M_TRIM_THRESHOLD, -1);
+	mallopt(M_MMAP_MAX, 0);
+	{
+		char * heap = malloc(RT_HEAP);
+
+		if(heap)
+		{
+			memset(heap, 0, RT_HEAP);
+			free(heap);
+		}
+	}
+#endif
+	prefaultStack();
+	// only what is mapped now: the loop works from the stack and the heap reserve,
+	// later mappings (pre-escaped images, files read, thread stacks) can be gigabytes
+	if(mlockall(MCL_CURRENT) == 0)
+		snprintf(memory, sizeof memory, "memory locked");
+	else
+		snprintf(memory, sizeof memory, "memory not locked (%s)", strerror(errno));
+
+	printf("Real-time mode: %s, %s%s\r\n", policy, memory, affinity);
+	return 0;
+}
+
+
+/*
+ * Ask the UART driver to hand received data over without delay
+ */
+void rtSerial(int fd)
+{
+#ifdef __linux__
+	struct serial_struct ss;
+
+	if(!enabled || ioctl(fd, TIOCGSERIAL, &ss) != 0)
+		return;
+	ss.flags |= ASYNC_LOW_LATENCY;
+	ioctl(fd, TIOCSSERIAL, &ss);
+#endif
+}
+
+
+void rtHelperThread(void)
+{
+	struct sched_param sp;
+
+	if(!enabled)
+		return;
+	memset(&sp, 0, sizeof sp);
+	pthread_setschedparam(pthread_self(), SCHED_OTHER, &sp);
+#ifdef __linux__
+	if(pinned)
+		sched_setaffinity(0, sizeof(allCpus), &allCpus);
+#endif
+}
+
+
+/*
+ * usleep() that records how late the loop woke up
+ */
+void rtSleep(unsigned us)
+{
+	struct timespec t0, t1;
+	int64_t late;
+	unsigned k;
+
+	if(!enabled)
+	{
+		usleep(us);
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	usleep(us);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	late = (t1.tv_sec - t0.tv_sec) * 1000000LL + (t1.tv_nsec - t0.tv_nsec) / 1000 - us;
+	if(late < 0)
+		late = 0;
+	wakeups++;
+	latSum += late;
+	for(k = 0; k < NBUCKET - 1 && late >= bucket[k]; k++)
+		;
+	hist[k]++;
+	if(late > latMax)
+	{
+		latMax = (uint32_t) late;
+		DLOG(DLOG_REQUEST, "new maximum wakeup latency %u us", latMax, 0, 0);
+	}
+}
+
+
+void rtStatsPrint(FILE * f)
+{
+	unsigned k;
+
+	if(!enabled || wakeups == 0)
+		return;
+	fprintf(f, "Wakeup latency: %u wakeups, avg %llu us, max %u us (",
+			wakeups, (unsigned long long) (latSum / wakeups), latMax);
+	for(k = 0; k < NBUCKET; k++)
+	{
+		if(k < NBUCKET - 1)
+			fprintf(f, "%s<%u us: %u", k ? ", " : "", bucket[k], hist[k]);
+		else
+			fprintf(f, ", more: %u", hist[k]);
+	}
+	fprintf(f, ")\r\n");
+}
@@ -0,0 +1,22 @@
+/*
+ ============================================================================
+ Name        : rt.h
+ Author      : F. Erckenbrecht / dg1yfe
+ Copyright   : GPL
+ Description : Real-time mode: scheduling policy, memory locking, CPU
+               affinity and the wakeup latency of the session loop
+ ============================================================================
+ */
+
+#ifndef RT_H_
+#define RT_H_
+
+#include <stdio.h>
+
+int rtInit(int prio, int cpu);		// prio: SCHED_FIFO priority, cpu -1: not pinned
+void rtSerial(int fd);
+void rtHelperThread(void);			// background threads run with the normal policy
+void rtSleep(unsigned us);
+void rtStatsPrint(FILE * f);
+
+#endif /* RT_H_ */
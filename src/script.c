@@ -0,0 +1,668 @@
+/*
+ ============================================================================
+ Name        : script.c
+ Author      : F. Erckenbrecht / dg1yfe
+ Copyright   : GPL
+ Description : expect/send scripts over the TNC console, all patterns are
+               matched at once by an Aho-Corasick automaton
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+
+#include "OpenRS.h"
+#include "script.h"
+#include "transport.h"
+#include "timer.h"
+#include "dlog.h"
+
+#define SCRIPT_LINE		1024
+#define SCRIPT_QUEUE	16		// 'on' matches waiting for the next poll
+
+enum { OP_SEND, OP_EXPECT, OP_TIMEOUT, OP_ON, OP_SLEEP, OP_GOTO, OP_EXIT, OP_LABEL };
+enum { ACT_NEXT, ACT_GOTO, ACT_SEND, ACT_EXIT };
+
+struct stmt {
+	int			op;
+	int			line;
+	char *		str;		// send text, label name
+	size_t		len;
+	char *		label;		// goto, timeout target
+	int			target;		// statement index of label, -1: none
+	int			num;		// exit status, ms for sleep and timeout
+	int			first;		// expect, on: patterns
+	int			count;
+};
+
+struct pattern {
+	char *		s;
+	size_t		len;
+	int			stmt;		// expect or on statement it belongs to
+	int			act;
+	char *		label;
+	int			target;
+	char *		str;		// ACT_SEND
+	size_t		strLen;
+	int			num;		// ACT_EXIT
+	int			active;		// on: the statement has been executed
+	int			nextSame;	// next pattern ending in the same node
+};
+
+/*
+ * The automaton is a full DFA: every node has a transition for every byte,
+ * one table lookup per console byte whatever the number of patterns.
+ */
+struct acNode {
+	int32_t		next[256];
+	int32_t		fail;
+	int32_t		out;		// first pattern ending here, -1: none
+	int32_t		dict;		// nearest node on the fail chain with out, -1: none
+};
+
+static struct stmt * stmt;
+static int nStmt;
+static struct pattern * pat;
+static int nPat;
+static struct acNode * node;
+static int nNode;
+static int acState = 0;
+
+static int pc = 0;
+static int waiting = 0;			// expect of statement pc is waiting
+static uint64_t deadline;
+static int expectMs = 30000;
+static int timeoutTarget = -1;
+static int hit = -1;			// pattern that satisfied the expect
+static int onQueue[SCRIPT_QUEUE];
+static int onHead, onTail;
+static int done = 0;
+static int status = 0;
+
+static void scriptByte(int c);
+static void jump(int target);
+static void advance(void);
+
+
+static void * grow(void * p, int n, size_t size)
+{
+	// power of two capacities, n is the new element count
+	if(n & (n - 1))
+		return p;
+	p = realloc(p, (n ? 2 * n : 1) * size);
+	if(p == NULL)
+	{
+		fprintf(stderr, "Out of memory loading script\r\n");
+		exit(1);
+	}
+	return p;
+}
+
+
+static int newNode(void)
+{
+	node = grow(node, nNode, sizeof(*node));
+	memset(&node[nNode], 0xff, sizeof(node[nNode].next));
+	node[nNode].fail = 0;
+	node[nNode].out = -1;
+	node[nNode].dict = -1;
+	return nNode++;
+}
+
+
+static void acAdd(int p)
+{
+	int s = 0;
+	size_t i;
+
+	for(i = 0; i < pat[p].len; i++)
+	{
+		unsigned char c = pat[p].s[i];
+
+		if(node[s].next[c] == -1)
+		{
+			int n = newNode();		// may move node[]
+
+			node[s].next[c] = n;
+		}
+		s = node[s].next[c];
+	}
+	pat[p].nextSame = node[s].out;
+	node[s].out = p;
+}
+
+
+static void acBuild(void)
+{
+	int * queue = malloc(nNode * sizeof(int));
+	int head = 0, tail = 0;
+	int c;
+
+	if(queue == NULL)
+	{
+		fprintf(stderr, "Out of memory loading script\r\n");
+		exit(1);
+	}
+	for(c = 0; c < 256; c++)
+	{
+		int n = node[0].next[c];
+
+		if(n == -1)
+			node[0].next[c] = 0;
+		else
+		{
+			node[n].fail = 0;
+			queue[tail++] = n;
+		}
+	}
+	// breadth first, the fail node of a node is always complete before it
+	while(head < tail)
+	{
+		int s = queue[head++];
+
+		for(c = 0; c < 256; c++)
+		{
+			int n = node[s].next[c];
+
+			if(n == -1)
+			{
+				node[s].next[c] = node[node[s].fail].next[c];
+				continue;
+			}
+			node[n].fail = node[node[s].fail].next[c];
+			node[n].dict = node[node[n].fail].out != -1 ? node[n].fail : node[node[n].fail].dict;
+			queue[tail++] = n;
+		}
+	}
+	free(queue);
+}
+
+
+/*
+ * Next token of a line: a quoted string (escapes resolved, *len set) or a
+ * word. NULL at the end of the line or at a comment.
+ */
+static char * token(char ** line, size_t * len, int * quoted)
+{
+	char * s = *line;
+	char * o;
+	char * t;
+
+	while(isspace((unsigned char) *s))
+		s++;
+	if(*s == 0 || *s == '#')
+		return NULL;
+
+	*quoted = *s == '"';
+	if(!*quoted)
+	{
+		t = s;
+		while(*s && !isspace((unsigned char) *s))
+			s++;
+		if(*s)
+			*s++ = 0;
+		*line = s;
+		*len = strlen(t);
+		return t;
+	}
+
+	t = o = ++s;
+	while(*s && *s != '"')
+	{
+		if(*s == '\\' && s[1])
+		{
+			s++;
+			switch(*s)
+			{
+			case 'r': *o++ = '\r'; s++; break;
+			case 'n': *o++ = '\n'; s++; break;
+			case 't': *o++ = '\t'; s++; break;
+			case 'e': *o++ = 0x1b; s++; break;
+			case 'x':
+				*o++ = (char) strtol(s + 1, &s, 16);
+				break;
+			default:
+				*o++ = *s++;
+				break;
+			}
+		}
+		else
+			*o++ = *s++;
+	}
+	if(*s)
+		s++;
+	*o = 0;
+	*line = s;
+	*len = o - t;
+	return t;
+}
+
+
+static char * strDup(const char * s, size_t len)
+{
+	char * d = malloc(len + 1);
+
+	if(d == NULL)
+	{
+		fprintf(stderr, "Out of memory loading script\r\n");
+		exit(1);
+	}
+	memcpy(d, s, len);
+	d[len] = 0;
+	return d;
+}
+
+
+static int addPattern(int st, const char * s, size_t len)
+{
+	struct pattern * p;
+
+	pat = grow(pat, nPat, sizeof(*pat));
+	p = &pat[nPat];
+	memset(p, 0, sizeof(*p));
+	p->s = strDup(s, len);
+	p->len = len;
+	p->stmt = st;
+	p->target = -1;
+	return nPat++;
+}
+
+
+static int findLabel(const char * name)
+{
+	int i;
+
+	for(i = 0; i < nStmt; i++)
+	{
+		if(stmt[i].op == OP_LABEL && strcmp(stmt[i].str, name) == 0)
+			return i;
+	}
+	return -1;
+}
+
+
+static int parseError(const char * path, int line, const char * msg)
+{
+	fprintf(stderr, "%s:%d: %s\r\n", path, line, msg);
+	return -1;
+}
+
+
+int scriptLoad(const char * path)
+{
+	char buf[SCRIPT_LINE];
+	FILE * f;
+	int line = 0;
+	int i;
+
+	f = fopen(path, "r");
+	if(f == NULL)
+	{
+		fprintf(stderr, "Can't open script %s\r\n", path);
+		return -1;
+	}
+
+	newNode();
+	while(fgets(buf, sizeof buf, f))
+	{
+		char * s = buf;
+		char * w;
+		char * a;
+		size_t len;
+		int q;
+		struct stmt * st;
+
+		line++;
+		buf[strcspn(buf, "\r\n")] = 0;
+		w = token(&s, &len, &q);
+		if(w == NULL)
+			continue;
+
+		stmt = grow(stmt, nStmt, sizeof(*stmt));
+		st = &stmt[nStmt];
+		memset(st, 0, sizeof(*st));
+		st->line = line;
+		st->target = -1;
+
+		if(w[0] == ':' && !q)
+		{
+			st->op = OP_LABEL;
+			st->str = strDup(w + 1, len - 1);
+		}
+		else
+		if(strcmp(w, "send") == 0)
+		{
+			st->op = OP_SEND;
+			a = token(&s, &len, &q);
+			if(a == NULL)
+				return parseError(path, line, "send needs a string");
+			st->str = strDup(a, len);
+			st->len = len;
+		}
+		else
+		if(strcmp(w, "expect") == 0)
+		{
+			st->op = OP_EXPECT;
+			st->first = nPat;
+			while((a = token(&s, &len, &q)))
+			{
+				if(q)
+					addPattern(nStmt, a, len);
+				else
+				if(nPat > st->first && pat[nPat-1].label == NULL)
+				{
+					pat[nPat-1].act = ACT_GOTO;
+					pat[nPat-1].label = strDup(a, len);
+				}
+				else
+					return parseError(path, line, "label without pattern");
+			}
+			st->count = nPat - st->first;
+			if(st->count == 0)
+				return parseError(path, line, "expect needs a pattern");
+		}
+		else
+		if(strcmp(w, "on") == 0)
+		{
+			struct pattern * p;
+
+			st->op = OP_ON;
+			a = token(&s, &len, &q);
+			if(a == NULL || !q)
+				return parseError(path, line, "on needs a pattern");
+			st->first = addPattern(nStmt, a, len);
+			st->count = 1;
+			p = &pat[st->first];
+			a = token(&s, &len, &q);
+			if(a && strcmp(a, "goto") == 0 && (a = token(&s, &len, &q)))
+			{
+				p->act = ACT_GOTO;
+				p->label = strDup(a, len);
+			}
+			else
+			if(a && strcmp(a, "send") == 0 && (a = token(&s, &len, &q)))
+			{
+				p->act = ACT_SEND;
+				p->str = strDup(a, len);
+				p->strLen = len;
+			}
+			else
+			if(a && strcmp(a, "exit") == 0)
+			{
+				p->act = ACT_EXIT;
+				a = token(&s, &len, &q);
+				p->num = a ? atoi(a) : 1;
+			}
+			else
+				return parseError(path, line, "on needs goto <label>, send \"string\" or exit <n>");
+		}
+		else
+		if(strcmp(w, "timeout") == 0 || strcmp(w, "sleep") == 0)
+		{
+			st->op = w[0] == 't' ? OP_TIMEOUT : OP_SLEEP;
+			a = token(&s, &len, &q);
+			if(a == NULL)
+				return parseError(path, line, "missing time");
+			st->num = (int) (strtod(a, NULL) * 1000);
+			a = token(&s, &len, &q);
+			if(a && st->op == OP_TIMEOUT)
+				st->label = strDup(a, len);
+		}
+		else
+		if(strcmp(w, "goto") == 0)
+		{
+			st->op = OP_GOTO;
+			a = token(&s, &len, &q);
+			if(a == NULL)
+				return parseError(path, line, "goto needs a label");
+			st->label = strDup(a, len);
+		}
+		else
+		if(strcmp(w, "exit") == 0)
+		{
+			st->op = OP_EXIT;
+			a = token(&s, &len, &q);
+			st->num = a ? atoi(a) : 0;
+		}
+		else
+			return parseError(path, line, "unknown statement");
+		nStmt++;
+	}
+	fclose(f);
+
+	// labels may be used before they are defined
+	for(i = 0; i < nStmt; i++)
+	{
+		if(stmt[i].label && (stmt[i].target = findLabel(stmt[i].label)) == -1)
+			return parseError(path, stmt[i].line, "undefined label");
+	}
+	for(i = 0; i < nPat; i++)
+	{
+		if(pat[i].label && (pat[i].target = findLabel(pat[i].label)) == -1)
+			return parseError(path, stmt[pat[i].stmt].line, "undefined label");
+		if(pat[i].len)
+			acAdd(i);
+	}
+	acBuild();
+
+	consoleTap = scriptByte;
+	DLOG(DLOG_REQUEST, "script: %d statements, %d patterns, %d nodes", nStmt, nPat, nNode);
+	return 0;
+}
+
+
+/*
+ * Console byte, outside of protocol frames (consoleTap)
+ */
+static void scriptByte(int c)
+{
+	int m;
+
+	acState = node[acState].next[(unsigned char) c];
+	m = node[acState].out != -1 ? acState : node[acState].dict;
+
+	for(; m != -1; m = node[m].dict)
+	{
+		int p;
+
+		for(p = node[m].out; p != -1; p = pat[p].nextSame)
+		{
+			if(stmt[pat[p].stmt].op == OP_ON)
+			{
+				if(pat[p].active && (onTail + 1) % SCRIPT_QUEUE != onHead)
+				{
+					onQueue[onTail] = p;
+					onTail = (onTail + 1) % SCRIPT_QUEUE;
+				}
+			}
+			else
+			if(waiting && pat[p].stmt == pc && hit == -1)
+			{
+				hit = p;
+			}
+		}
+	}
+
+	// the rest of the burst may satisfy the next expect, go on to it now
+	// unless an 'on' rule matched first (it may jump)
+	if(hit != -1 && onHead == onTail)
+	{
+		int target = pat[hit].target;
+
+		DLOGS(DLOG_REQUEST, "script: matched \"%s\"", pat[hit].s, 0, 0);
+		jump(target != -1 ? target : pc + 1);
+		advance();
+	}
+}
+
+
+static void scriptExit(int n)
+{
+	done = 1;
+	status = n;
+	printf("\r\nScript ended with status %d.\r\n", n);
+}
+
+
+static void jump(int target)
+{
+	pc = target;
+	waiting = 0;
+	hit = -1;
+}
+
+
+/*
+ * Run the statements that do not wait, up to the next expect (armed),
+ * sleep, send or exit; scriptPoll() goes on from there
+ */
+static void advance(void)
+{
+	while(pc < nStmt)
+	{
+		struct stmt * st = &stmt[pc];
+
+		switch(st->op)
+		{
+		case OP_EXPECT:
+			waiting = 1;
+			hit = -1;
+			deadline = timerNow() + expectMs;
+			return;
+		case OP_TIMEOUT:
+			expectMs = st->num;
+			timeoutTarget = st->target;
+			pc++;
+			break;
+		case OP_ON:
+			pat[st->first].active = 1;
+			pc++;
+			break;
+		case OP_GOTO:
+			jump(st->target);
+			break;
+		case OP_LABEL:
+			pc++;
+			break;
+		default:
+			return;
+		}
+	}
+}
+
+
+/*
+ * Called from the session loop; runs statements until one has to wait
+ */
+int scriptPoll(void)
+{
+	uint64_t now = timerNow();
+
+	if(done)
+		return 1;
+
+	// 'on' rules take precedence over the statement in progress
+	while(onHead != onTail)
+	{
+		struct pattern * p = &pat[onQueue[onHead]];
+
+		if(p->act == ACT_SEND && !protocolIdle())
+			return 0;
+		onHead = (onHead + 1) % SCRIPT_QUEUE;
+		DLOGS(DLOG_REQUEST, "script: on \"%s\"", p->s, 0, 0);
+		switch(p->act)
+		{
+		case ACT_GOTO:
+			jump(p->target);
+			onHead = onTail;
+			break;
+		case ACT_SEND:
+			portConsole(p->str, p->strLen);
+			break;
+		case ACT_EXIT:
+			scriptExit(p->num);
+			return 1;
+		}
+	}
+
+	while(pc < nStmt)
+	{
+		struct stmt * st = &stmt[pc];
+
+		switch(st->op)
+		{
+		case OP_SEND:
+			// never in the middle of a protocol response
+			if(!protocolIdle())
+				return 0;
+			portConsole(st->str, st->len);
+			pc++;
+			break;
+		case OP_EXPECT:
+			if(!waiting)
+			{
+				waiting = 1;
+				hit = -1;
+				deadline = now + expectMs;
+			}
+			if(hit != -1)
+			{
+				int target = pat[hit].target;
+
+				DLOGS(DLOG_REQUEST, "script: matched \"%s\"", pat[hit].s, 0, 0);
+				jump(target != -1 ? target : pc + 1);
+				break;
+			}
+			if(now < deadline)
+				return 0;
+			if(timeoutTarget == -1)
+			{
+				fprintf(stderr, "\r\nScript: timeout at line %d\r\n", st->line);
+				scriptExit(1);
+				return 1;
+			}
+			jump(timeoutTarget);
+			break;
+		case OP_TIMEOUT:
+			expectMs = st->num;
+			timeoutTarget = st->target;
+			pc++;
+			break;
+		case OP_ON:
+			pat[st->first].active = 1;
+			pc++;
+			break;
+		case OP_SLEEP:
+			if(!waiting)
+			{
+				waiting = 1;
+				deadline = now + st->num;
+			}
+			if(now < deadline)
+				return 0;
+			waiting = 0;
+			pc++;
+			break;
+		case OP_GOTO:
+			jump(st->target);
+			break;
+		case OP_EXIT:
+			scriptExit(st->num);
+			return 1;
+		default:
+			pc++;
+			break;
+		}
+	}
+	scriptExit(0);
+	return 1;
+}
+
+
+int scriptStatus(void)
+{
+	return status;
+}
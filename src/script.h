@@ -0,0 +1,35 @@
+/*
+ ============================================================================
+ Name        : script.h
+ Author      : F. Erckenbrecht / dg1yfe
+ Copyright   : GPL
+ Description : expect/send scripts over the TNC console, all patterns are
+               matched at once by an Aho-Corasick automaton
+ ============================================================================
+ */
+
+#ifndef SCRIPT_H_
+#define SCRIPT_H_
+
+/*
+ * One statement per line, strings in double quotes with C escapes:
+ *
+ *   send "string"                  type on the TNC console
+ *   expect "p1" [label] "p2" ...   wait for one of the patterns, continue
+ *                                  at its label or the next line
+ *   timeout <s> [label]            for the following expects, on expiry
+ *                                  continue at label (default: exit 1)
+ *   on "pattern" <action>          from here on, whenever pattern is seen:
+ *                                  goto <label>, send "string" or exit <n>
+ *   sleep <s>
+ *   goto <label>
+ *   exit <n>
+ *   :label
+ *
+ * Only the console output is matched, never the bytes of protocol frames.
+ */
+int scriptLoad(const char * path);
+int scriptPoll(void);			// for sessionLoop(), 1 when the script has ended
+int scriptStatus(void);			// exit status of the script
+
+#endif /* SCRIPT_H_ */
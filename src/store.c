@@ -0,0 +1,516 @@
+/*
+ ============================================================================
+ Name        : store.c
+ Author      : F. Erckenbrecht / dg1yfe
+ Copyright   : GPL
+ Description : Deduplicating, versioned store for the files the TNC writes
+               (ramdisk backups)
+ ============================================================================
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <time.h>
+#include <stdarg.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
+#include "OpenRS.h"
+#include "store.h"
+#include "vfs.h"
+#include "digest.h"
+#include "dlog.h"
+
+struct storeFile {
+	struct vfsMemFile	mf;
+	struct sha256		sha;
+	int					moved;		// repositioned, hash again on close
+	char				name[];
+};
+
+static char * storeDir = NULL;		// absolute, NULL: store off
+
+static struct {
+	uint32_t	files;			// backups published
+	uint32_t	objects;		// new content written
+	uint32_t	dedups;			// content that was already stored
+	uint32_t	imported;		// existing files kept as a version
+	uint32_t	failed;
+	uint32_t	dropped;		// not closed by the TNC
+	uint64_t	written;		// bytes written to objects
+	uint64_t	saved;			// bytes not written, already stored
+} stats;
+
+
+/*
+ * snprintf() for paths, a path that does not fit is an error
+ */
+static int makePath(char * buf, size_t len, const char * fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(buf, len, fmt, ap);
+	va_end(ap);
+	if(n < 0 || (size_t) n >= len)
+	{
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	return 0;
+}
+
+
+static int makeDir(const char * path)
+{
+	if(mkdir(path, 0755) != 0 && errno != EEXIST)
+		return -1;
+	return 0;
+}
+
+
+int storeInit(const char * dir)
+{
+	char real[PATH_MAX];
+	char path[PATH_MAX + 16];
+
+	if(makeDir(dir) != 0 || realpath(dir, real) == NULL)
+	{
+		fprintf(stderr, "Could not create the store %s (%s)\r\n", dir, strerror(errno));
+		return -1;
+	}
+	if(makePath(path, sizeof path, "%s/objects", real) != 0 || makeDir(path) != 0)
+	{
+		fprintf(stderr, "Could not create %s (%s)\r\n", path, strerror(errno));
+		return -1;
+	}
+	if(makePath(path, sizeof path, "%s/versions", real) != 0 || makeDir(path) != 0)
+	{
+		fprintf(stderr, "Could not create %s (%s)\r\n", path, strerror(errno));
+		return -1;
+	}
+	free(storeDir);
+	storeDir = strdup(real);
+	return storeDir ? 0 : -1;
+}
+
+
+int storeWanted(const char * mode)
+{
+	return storeDir != NULL && vfs == &vfsHost &&
+			strpbrk(mode, "wWaA+") != NULL && strpbrk(mode, "tT") == NULL;
+}
+
+
+/*
+ * Read a regular file into a buffer of at least one byte
+ */
+static char * readFile(const char * name, uint64_t * size)
+{
+	struct stat st;
+	char * data;
+	int fd;
+
+	fd = open(name, O_RDONLY);
+	if(fd == -1)
+		return NULL;
+	if(fstat(fd, &st) != 0)
+	{
+		close(fd);
+		return NULL;
+	}
+	data = malloc(st.st_size ? st.st_size : 1);
+	if(data == NULL || read(fd, data, st.st_size) != st.st_size)
+	{
+		close(fd);
+		free(data);
+		errno = EIO;
+		return NULL;
+	}
+	close(fd);
+	*size = st.st_size;
+	return data;
+}
+
+
+FILE * storeOpen(int h, const char * name, const char * mode)
+{
+	struct storeFile * sf;
+	struct stat st;
+	int exists;
+	FILE * f;
+
+	if(name[0] == '\0' || name[0] == '.' || strchr(name, '/'))
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+	exists = lstat(name, &st) == 0;
+	if(exists && !S_ISREG(st.st_mode))
+	{
+		errno = EISDIR;
+		return NULL;
+	}
+	if(!exists && strpbrk(mode, "wWaA") == NULL)
+	{
+		errno = ENOENT;
+		return NULL;
+	}
+
+	sf = calloc(1, sizeof(*sf) + strlen(name) + 1);
+	if(sf == NULL)
+		return NULL;
+	strcpy(sf->name, name);
+	sf->mf.name = sf->name;
+	sf->mf.mtime = time(NULL);
+	sha256Init(&sf->sha);
+	sf->moved = strchr(mode, '+') != NULL;		// reads go through handleData() as well
+
+	if(exists && strpbrk(mode, "wW") == NULL)
+	{
+		// append or update: the new version starts with the current content
+		sf->mf.data = readFile(name, &sf->mf.size);
+		if(sf->mf.data == NULL)
+		{
+			free(sf);
+			return NULL;
+		}
+		sf->mf.alloc = sf->mf.size ? sf->mf.size : 1;
+		sha256Update(&sf->sha, sf->mf.data, sf->mf.size);
+	}
+
+	f = vfsStreamOpen(&sf->mf, mode);
+	if(f == NULL)
+	{
+		free(sf->mf.data);
+		free(sf);
+		return NULL;
+	}
+	Handle[h].store = sf;
+	return f;
+}
+
+
+void storeUpdate(struct storeFile * sf, const void * p, size_t n)
+{
+	if(!sf->moved)
+		sha256Update(&sf->sha, p, n);
+}
+
+
+void storeSeek(int h)
+{
+	if(Handle[h].store)
+		Handle[h].store->moved = 1;
+}
+
+
+/*
+ * The stream was flushed and is positioned at start by the caller, the
+ * buffer is cut back like a file would be
+ */
+void storeRollback(int h, off_t start, uint32_t n)
+{
+	struct storeFile * sf = Handle[h].store;
+
+	if(sf == NULL)
+		return;
+	if(sf->mf.size == (uint64_t) start + n)
+		sf->mf.size = start;
+	sf->moved = 1;
+}
+
+
+/*
+ * Write a new file, the data is on the disk when it returns 0
+ */
+static int writeFile(const char * path, const char * data, uint64_t size, mode_t mode)
+{
+	uint64_t done = 0;
+	int fd;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_EXCL, mode);
+	if(fd == -1)
+		return -1;
+	while(done < size)
+	{
+		ssize_t n = write(fd, data + done, size - done);
+
+		if(n < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			break;
+		}
+		done += n;
+	}
+	if(done < size || fsync(fd) != 0)
+	{
+		int err = errno;
+
+		close(fd);
+		unlink(path);
+		errno = err;
+		return -1;
+	}
+	return close(fd);
+}
+
+
+/*
+ * Object of the content with the hash hex, written if it does not exist.
+ * 1: new object, 0: already stored, -1: error
+ */
+static int putObject(const char * hex, const char * data, uint64_t size, char * obj, size_t len)
+{
+	char path[PATH_MAX];
+	struct stat st;
+
+	if(makePath(path, sizeof path, "%s/objects/%.2s", storeDir, hex) != 0 ||
+			makePath(obj, len, "%s/%s", path, hex + 2) != 0)
+	{
+		return -1;
+	}
+	if(lstat(obj, &st) == 0)
+	{
+		stats.dedups++;
+		stats.saved += size;
+		return 0;
+	}
+	if(makeDir(path) != 0)
+		return -1;
+
+	if(makePath(path, sizeof path, "%s/objects/tmp.%ld", storeDir, (long) getpid()) != 0)
+		return -1;
+	unlink(path);
+	if(writeFile(path, data, size, 0444) != 0)
+		return -1;
+	if(rename(path, obj) != 0)
+	{
+		int err = errno;
+
+		unlink(path);
+		errno = err;
+		return -1;
+	}
+	stats.objects++;
+	stats.written += size;
+	return 1;
+}
+
+
+/*
+ * Link obj as the version of name at time t, ver receives its path
+ */
+static int addVersion(const char * name, const char * obj, time_t t, char * ver, size_t len)
+{
+	char dir[PATH_MAX];
+	char stamp[32];
+	struct tm tm;
+	int i;
+
+	if(makePath(dir, sizeof dir, "%s/versions/%s", storeDir, name) != 0 || makeDir(dir) != 0)
+		return -1;
+
+	localtime_r(&t, &tm);
+	strftime(stamp, sizeof stamp, "%Y%m%d-%H%M%S", &tm);
+	if(makePath(ver, len, "%s/%s", dir, stamp) != 0)
+		return -1;
+	for(i = 1; link(obj, ver) != 0; i++)
+	{
+		if(errno != EEXIST || i > 999 || makePath(ver, len, "%s/%s-%d", dir, stamp, i) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+
+static void hashData(const char * data, uint64_t size, char hex[65])
+{
+	struct sha256 sha;
+
+	sha256Init(&sha);
+	sha256Update(&sha, data, size);
+	sha256Final(&sha, hex);
+}
+
+
+/*
+ * Keep a file that is about to be replaced as a version. If its content
+ * is stored already and the name has versions, it came from the store or
+ * is a copy of one of them.
+ */
+static int importFile(const char * name)
+{
+	char obj[PATH_MAX];
+	char ver[PATH_MAX];
+	char hex[65];
+	struct stat st;
+	uint64_t size;
+	char * data;
+	int res;
+
+	if(lstat(name, &st) != 0 || !S_ISREG(st.st_mode))
+		return 0;
+
+	data = readFile(name, &size);
+	if(data == NULL)
+		return -1;
+	hashData(data, size, hex);
+	res = putObject(hex, data, size, obj, sizeof obj);
+	free(data);
+	if(res < 0)
+		return -1;
+	if(res == 0)
+	{
+		if(makePath(ver, sizeof ver, "%s/versions/%s", storeDir, name) != 0)
+			return -1;
+		if(access(ver, F_OK) == 0)
+			return 0;
+	}
+	if(addVersion(name, obj, st.st_mtime, ver, sizeof ver) != 0)
+		return -1;
+	stats.imported++;
+	return 0;
+}
+
+
+/*
+ * New file path with the content of ver. It shares the blocks of ver
+ * (reflink) where the file system can, the data is written otherwise.
+ */
+static int cloneFile(const char * path, const char * ver, const char * data, uint64_t size)
+{
+#ifdef FICLONE
+	int in;
+	int out;
+
+	in = open(ver, O_RDONLY);
+	if(in != -1)
+	{
+		out = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+		if(out != -1 && ioctl(out, FICLONE, in) == 0 && fsync(out) == 0)
+		{
+			close(in);
+			return close(out);
+		}
+		if(out != -1)
+		{
+			close(out);
+			unlink(path);
+		}
+		close(in);
+	}
+#endif
+	return writeFile(path, data, size, 0644);
+}
+
+
+/*
+ * Replace name with a copy of ver. It is a file of its own, a write to it
+ * in place does not reach the (read only) object the versions link to.
+ */
+static int replaceFile(const char * name, const char * ver, const char * data, uint64_t size)
+{
+	char tmp[PATH_MAX];
+
+	if(makePath(tmp, sizeof tmp, ".%s.store", name) != 0)
+		return -1;
+	unlink(tmp);
+	if(cloneFile(tmp, ver, data, size) != 0)
+		return -1;
+	if(rename(tmp, name) != 0)
+	{
+		int err = errno;
+
+		unlink(tmp);
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+
+static int publish(struct storeFile * sf)
+{
+	char obj[PATH_MAX];
+	char ver[PATH_MAX];
+	char hex[65];
+	int res;
+
+	if(sf->moved)
+		hashData(sf->mf.data, sf->mf.size, hex);
+	else
+		sha256Final(&sf->sha, hex);
+
+	res = putObject(hex, sf->mf.data, sf->mf.size, obj, sizeof obj);
+	if(res < 0 || importFile(sf->name) != 0 ||
+			addVersion(sf->name, obj, sf->mf.mtime, ver, sizeof ver) != 0 ||
+			replaceFile(sf->name, ver, sf->mf.data, sf->mf.size) != 0)
+	{
+		return -1;
+	}
+	stats.files++;
+	printf("File %s stored (%s, %s).\r\n", sf->name, res ? "new" : "unchanged", hex);
+	DLOGS(DLOG_REQUEST, "Stored %s", sf->name, 0, 0);
+	return 0;
+}
+
+
+int storeClose(int h)
+{
+	struct storeFile * sf = Handle[h].store;
+	int res;
+
+	if(sf == NULL)
+		return 0;
+	Handle[h].store = NULL;
+
+	res = publish(sf);
+	if(res != 0)
+	{
+		stats.failed++;
+		printf("Could not store %s (%s)\r\n", sf->name, strerror(errno));
+	}
+	free(sf->mf.data);
+	free(sf);
+	return res;
+}
+
+
+void storeRelease(int h)
+{
+	struct storeFile * sf = Handle[h].store;
+
+	if(sf == NULL)
+		return;
+	Handle[h].store = NULL;
+	stats.dropped++;
+	printf("File %s not stored, the TNC did not close it.\r\n", sf->name);
+	free(sf->mf.data);
+	free(sf);
+}
+
+
+void storeStatsPrint(FILE * f)
+{
+	if(storeDir == NULL)
+		return;
+	fprintf(f, "Store: %u files, %u new objects, %u unchanged, %u kept as versions, %u failed, %u not closed\r\n",
+			stats.files, stats.objects, stats.dedups, stats.imported, stats.failed, stats.dropped);
+	fprintf(f, "Store: %llu bytes written, %llu bytes not written (already stored)\r\n",
+			(unsigned long long) stats.written, (unsigned long long) stats.saved);
+}
@@ -0,0 +1,44 @@
+/*
+ ============================================================================
+ Name        : store.h
+ Author      : F. Erckenbrecht / dg1yfe
+ Copyright   : GPL
+ Description : Deduplicating, versioned store for the files the TNC writes
+               (ramdisk backups)
+ ============================================================================
+ */
+
+#ifndef STORE_H_
+#define STORE_H_
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+struct storeFile;
+
+/*
+ * With a store, a binary write open ("w", "a", "r+") of the host file system
+ * is accepted even if the file exists. The data goes to memory (appends and
+ * updates start with the current content) and is hashed (SHA-256) while it
+ * is written; on close it is published:
+ *
+ *   <dir>/objects/<2 hex>/<62 hex>   the content, written only if it is new
+ *   <dir>/versions/<name>/<YYYYmmdd-HHMMSS>   a version, hard link to the object
+ *   <name>            replaced (rename) by a copy (reflink if possible) of it
+ *
+ * A file of that name that is not from the store is kept as a version
+ * before it is replaced. Files the TNC does not close are dropped.
+ */
+int storeInit(const char * dir);
+int storeWanted(const char * mode);		// 1: the open goes to the store
+FILE * storeOpen(int h, const char * name, const char * mode);
+void storeUpdate(struct storeFile * sf, const void * p, size_t n);
+void storeSeek(int h);
+void storeRollback(int h, off_t start, uint32_t n);
+int storeClose(int h);		// after fclose() of FCLOSE, -1: not stored
+void storeRelease(int h);	// drop without publishing (handle reclaimed or reused, exit)
+void storeStatsPrint(FILE * f);
+
+#endif /* STORE_H_ */
@@ -0,0 +1,509 @@
+/*
+ ============================================================================
+ Name        : sync.c
+ Author      : F. Erckenbrecht / dg1yfe
+ Copyright   : GPL
+ Description : Copy the changed files of a host directory to a TNC drive
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "OpenRS.h"
+#include "sync.h"
+#include "digest.h"
+#include "transport.h"
+#include "nameidx.h"
+
+#define SYNC_MANIFEST	".openrs-sync"
+#define SYNC_QUIET		2		// s of console silence that end a listing
+#define SYNC_SETTLE		1		// s of silence after the copy closed its files
+#define SYNC_TIMEOUT	60		// s to wait for the TNC
+
+struct syncFile {
+	char		name[14];
+	uint64_t	size;
+	uint32_t	dosTime;		// date << 16 | time of the host file
+	uint32_t	crc;
+	char		tncDate[24];	// as listed by the TNC after the copy
+};
+
+struct syncList {
+	struct syncFile *	f;
+	int					n;
+	int					alloc;
+};
+
+static struct syncList host, manifest, tnc;
+static char * cap = NULL;
+static size_t capLen = 0;
+static size_t capAlloc = 0;
+static time_t lastConsole;
+static time_t phaseStart;
+static time_t lastActive;
+static int copyOpened;
+
+
+static struct syncFile * listAdd(struct syncList * l)
+{
+	if(l->n == l->alloc)
+	{
+		int alloc = l->alloc ? l->alloc * 2 : 64;
+		struct syncFile * f = realloc(l->f, alloc * sizeof(*f));
+
+		if(f == NULL)
+			return NULL;
+		l->f = f;
+		l->alloc = alloc;
+	}
+	memset(&l->f[l->n], 0, sizeof(l->f[0]));
+	return &l->f[l->n++];
+}
+
+
+static struct syncFile * listFind(struct syncList * l, const char * name)
+{
+	int i;
+
+	for(i = 0; i < l->n; i++)
+	{
+		if(strcasecmp(l->f[i].name, name) == 0)
+			return &l->f[i];
+	}
+	return NULL;
+}
+
+
+/*
+ * 8.3 name in any case: FOPEN folds the requested name to lower case and
+ * nameResolve() finds the host file whatever its case
+ */
+static int validName(const char * name)
+{
+	const char * dot = strchr(name, '.');
+	size_t base = dot ? (size_t) (dot - name) : strlen(name);
+	const char * s;
+
+	if(base == 0 || base > 8 || (dot && (strlen(dot + 1) == 0 || strlen(dot + 1) > 3)))
+		return 0;
+	for(s = name; *s; s++)
+	{
+		if(s == dot)
+			continue;
+		if(!(isalnum((unsigned char) *s) || strchr("_-$~!#%&", *s)))
+			return 0;
+	}
+	return 1;
+}
+
+
+static int isNumber(const char * s)
+{
+	if(*s == 0)
+		return 0;
+	for(; *s; s++)
+	{
+		if(!isdigit((unsigned char) *s))
+			return 0;
+	}
+	return 1;
+}
+
+
+static uint32_t dosTime(time_t t)
+{
+	struct tm tm;
+
+	localtime_r(&t, &tm);
+	return (uint32_t) ((tm.tm_year - 80) << 9 | (tm.tm_mon + 1) << 5 | tm.tm_mday) << 16 |
+			tm.tm_hour << 11 | tm.tm_min << 5 | tm.tm_sec / 2;
+}
+
+
+static int fileCrc(const char * name, uint32_t * crc)
+{
+	char buf[65536];
+	size_t n;
+	FILE * f;
+
+	f = fopen(name, "rb");
+	if(f == NULL)
+		return -1;
+	*crc = 0;
+	while((n = fread(buf, 1, sizeof buf, f)) > 0)
+		*crc = crc32c(*crc, buf, n);
+	fclose(f);
+	return 0;
+}
+
+
+static void scanHost(void)
+{
+	struct dirent * de;
+	struct stat st;
+	DIR * d;
+
+	d = opendir(".");
+	if(d == NULL)
+		return;
+	while((de = readdir(d)) != NULL)
+	{
+		struct syncFile * f;
+		char lower[16];
+		char real[PATH_MAX];
+		size_t i;
+
+		if(stat(de->d_name, &st) != 0 || !S_ISREG(st.st_mode) || de->d_name[0] == '.')
+			continue;
+		if(!validName(de->d_name))
+		{
+			printf("%s: not an 8.3 name, skipped\r\n", de->d_name);
+			continue;
+		}
+		// of names that differ only in case, the one FOPEN opens
+		for(i = 0; de->d_name[i]; i++)
+			lower[i] = tolower((unsigned char) de->d_name[i]);
+		lower[i] = 0;
+		if(nameResolve(lower, real, sizeof real) != 0 || strcmp(real, de->d_name) != 0)
+		{
+			printf("%s: the TNC opens %s under this name, skipped\r\n", de->d_name, real);
+			continue;
+		}
+		f = listAdd(&host);
+		if(f == NULL)
+			break;
+		strcpy(f->name, de->d_name);
+		f->size = st.st_size;
+		f->dosTime = dosTime(st.st_mtime);
+		if(fileCrc(f->name, &f->crc) != 0)
+			host.n--;
+	}
+	closedir(d);
+}
+
+
+static void loadManifest(void)
+{
+	char line[256];
+	FILE * m;
+
+	m = fopen(SYNC_MANIFEST, "r");
+	if(m == NULL)
+		return;
+	while(fgets(line, sizeof line, m))
+	{
+		struct syncFile e;
+		unsigned long long size;
+		int n = 0;
+
+		memset(&e, 0, sizeof e);
+		line[strcspn(line, "\r\n")] = 0;
+		if(sscanf(line, "%13s %llu %x %x %n", e.name, &size, &e.dosTime, &e.crc, &n) < 4 || n == 0)
+			continue;
+		e.size = size;
+		snprintf(e.tncDate, sizeof e.tncDate, "%s", line + n);
+		if(listAdd(&manifest))
+			manifest.f[manifest.n - 1] = e;
+	}
+	fclose(m);
+}
+
+
+static void saveManifest(void)
+{
+	FILE * m;
+	int i;
+
+	m = fopen(SYNC_MANIFEST ".tmp", "w");
+	if(m == NULL)
+	{
+		perror("Could not write " SYNC_MANIFEST);
+		return;
+	}
+	for(i = 0; i < manifest.n; i++)
+	{
+		struct syncFile * e = &manifest.f[i];
+
+		fprintf(m, "%s %llu %08x %08x %s\n", e->name, (unsigned long long) e->size,
+				e->dosTime, e->crc, e->tncDate);
+	}
+	fclose(m);
+	rename(SYNC_MANIFEST ".tmp", SYNC_MANIFEST);
+}
+
+
+static void syncTap(int c)
+{
+	lastConsole = time(NULL);
+	if(capLen + 1 >= capAlloc)
+	{
+		size_t alloc = capAlloc ? capAlloc * 2 : 4096;
+		char * p = realloc(cap, alloc);
+
+		if(p == NULL)
+			return;
+		cap = p;
+		capAlloc = alloc;
+	}
+	cap[capLen++] = c;
+	cap[capLen] = 0;
+}
+
+
+static int listPoll(void)
+{
+	time_t now = time(NULL);
+
+	if(capLen && now - lastConsole >= SYNC_QUIET)
+		return 1;
+	if(now - phaseStart > SYNC_TIMEOUT)
+		return 2;
+	return 0;
+}
+
+
+static int copyPoll(void)
+{
+	time_t now = time(NULL);
+	int i;
+
+	for(i = 0; i < MAXFPTR; i++)
+	{
+		if(File[i])
+		{
+			copyOpened = 1;
+			lastActive = now;
+			return 0;
+		}
+	}
+	if(copyOpened && now - lastActive >= SYNC_SETTLE && now - lastConsole >= SYNC_SETTLE)
+		return 1;
+	if(!copyOpened && now - phaseStart > SYNC_TIMEOUT)
+		return 2;
+	return 0;
+}
+
+
+/*
+ * One line of the TNC directory listing: a name (with the extension
+ * either attached or in a column of its own), the size and the time
+ * stamp. Headers, the echo of the command and the free space line do not
+ * fit and are skipped.
+ */
+static int parseLine(char * line, struct syncFile * e)
+{
+	char * tok[16];
+	int n = 0;
+	int i;
+	char * s;
+
+	for(s = strtok(line, " \t"); s && n < 16; s = strtok(NULL, " \t"))
+		tok[n++] = s;
+	if(n < 2)
+		return -1;
+
+	for(s = tok[0]; *s; s++)
+		*s = tolower((unsigned char) *s);
+
+	memset(e, 0, sizeof *e);
+	if(isNumber(tok[1]))
+	{
+		snprintf(e->name, sizeof e->name, "%.13s", tok[0]);
+		i = 1;
+	}
+	else
+	if(n >= 3 && strlen(tok[1]) <= 3 && isNumber(tok[2]) && strchr(tok[0], '.') == NULL)
+	{
+		for(s = tok[1]; *s; s++)
+			*s = tolower((unsigned char) *s);
+		snprintf(e->name, sizeof e->name, "%.8s.%.3s", tok[0], tok[1]);
+		i = 2;
+	}
+	else
+		return -1;
+
+	if(!validName(e->name) || isNumber(tok[0]))
+		return -1;
+	e->size = strtoull(tok[i++], NULL, 10);
+
+	// date and time as printed, only compared with the next listing
+	for(; i < n; i++)
+	{
+		if(!isdigit((unsigned char) tok[i][0]))
+			continue;
+		if(e->tncDate[0])
+			strncat(e->tncDate, " ", sizeof(e->tncDate) - strlen(e->tncDate) - 1);
+		strncat(e->tncDate, tok[i], sizeof(e->tncDate) - strlen(e->tncDate) - 1);
+	}
+	return 0;
+}
+
+
+static int listTnc(const char * drive, struct syncList * l)
+{
+	char command[64];
+	char * line;
+	char * next;
+	struct syncFile e;
+
+	l->n = 0;
+	capLen = 0;
+	phaseStart = lastConsole = time(NULL);
+	snprintf(command, sizeof command, "dir %s", drive);
+	sendCommand(command);
+	if(sessionLoop(0, listPoll) != 1)
+	{
+		fprintf(stderr, "No directory listing from the TNC\r\n");
+		return -1;
+	}
+
+	for(line = cap; line && *line; line = next)
+	{
+		next = line + strcspn(line, "\r\n");
+		if(*next)
+			*next++ = 0;
+		if(parseLine(line, &e) == 0 && listAdd(l))
+			l->f[l->n - 1] = e;
+	}
+	return 0;
+}
+
+
+static int copyFile(const char * name, const char * drive)
+{
+	char command[64];
+	char lname[16];
+	size_t i;
+
+	// the name as the TNC lists it
+	for(i = 0; name[i] && i < sizeof(lname) - 1; i++)
+		lname[i] = tolower((unsigned char) name[i]);
+	lname[i] = 0;
+	snprintf(command, sizeof command, "cp c:%s %s%s", lname, drive, lname);
+	copyOpened = 0;
+	capLen = 0;
+	phaseStart = lastConsole = lastActive = time(NULL);
+	sendCommand(command);
+	return sessionLoop(0, copyPoll) == 1 ? 0 : -1;
+}
+
+
+int syncRun(char * port, int bitrate, const char * dir, const char * drive)
+{
+	struct syncList sent;
+	int failed = 0;
+	int unchanged = 0;
+	int i;
+
+	if(drive == NULL)
+		drive = "r:";
+	memset(&sent, 0, sizeof sent);
+
+	if(chdir(dir) != 0)
+	{
+		fprintf(stderr, "Can't change to %s (%s)\r\n", dir, strerror(errno));
+		return 1;
+	}
+	free(cwd);
+	cwd = getcwd(NULL, 0);
+
+	loadManifest();
+	scanHost();
+
+	if(portOpen(port, bitrate) != 0)
+		return 1;
+	consoleTap = syncTap;
+
+	if(listTnc(drive, &tnc) != 0)
+		return 1;
+
+	for(i = 0; i < host.n; i++)
+	{
+		struct syncFile * h = &host.f[i];
+		struct syncFile * t = listFind(&tnc, h->name);
+		struct syncFile * m = listFind(&manifest, h->name);
+		const char * reason = NULL;
+
+		if(t == NULL)
+			reason = "not on the TNC";
+		else
+		if(t->size != h->size)
+			reason = "size differs";
+		else
+		if(m == NULL)
+			reason = "not in the manifest";
+		else
+		if(m->crc != h->crc)
+			reason = "content changed";
+		else
+		if(m->dosTime != h->dosTime)
+			reason = "time stamp changed";
+		else
+		if(m->tncDate[0] && strcmp(m->tncDate, t->tncDate) != 0)
+			reason = "changed on the TNC";
+
+		if(reason == NULL)
+		{
+			unchanged++;
+			continue;
+		}
+
+		printf("\r\n%s: %s, copying\r\n", h->name, reason);
+		if(copyFile(h->name, drive) == 0)
+		{
+			struct syncFile * s = listAdd(&sent);
+
+			if(s)
+				*s = *h;
+		}
+		else
+		{
+			printf("%s: copy failed\r\n", h->name);
+			failed++;
+		}
+		// the entry is rewritten from the host list below
+		if(m)
+			m->name[0] = 0;
+	}
+
+	// the dates the TNC gave the new copies, to notice later changes there
+	if(sent.n && listTnc(drive, &tnc) != 0)
+		tnc.n = 0;
+
+	for(i = 0; i < sent.n; i++)
+	{
+		struct syncFile * t = listFind(&tnc, sent.f[i].name);
+		struct syncFile * m = listFind(&manifest, sent.f[i].name);
+
+		if(m == NULL)
+			m = listAdd(&manifest);
+		if(m == NULL)
+			break;
+		*m = sent.f[i];
+		if(t)
+			strcpy(m->tncDate, t->tncDate);
+	}
+	// drop entries of files that are gone or failed
+	for(i = 0; i < manifest.n;)
+	{
+		if(manifest.f[i].name[0] == 0 || listFind(&host, manifest.f[i].name) == NULL)
+			manifest.f[i] = manifest.f[--manifest.n];
+		else
+			i++;
+	}
+	saveManifest();
+
+	consoleTap = NULL;
+	printf("\r\n%d files copied, %d unchanged, %d failed\r\n", sent.n, unchanged, failed);
+	return failed;
+}
@@ -0,0 +1,22 @@
+/*
+ ============================================================================
+ Name        : sync.h
+ Author      : F. Erckenbrecht / dg1yfe
+ Copyright   : GPL
+ Description : Copy the changed files of a host directory to a TNC drive
+ ============================================================================
+ */
+
+#ifndef SYNC_H_
+#define SYNC_H_
+
+/*
+ * Lists drive (e.g. "r:") on the TNC console, compares the listing and
+ * the manifest .openrs-sync in dir (size, DOS time stamp and CRC32C of
+ * every file as it was sent) with the files in dir and types
+ * "cp c:<name> <drive><name>" for the files that changed.
+ * Returns the number of files that could not be copied.
+ */
+int syncRun(char * port, int bitrate, const char * dir, const char * drive);
+
+#endif /* SYNC_H_ */
@@ -0,0 +1,454 @@
+/*
+ ============================================================================
+ Name        : textmode.c
+ Author      : F. Erckenbrecht / dg1yfe
+ Copyright   : GPL
+ Description : DOS text mode for 't' opens: the TNC sees CRLF, the host
+               file keeps LF
+ ============================================================================
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/types.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "OpenRS.h"
+#include "textmode.h"
+#include "vfs.h"
+
+#define TEXT_BUF	8192
+
+/*
+ * A LF that does not follow a CR in the file is sent as CRLF, a file that
+ * already has CRLF line ends reads unchanged. The mapping of text offsets
+ * to file offsets is found by scanning the file, forward from the current
+ * position where possible.
+ */
+struct text {
+	FILE *			base;
+	uint64_t		pos;		// offset in the text
+	int				lfOwed;		// read: CR of an expanded LF delivered, its LF not yet
+	int				prevCR;		// read: the file byte before the current one is CR
+	int				heldCR;		// write: CR waiting for the next byte
+	int				writing;
+	size_t			rlen;		// read buffer, file data
+	size_t			roff;
+	unsigned char	buf[TEXT_BUF];
+};
+
+
+static size_t findByte(const unsigned char * p, size_t n, unsigned char c)
+{
+#ifdef __SSE2__
+	__m128i k = _mm_set1_epi8((char) c);
+	size_t i = 0;
+
+	for(; i + 16 <= n; i += 16)
+	{
+		int m = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (p + i)), k));
+
+		if(m)
+			return i + __builtin_ctz(m);
+	}
+	for(; i < n; i++)
+	{
+		if(p[i] == c)
+			return i;
+	}
+	return n;
+#else
+	const unsigned char * q = memchr(p, c, n);
+
+	return q ? (size_t) (q - p) : n;
+#endif
+}
+
+
+/*
+ * Number of LFs in p[0..n) that are not preceded by a CR, i.e. the bytes
+ * the text is longer than the file
+ */
+static size_t countBareLF(const unsigned char * p, size_t n, int prevCR)
+{
+	size_t c = 0;
+	size_t i = 1;
+
+	if(n == 0)
+		return 0;
+	if(p[0] == '\n' && !prevCR)
+		c++;
+#ifdef __SSE2__
+	{
+		const __m128i lf = _mm_set1_epi8('\n');
+		const __m128i cr = _mm_set1_epi8('\r');
+
+		for(; i + 16 <= n; i += 16)
+		{
+			__m128i v = _mm_loadu_si128((const __m128i *) (p + i));
+			__m128i b = _mm_loadu_si128((const __m128i *) (p + i - 1));
+
+			c += __builtin_popcount(_mm_movemask_epi8(
+					_mm_andnot_si128(_mm_cmpeq_epi8(b, cr), _mm_cmpeq_epi8(v, lf))));
+		}
+	}
+#endif
+	for(; i < n; i++)
+	{
+		if(p[i] == '\n' && p[i-1] != '\r')
+			c++;
+	}
+	return c;
+}
+
+
+/*
+ * Position the file at text offset target, scanning from the file offset
+ * host which is at text offset text. Returns the text length if the file
+ * ends before target.
+ */
+static uint64_t textMap(struct text * t, uint64_t host, uint64_t text, int prevCR, uint64_t target)
+{
+	size_t n;
+
+	t->lfOwed = 0;
+	if(fseeko(t->base, host, SEEK_SET) != 0)
+		return text;
+
+	while(text < target && (n = fread(t->buf, 1, sizeof t->buf, t->base)) > 0)
+	{
+		size_t extra = countBareLF(t->buf, n, prevCR);
+		size_t i;
+
+		if(text + n + extra < target)
+		{
+			host += n;
+			text += n + extra;
+			prevCR = t->buf[n-1] == '\r';
+			continue;
+		}
+
+		for(i = 0; text < target; i++)
+		{
+			int bare = t->buf[i] == '\n' && !prevCR;
+
+			if(bare && text + 1 == target)
+			{
+				// between the CR and the LF of an expanded line end
+				i++;
+				t->lfOwed = 1;
+				text++;
+				break;
+			}
+			text += bare ? 2 : 1;
+			prevCR = t->buf[i] == '\r';
+		}
+		host += i;
+		if(t->lfOwed)
+			prevCR = 0;
+		break;
+	}
+
+	t->prevCR = prevCR;
+	if(text < target)
+	{
+		// beyond the end, the gap is the same in both
+		host += target - text;
+	}
+	fseeko(t->base, host, SEEK_SET);
+	return text;
+}
+
+
+static void textFlushCR(struct text * t)
+{
+	if(t->heldCR)
+	{
+		putc('\r', t->base);
+		t->heldCR = 0;
+	}
+}
+
+
+static ssize_t textRead(void * cookie, char * out, size_t size)
+{
+	struct text * t = cookie;
+	size_t n = 0;
+
+	if(t->writing)
+	{
+		textFlushCR(t);
+		fseeko(t->base, 0, SEEK_CUR);		// switching from writing to reading
+		t->writing = 0;
+	}
+
+	while(n < size)
+	{
+		const unsigned char * p;
+		size_t k;
+		size_t j;
+
+		if(t->lfOwed)
+		{
+			out[n++] = '\n';
+			t->lfOwed = 0;
+			continue;
+		}
+		if(t->roff == t->rlen)
+		{
+			t->rlen = fread(t->buf, 1, sizeof t->buf, t->base);
+			t->roff = 0;
+			if(t->rlen == 0)
+				break;
+		}
+
+		p = t->buf + t->roff;
+		k = t->rlen - t->roff;
+		if(k > size - n)
+			k = size - n;
+		j = findByte(p, k, '\n');
+		memcpy(out + n, p, j);
+		n += j;
+		t->roff += j;
+		if(j)
+			t->prevCR = p[j-1] == '\r';
+		if(j == k)
+			continue;
+
+		// LF
+		t->roff++;
+		if(t->prevCR)
+			out[n++] = '\n';
+		else
+		{
+			out[n++] = '\r';
+			t->lfOwed = 1;
+		}
+		t->prevCR = 0;
+	}
+	t->pos += n;
+	return n;
+}
+
+
+static ssize_t textWrite(void * cookie, const char * buf, size_t size)
+{
+	struct text * t = cookie;
+	const unsigned char * in = (const unsigned char *) buf;
+	size_t i = 0;
+
+	if(!t->writing)
+	{
+		// data read ahead is given back, the write goes where the TNC is
+		if(t->rlen)
+			fseeko(t->base, (off_t) t->roff - (off_t) t->rlen, SEEK_CUR);
+		else
+			fseeko(t->base, 0, SEEK_CUR);
+		t->rlen = t->roff = 0;
+		t->lfOwed = 0;
+		t->writing = 1;
+	}
+
+	if(t->heldCR && size)
+	{
+		if(in[0] != '\n')
+			putc('\r', t->base);
+		t->heldCR = 0;
+	}
+
+	while(i < size)
+	{
+		size_t j = i + findByte(in + i, size - i, '\r');
+
+		if(j > i && fwrite(in + i, 1, j - i, t->base) != j - i)
+			return -1;
+		if(j == size)
+			break;
+		if(j + 1 == size)
+		{
+			t->heldCR = 1;		// the LF may come with the next write
+			break;
+		}
+		if(in[j+1] != '\n')
+			putc('\r', t->base);
+		i = j + 1;
+	}
+	if(ferror(t->base))
+		return -1;
+	t->pos += size;
+	return size;
+}
+
+
+static int textSeek(void * cookie, int64_t * offset, int whence)
+{
+	struct text * t = cookie;
+	uint64_t host = 0;
+	uint64_t text = 0;
+	int prevCR = 0;
+	int64_t target;
+
+	if(whence == SEEK_CUR && *offset == 0)
+	{
+		*offset = t->pos;		// FTELL
+		return 0;
+	}
+
+	switch(whence)
+	{
+	case SEEK_SET:
+		target = *offset;
+		break;
+	case SEEK_CUR:
+		target = t->pos + *offset;
+		break;
+	case SEEK_END:
+		textFlushCR(t);
+		fflush(t->base);
+		target = textMap(t, 0, 0, 0, UINT64_MAX) + *offset;
+		t->pos = UINT64_MAX;	// the scan started over
+		break;
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+	if(target < 0)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	// forward seeks continue from the current position
+	if(((uint64_t) target > t->pos || ((uint64_t) target == t->pos && !t->lfOwed)) && !t->heldCR)
+	{
+		off_t o = ftello(t->base);
+
+		if(o != -1)
+		{
+			host = o - (t->writing ? 0 : t->rlen - t->roff);
+			text = t->pos;
+			prevCR = t->prevCR;
+			if(t->lfOwed)
+			{
+				text++;
+				prevCR = 0;
+			}
+			if(t->writing)
+			{
+				prevCR = 0;
+				if(host)
+				{
+					// the last byte written decides if a following LF is bare
+					fflush(t->base);
+					if(fseeko(t->base, host - 1, SEEK_SET) == 0)
+						prevCR = getc(t->base) == '\r';
+				}
+			}
+		}
+	}
+
+	textFlushCR(t);
+	fflush(t->base);
+	t->rlen = t->roff = 0;
+	t->writing = 0;
+	textMap(t, host, text, prevCR, target);
+	t->pos = target;
+	*offset = target;
+	return 0;
+}
+
+
+static int textClose(void * cookie)
+{
+	struct text * t = cookie;
+	int r;
+
+	textFlushCR(t);
+	r = fclose(t->base);
+	free(t);
+	return r;
+}
+
+
+#ifdef __APPLE__
+static int textReadBsd(void * cookie, char * buf, int size)
+{
+	return textRead(cookie, buf, size);
+}
+
+
+static int textWriteBsd(void * cookie, const char * buf, int size)
+{
+	return textWrite(cookie, buf, size);
+}
+
+
+static fpos_t textSeekBsd(void * cookie, fpos_t offset, int whence)
+{
+	int64_t o = offset;
+
+	if(textSeek(cookie, &o, whence) != 0)
+		return -1;
+	return o;
+}
+#endif
+
+
+FILE * textOpen(const char * path, const char * mode)
+{
+	char m[8];
+	struct text * t;
+	FILE * f;
+	size_t n = 0;
+	const char * s;
+
+	// the file is also read to map offsets, write modes get '+'
+	for(s = mode; *s && n < sizeof(m) - 2; s++)
+	{
+		if(*s != 't' && *s != 'T')
+			m[n++] = *s;
+	}
+	m[n] = 0;
+	if(strpbrk(m, "wa") && !strchr(m, '+'))
+	{
+		m[n++] = '+';
+		m[n] = 0;
+	}
+
+	t = calloc(1, sizeof(*t));
+	if(t == NULL)
+		return NULL;
+	t->base = vfsOpen(path, m);
+	if(t->base == NULL)
+	{
+		free(t);
+		return NULL;
+	}
+	if(strchr(m, 'a'))
+	{
+		t->pos = textMap(t, 0, 0, 0, UINT64_MAX);
+	}
+
+#ifdef __APPLE__
+	f = funopen(t, textReadBsd, textWriteBsd, textSeekBsd, textClose);
+#else
+	{
+		cookie_io_functions_t io = { textRead, textWrite, textSeek, textClose };
+		f = fopencookie(t, m, io);
+	}
+#endif
+	if(f == NULL)
+	{
+		fclose(t->base);
+		free(t);
+	}
+	return f;
+}
@@ -0,0 +1,23 @@
+/*
+ ============================================================================
+ Name        : textmode.h
+ Author      : F. Erckenbrecht / dg1yfe
+ Copyright   : GPL
+ Description : DOS text mode for 't' opens: the TNC sees CRLF, the host
+               file keeps LF
+ ============================================================================
+ */
+
+#ifndef TEXTMODE_H_
+#define TEXTMODE_H_
+
+#include <stdio.h>
+
+/*
+ * Opens path through the vfs and returns a stream in which every LF of
+ * the file reads as CRLF and CRLF written becomes LF. Offsets (FTELL,
+ * FSEEK) are those of the CRLF text.
+ */
+FILE * textOpen(const char * path, const char * mode);
+
+#endif /* TEXTMODE_H_ */
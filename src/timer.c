@@ -0,0 +1,104 @@
+/*
+ ============================================================================
+ Name        : timer.c
+ Author      : F. Erckenbrecht / dg1yfe
+ Copyright   : GPL
+ Description : Hashed timer wheel driven by the session loop
+ ============================================================================
+ */
+
+#include <stddef.h>
+#include <time.h>
+
+#include "timer.h"
+
+uint32_t timersFired = 0;
+
+static struct timer * wheel[TIMER_SLOTS];
+static uint64_t curTick = 0;		// last tick whose slot was run
+static uint64_t nowMs = 0;
+
+
+static uint64_t clockMs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+uint64_t timerNow(void)
+{
+	if(nowMs == 0)
+		nowMs = clockMs();
+	return nowMs;
+}
+
+
+void timerDel(struct timer * t)
+{
+	if(t->pprev == NULL)
+		return;
+	*t->pprev = t->next;
+	if(t->next)
+		t->next->pprev = t->pprev;
+	t->next = NULL;
+	t->pprev = NULL;
+}
+
+
+void timerAdd(struct timer * t, uint32_t ms)
+{
+	struct timer ** slot;
+	uint64_t tick;
+
+	timerDel(t);
+	t->expires = timerNow() + ms;
+	if(curTick == 0)
+		curTick = nowMs / TIMER_TICK;
+	tick = t->expires / TIMER_TICK;
+	if(tick <= curTick)
+		tick = curTick + 1;
+
+	// timers further out than one revolution wait for later rounds
+	slot = &wheel[tick & (TIMER_SLOTS - 1)];
+	t->next = *slot;
+	if(t->next)
+		t->next->pprev = &t->next;
+	t->pprev = slot;
+	*slot = t;
+}
+
+
+void timerRun(void)
+{
+	uint64_t target;
+
+	nowMs = clockMs();
+	target = nowMs / TIMER_TICK;
+	if(curTick == 0)
+		curTick = target;
+
+	// after a long stall every slot is visited once
+	if(target - curTick > TIMER_SLOTS)
+		curTick = target - TIMER_SLOTS;
+
+	while(curTick < target)
+	{
+		struct timer * t;
+		struct timer * next;
+
+		curTick++;
+		for(t = wheel[curTick & (TIMER_SLOTS - 1)]; t; t = next)
+		{
+			next = t->next;
+			if(t->expires / TIMER_TICK <= curTick)
+			{
+				timerDel(t);
+				timersFired++;
+				t->fn(t);
+			}
+		}
+	}
+}
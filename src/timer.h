@@ -0,0 +1,45 @@
+/*
+ ============================================================================
+ Name        : timer.h
+ Author      : F. Erckenbrecht / dg1yfe
+ Copyright   : GPL
+ Description : Hashed timer wheel driven by the session loop
+ ============================================================================
+ */
+
+#ifndef TIMER_H_
+#define TIMER_H_
+
+#include <stdint.h>
+
+#define TIMER_SLOTS	256		// power of 2
+#define TIMER_TICK	100		// ms per slot
+
+/*
+ * Timers are embedded in the structure they watch. Adding, re-adding and
+ * deleting are O(1); timerRun() only visits the slots of the ticks that
+ * passed. A timer may fire up to one tick early, watchdogs compare their
+ * own time stamps and re-arm for the remainder (so activity only has to
+ * store a time stamp, not touch the wheel). The callback may re-add its
+ * own timer but must not delete other timers.
+ */
+struct timer {
+	struct timer *	next;
+	struct timer **	pprev;		// NULL if not pending
+	uint64_t		expires;	// ms, monotonic
+	void			(*fn)(struct timer * t);
+};
+
+extern uint32_t timersFired;
+
+void timerAdd(struct timer * t, uint32_t ms);
+void timerDel(struct timer * t);
+void timerRun(void);
+uint64_t timerNow(void);		// ms, as of the last timerRun()
+
+static inline int timerPending(const struct timer * t)
+{
+	return t->pprev != 0;
+}
+
+#endif /* TIMER_H_ */
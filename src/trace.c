@@ -0,0 +1,150 @@
+/*
+ ============================================================================
+ Name        : trace.c
+ Author      : F. Erckenbrecht / dg1yfe
+ Copyright   : GPL
+ Description : Chrome trace (chrome://tracing, Perfetto) export of the
+               protocol tracepoints
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdint.h>
+
+#include "trace.h"
+
+int iTraceActive = 0;
+int iTraceFop = 0;
+
+static FILE * traceFile = NULL;
+static int traceFirst;
+static uint64_t traceT0;
+
+static const char * const cmdName[] = {
+	"FOPEN", "FREAD", "FWRITE", "FCLOSE",
+	"FGETC", "FPUTC", "FGETS", "FPUTS",
+	"FINDFIRST", "FINDNEXT",
+	"REMOVE", "RENAME",
+	"FTELL", "FSEEK",
+	"UNGETC"
+};
+
+
+const char * traceCmdName(int cmd)
+{
+	if(cmd < 0 || cmd >= (int) (sizeof(cmdName) / sizeof(cmdName[0])))
+		return "?";
+	return cmdName[cmd];
+}
+
+
+static uint64_t traceNow(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+int traceOpen(const char * filename)
+{
+	traceFile = fopen(filename, "w");
+	if(traceFile == NULL)
+	{
+		return -1;
+	}
+
+	fprintf(traceFile, "[\n");
+	traceFirst = 1;
+	traceT0 = traceNow();
+	iTraceActive = 1;
+	return 0;
+}
+
+
+void traceClose(void)
+{
+	if(traceFile)
+	{
+		fprintf(traceFile, "\n]\n");
+		fclose(traceFile);
+		traceFile = NULL;
+	}
+	iTraceActive = 0;
+}
+
+
+void traceEvent(int event, int cmd, int32_t arg)
+{
+	const char * name;
+	const char * ph;
+	const char * argName;
+	char cbuf[16];
+
+	if(traceFile == NULL)
+		return;
+
+	if(cmd >= 0 && cmd < (int)(sizeof(cmdName)/sizeof(cmdName[0])))
+	{
+		name = cmdName[cmd];
+	}
+	else
+	{
+		snprintf(cbuf, sizeof cbuf, "0x%02x", cmd);
+		name = cbuf;
+	}
+
+	/*
+	 * A request is one "B"/"E" span from request start to response flush,
+	 * the file operation a nested span. The time between request start
+	 * and argument decode is spent waiting for the line.
+	 */
+	switch(event)
+	{
+	case TRACE_REQUEST_START:
+		ph = "B";
+		argName = NULL;
+		break;
+	case TRACE_ARGS_DONE:
+		ph = "i";
+		argName = "fd";
+		break;
+	case TRACE_FOP_START:
+		ph = "B";
+		argName = "fd";
+		break;
+	case TRACE_FOP_END:
+		ph = "E";
+		argName = "result";
+		break;
+	case TRACE_RESPONSE_FLUSH:
+	default:
+		ph = "E";
+		argName = "bytes";
+		break;
+	}
+
+	fprintf(traceFile, "%s{\"name\":\"%s%s\",\"cat\":\"%s\",\"ph\":\"%s\",\"ts\":%llu,\"pid\":%d,\"tid\":1",
+			traceFirst ? "" : ",\n",
+			event == TRACE_FOP_START || event == TRACE_FOP_END ? "fop " : (event == TRACE_ARGS_DONE ? "args " : ""),
+			name,
+			event == TRACE_FOP_START || event == TRACE_FOP_END ? "file" : "request",
+			ph,
+			(unsigned long long)(traceNow() - traceT0),
+			(int) getpid());
+	if(event == TRACE_ARGS_DONE)
+	{
+		fprintf(traceFile, ",\"s\":\"t\"");
+	}
+	if(argName)
+	{
+		fprintf(traceFile, ",\"args\":{\"%s\":%ld}", argName, (long) arg);
+	}
+	fprintf(traceFile, "}");
+	traceFirst = 0;
+}
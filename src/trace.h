@@ -0,0 +1,72 @@
+/*
+ ============================================================================
+ Name        : trace.h
+ Author      : F. Erckenbrecht / dg1yfe
+ Copyright   : GPL
+ Description : Static tracepoints (USDT) and Chrome trace export for
+               protocol requests
+ ============================================================================
+ */
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdint.h>
+
+/*
+ * If <sys/sdt.h> (systemtap-sdt-dev) is available the probes below are
+ * compiled as USDT probes of provider "openrs". They can be listed with
+ *   bpftrace -l 'usdt:./openrs:*'
+ * and cost a single nop while nobody is attached.
+ */
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HAVE_SDT 1
+#endif
+#endif
+
+enum { TRACE_REQUEST_START, TRACE_ARGS_DONE, TRACE_FOP_START, TRACE_FOP_END,
+	TRACE_RESPONSE_FLUSH };
+
+extern int iTraceActive;
+extern int iTraceFop;		// a file operation span is open
+
+int traceOpen(const char * filename);
+void traceClose(void);
+void traceEvent(int event, int cmd, int32_t arg);
+const char * traceCmdName(int cmd);
+
+#ifdef HAVE_SDT
+#define TRACE_PROBE(name, cmd, arg)	DTRACE_PROBE2(openrs, name, cmd, arg)
+#else
+#define TRACE_PROBE(name, cmd, arg)	do {} while(0)
+#endif
+
+#define TRACE_POINT(event, name, cmd, arg)	\
+	do {									\
+		TRACE_PROBE(name, cmd, arg);		\
+		if(iTraceActive)					\
+			traceEvent(event, cmd, arg);	\
+	} while(0)
+
+/* request byte received, arg: - */
+#define TRACE_REQ_START(cmd)		TRACE_POINT(TRACE_REQUEST_START, request__start, cmd, 0)
+/* all arguments decoded, arg: handle (if any) */
+#define TRACE_ARGS(cmd, fd)			TRACE_POINT(TRACE_ARGS_DONE, args__done, cmd, fd)
+/* file operation about to start, arg: handle (if any) */
+#define TRACE_FOP_BEGIN(cmd, fd)	do { TRACE_POINT(TRACE_FOP_START, fop__start, cmd, fd); iTraceFop = 1; } while(0)
+/* file operation finished, arg: result */
+#define TRACE_FOP_DONE(cmd, res)	do { TRACE_POINT(TRACE_FOP_END, fop__end, cmd, res); iTraceFop = 0; } while(0)
+/* response completely handed to the port, arg: bytes sent for this request */
+#define TRACE_FLUSH(cmd, bytes)		TRACE_POINT(TRACE_RESPONSE_FLUSH, response__flush, cmd, bytes)
+/* request abandoned: close the open spans (result -1), if a request was started */
+#define TRACE_ABANDON(cmd, bytes)				\
+	do {										\
+		if(iTraceFop)							\
+			TRACE_FOP_DONE(cmd, -1);			\
+		if((cmd) >= 0)							\
+			TRACE_FLUSH(cmd, bytes);			\
+	} while(0)
+
+#endif /* TRACE_H_ */
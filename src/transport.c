@@ -0,0 +1,601 @@
+/*
+ ============================================================================
+ Name        : transport.c
+ Author      : F. Erckenbrecht / dg1yfe
+ Copyright   : GPL
+ Description : Connection to the TNC: local serial device, raw TCP or
+               RFC 2217 (telnet com port control) serial server
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <time.h>
+#include <libgen.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#include "OpenRS.h"
+#include "transport.h"
+#include "dlog.h"
+#include "rt.h"
+#include "wire.h"
+
+// telnet
+#define IAC		255
+#define DONT	254
+#define DO		253
+#define WONT	252
+#define WILL	251
+#define SB		250
+#define SE		240
+#define OPT_BINARY		0
+#define OPT_SGA			3
+#define OPT_COMPORT		44
+
+// RFC 2217 client to server commands
+#define CPC_SET_BAUDRATE	1
+#define CPC_SET_DATASIZE	2
+#define CPC_SET_PARITY		3
+#define CPC_SET_STOPSIZE	4
+#define CPC_SET_CONTROL		5
+
+enum { TN_DATA, TN_IAC, TN_OPT, TN_SB, TN_SB_IAC };
+
+static int type = PORT_SERIAL;
+static unsigned char txBuf[TXBUF_SIZE];
+static size_t txLen = 0;
+static unsigned char conBuf[CONSOLE_QUEUE];
+static size_t conLen = 0;
+static int tnState = TN_DATA;
+static int tnVerb;
+
+int hotplugWait = 60;
+static char portName[PATH_MAX];
+static int portSpeed;
+static int lost = 0;				// the device is gone, waiting for it
+static time_t lostAt;
+static int lastErr;				// of the last attempt to reopen
+static time_t lastTry;
+static int watchFd = -1;			// inotify on the directory of the device
+
+
+/*
+ * Check an error of the port for the loss of the device (USB adapter
+ * unplugged or reset, serial server gone). The port is marked lost, data
+ * for it is discarded until portReopen() has brought it back.
+ */
+int portGone(int err)
+{
+	if(err != EIO && err != ENXIO && err != ENODEV && err != EPIPE && err != ECONNRESET && err != 0)
+		return 0;
+	if(!lost)
+	{
+		lost = 1;
+		lostAt = lastTry = time(NULL);
+		lastErr = 0;
+		printf("\r\nLost %s (%s), waiting for it to come back.\r\n", portName, err ? strerror(err) : "hangup");
+		DLOGS(DLOG_REQUEST, "port %s lost", portName, 0, 0);
+	}
+	return 1;
+}
+
+
+int portLost(void)
+{
+	return lost;
+}
+
+
+static int writeAll(const unsigned char * buf, size_t len)
+{
+	int errcnt = 0;
+
+	if(lost)
+		return 0;
+	while(len)
+	{
+		ssize_t w = write(iDescriptor, buf, len);
+
+		if(w > 0)
+		{
+			buf += w;
+			len -= w;
+			errcnt = 0;
+		}
+		else
+		if(w == -1 && (errno == EAGAIN || errno == EINTR) && errcnt < 100)
+		{
+			usleep(1000);
+			errcnt++;
+		}
+		else
+		{
+			if(w == -1 && errno == EAGAIN)
+			{
+				fprintf(stderr,"Error writing to serial Port. Discarding some data.\r\n");
+				return 0;
+			}
+			if(w == -1 && hotplugWait && portGone(errno))
+				return 0;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+
+/*
+ * Write to the TNC, doubling IAC for RFC 2217
+ */
+static int portWriteRaw(const unsigned char * buf, size_t len)
+{
+	unsigned char esc[2 * TXBUF_SIZE];
+
+	wireData(WIRE_TX, buf, len);
+	if(type != PORT_RFC2217)
+		return writeAll(buf, len);
+
+	while(len)
+	{
+		size_t n = 0;
+
+		while(len && n < sizeof(esc) - 1)
+		{
+			if(*buf == IAC)
+				esc[n++] = IAC;
+			esc[n++] = *buf++;
+			len--;
+		}
+		if(writeAll(esc, n) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+
+int portFlush(void)
+{
+	int r = 0;
+
+	if(txLen)
+	{
+		r = portWriteRaw(txBuf, txLen);
+		txLen = 0;
+		if(r != 0)
+		{
+			perror("Unrecoverable Error while writing to serial port. Exiting...\r\n");
+			exit(errno);
+		}
+	}
+	return r;
+}
+
+
+void portPut(int data)
+{
+	if(txLen == sizeof(txBuf))
+		portFlush();
+	txBuf[txLen++] = (unsigned char) data;
+}
+
+
+int portWrite(const void * buf, size_t len)
+{
+	portFlush();
+	return portWriteRaw(buf, len);
+}
+
+
+void portConsole(const void * buf, size_t len)
+{
+	if(!consoleClear())
+		protoStats.held += len;
+	if(len > sizeof(conBuf) - conLen)
+	{
+		protoStats.discarded += len - (sizeof(conBuf) - conLen);
+		len = sizeof(conBuf) - conLen;
+	}
+	memcpy(conBuf + conLen, buf, len);
+	conLen += len;
+	portConsoleFlush();
+}
+
+
+void portConsoleFlush(void)
+{
+	if(conLen == 0 || lost || !consoleClear())
+		return;
+	portFlush();
+	if(portWriteRaw(conBuf, conLen) != 0)
+	{
+		fprintf(stderr,"Error writing to serial port.\n\r");
+		exit(errno);
+	}
+	conLen = 0;
+}
+
+
+int portType(void)
+{
+	return type;
+}
+
+
+int portRawFd(void)
+{
+	portFlush();
+	// a wire capture has to see every byte, no sendfile() past it
+	return type == PORT_RFC2217 || wireOn || lost ? -1 : iDescriptor;
+}
+
+
+static void tnSend(int verb, int opt)
+{
+	unsigned char b[3] = { IAC, verb, opt };
+
+	writeAll(b, sizeof b);
+}
+
+
+static void tnComPort(int cmd, const unsigned char * val, int len)
+{
+	unsigned char b[32];
+	int n = 0;
+
+	b[n++] = IAC;
+	b[n++] = SB;
+	b[n++] = OPT_COMPORT;
+	b[n++] = cmd;
+	while(len--)
+	{
+		if(*val == IAC)
+			b[n++] = IAC;
+		b[n++] = *val++;
+	}
+	b[n++] = IAC;
+	b[n++] = SE;
+	writeAll(b, n);
+}
+
+
+/*
+ * Strip telnet commands from received data, answer option requests
+ */
+static ssize_t tnFilter(char * buf, ssize_t len)
+{
+	ssize_t i;
+	ssize_t o = 0;
+
+	for(i = 0; i < len; i++)
+	{
+		unsigned char c = buf[i];
+
+		switch(tnState)
+		{
+		case TN_DATA:
+			if(c == IAC)
+				tnState = TN_IAC;
+			else
+				buf[o++] = c;
+			break;
+		case TN_IAC:
+			if(c == IAC)
+			{
+				buf[o++] = c;
+				tnState = TN_DATA;
+			}
+			else
+			if(c == WILL || c == WONT || c == DO || c == DONT)
+			{
+				tnVerb = c;
+				tnState = TN_OPT;
+			}
+			else
+			if(c == SB)
+				tnState = TN_SB;
+			else
+				tnState = TN_DATA;
+			break;
+		case TN_OPT:
+			// refuse what we did not offer, the others are already agreed
+			if(tnVerb == DO && c != OPT_BINARY && c != OPT_SGA && c != OPT_COMPORT)
+				tnSend(WONT, c);
+			else
+			if(tnVerb == WILL && c != OPT_BINARY && c != OPT_SGA)
+				tnSend(DONT, c);
+			else
+			if(tnVerb == DONT && c == OPT_COMPORT)
+				fprintf(stderr, "Serial server does not support RFC 2217, bitrate not set.\r\n");
+			tnState = TN_DATA;
+			break;
+		case TN_SB:
+			// com port notifications (line/modem state) are ignored
+			if(c == IAC)
+				tnState = TN_SB_IAC;
+			break;
+		case TN_SB_IAC:
+			tnState = c == SE ? TN_DATA : TN_SB;
+			break;
+		}
+	}
+	return o;
+}
+
+
+ssize_t portRead(char * buf, size_t len)
+{
+	ssize_t r;
+
+	r = read(iDescriptor, buf, len);
+	// readable but no data: hung up
+	if(r == 0 || (r == -1 && errno != EAGAIN && errno != EINTR))
+	{
+		if(hotplugWait && portGone(r == 0 ? 0 : errno))
+			return 0;
+	}
+	if(r > 0 && type == PORT_RFC2217)
+	{
+		r = tnFilter(buf, r);
+	}
+	if(r > 0)
+		wireData(0, buf, r);
+	return r;
+}
+
+
+static int tcpOpen(char * port, int speed)
+{
+	char host[PATH_MAX];
+	char * service;
+	struct addrinfo hints;
+	struct addrinfo * res;
+	struct addrinfo * ai;
+	int one = 1;
+	int sndbuf;
+	int r;
+
+	strncpy(host, strchr(port, ':') + 1, sizeof(host) - 1);
+	host[sizeof(host) - 1] = 0;
+
+	service = strrchr(host, ':');
+	if(service == NULL)
+	{
+		fprintf(stderr, "Invalid port %s, use tcp:host:port or rfc2217:host:port\r\n", port);
+		return -1;
+	}
+	*service++ = 0;
+	if(host[0] == '[')		// [::1]:4000
+	{
+		memmove(host, host + 1, strlen(host));
+		if(strchr(host, ']'))
+			*strchr(host, ']') = 0;
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	r = getaddrinfo(host, service, &hints, &res);
+	if(r != 0)
+	{
+		fprintf(stderr, "Error: can't resolve %s (%s)\r\n", host, gai_strerror(r));
+		return -1;
+	}
+
+	iDescriptor = -1;
+	for(ai = res; ai; ai = ai->ai_next)
+	{
+		iDescriptor = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if(iDescriptor == -1)
+			continue;
+		if(connect(iDescriptor, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+		close(iDescriptor);
+		iDescriptor = -1;
+	}
+	freeaddrinfo(res);
+	if(iDescriptor == -1)
+	{
+		if(!lost)
+		{
+			printf("Error: can't connect to %s\r\n", port);
+			printf("       (%s)\r\n", strerror(errno));
+		}
+		return -1;
+	}
+
+	// responses are coalesced by portFlush(), don't delay them any further
+	setsockopt(iDescriptor, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	// about a quarter second of line data, more only adds latency
+	sndbuf = speed / 10 / 4;
+	if(sndbuf < TXBUF_SIZE)
+		sndbuf = TXBUF_SIZE;
+	setsockopt(iDescriptor, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+	if(type == PORT_RFC2217)
+	{
+		unsigned char v[4];
+
+		tnSend(WILL, OPT_BINARY);
+		tnSend(DO, OPT_BINARY);
+		tnSend(WILL, OPT_SGA);
+		tnSend(DO, OPT_SGA);
+		tnSend(WILL, OPT_COMPORT);
+
+		v[0] = speed >> 24;
+		v[1] = speed >> 16;
+		v[2] = speed >> 8;
+		v[3] = speed;
+		tnComPort(CPC_SET_BAUDRATE, v, 4);
+		v[0] = 8;
+		tnComPort(CPC_SET_DATASIZE, v, 1);
+		v[0] = 1;		// none
+		tnComPort(CPC_SET_PARITY, v, 1);
+		v[0] = 1;		// 1 stop bit
+		tnComPort(CPC_SET_STOPSIZE, v, 1);
+		v[0] = 1;		// no flow control
+		tnComPort(CPC_SET_CONTROL, v, 1);
+	}
+	DLOGS(DLOG_REQUEST, "Connected to %s", port, 0, 0);
+	return 0;
+}
+
+
+int portOpen(char * port, int speed)
+{
+	txLen = 0;
+	tnState = TN_DATA;
+	strncpy(portName, port, sizeof(portName) - 1);
+	portSpeed = speed;
+
+	if(wireOpen(port, speed) != 0)
+		return -1;
+	if(strncmp(port, "tcp:", 4) == 0)
+	{
+		type = PORT_TCP;
+		return tcpOpen(port, speed);
+	}
+	if(strncmp(port, "rfc2217:", 8) == 0)
+	{
+		type = PORT_RFC2217;
+		return tcpOpen(port, speed);
+	}
+	type = PORT_SERIAL;
+	if(openSerial(port, speed) != 0)
+		return -1;
+	rtSerial(iDescriptor);
+	return 0;
+}
+
+
+#ifdef __linux__
+// a device node (or by-id link) is created or gets its permissions
+static int watchStart(void)
+{
+	char dir[PATH_MAX];
+
+	strncpy(dir, portName, sizeof(dir) - 1);
+	dir[sizeof(dir) - 1] = 0;
+	watchFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if(watchFd == -1)
+		return -1;
+	if(inotify_add_watch(watchFd, dirname(dir), IN_CREATE | IN_ATTRIB | IN_MOVED_TO) == -1)
+	{
+		close(watchFd);
+		watchFd = -1;
+		return -1;
+	}
+	return 0;
+}
+#endif
+
+
+/*
+ * Bring a lost port back: wait for the device node to reappear, open it and
+ * set it up again (termios, bitrate, telnet options). Open files and the
+ * transfer positions are kept. Exits after hotplugWait seconds.
+ */
+int portReopen(void)
+{
+	time_t now = time(NULL);
+	int changed = 0;
+
+	if(!lost)
+		return 0;
+
+	if(iDescriptor != -1)
+	{
+		close(iDescriptor);
+		iDescriptor = -1;
+		txLen = 0;
+		tnState = TN_DATA;
+#ifdef __linux__
+		if(type == PORT_SERIAL)
+			watchStart();
+#endif
+	}
+
+	if(now - lostAt >= hotplugWait)
+	{
+		fprintf(stderr, "%s did not come back within %d s%s%s%s. Exiting...\r\n", portName, hotplugWait,
+				lastErr ? " (" : "", lastErr ? strerror(lastErr) : "", lastErr ? ")" : "");
+		exit(EIO);
+	}
+
+#ifdef __linux__
+	if(watchFd != -1)
+	{
+		char buf[4096];
+
+		while(read(watchFd, buf, sizeof buf) > 0)
+			changed = 1;
+	}
+#endif
+	// without notification (or for a server) try every 2 s
+	if(!changed && now - lastTry < 2)
+		return -1;
+	lastTry = now;
+
+	// attempts are quiet, only giving up is reported
+	if(type == PORT_SERIAL)
+	{
+		if(access(portName, R_OK | W_OK) != 0 || openSerial(portName, portSpeed) != 0)
+		{
+			lastErr = errno;
+			return -1;
+		}
+		rtSerial(iDescriptor);
+	}
+	else
+	if(tcpOpen(portName, portSpeed) != 0)
+	{
+		lastErr = errno;
+		return -1;
+	}
+
+	if(watchFd != -1)
+	{
+		close(watchFd);
+		watchFd = -1;
+	}
+	lost = 0;
+	protoStats.reconnects++;
+	printf("%s is back after %d s.\r\n", portName, (int) (now - lostAt));
+	DLOGS(DLOG_REQUEST, "port %s reopened", portName, 0, 0);
+	return 0;
+}
+
+
+void portClose(void)
+{
+	if(iDescriptor == -1)
+	{
+		wireClose();
+		return;
+	}
+
+	if(txLen)
+	{
+		portWriteRaw(txBuf, txLen);
+		txLen = 0;
+	}
+	if(type == PORT_SERIAL)
+	{
+		restoreSerial();
+	}
+	close(iDescriptor);
+	iDescriptor = -1;
+	wireClose();
+}
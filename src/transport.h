@@ -0,0 +1,58 @@
+/*
+ ============================================================================
+ Name        : transport.h
+ Author      : F. Erckenbrecht / dg1yfe
+ Copyright   : GPL
+ Description : Connection to the TNC: local serial device, raw TCP or
+               RFC 2217 (telnet com port control) serial server
+ ============================================================================
+ */
+
+#ifndef TRANSPORT_H_
+#define TRANSPORT_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+enum { PORT_SERIAL, PORT_TCP, PORT_RFC2217 };
+
+#define TXBUF_SIZE	8192
+#define CONSOLE_QUEUE	65536
+
+/*
+ * Port names:
+ *   /dev/ttyUSB0            local serial device
+ *   tcp:host:port           raw TCP serial server
+ *   rfc2217:host:port       serial server with RFC 2217, bitrate is set remotely
+ *
+ * Output is collected by portPut() and written with a single write per
+ * portFlush(), so a protocol response leaves as one TCP segment (Nagle is
+ * disabled) instead of one packet per escaped byte.
+ *
+ * Console input (keyboard, scripts, daemon clients) is queued by
+ * portConsole() and only written while consoleClear(), protocol output
+ * always goes first and is never interleaved with it.
+ */
+int portOpen(char * port, int speed);
+void portClose(void);
+int portType(void);
+int portRawFd(void);		// fd data may be written to directly (sendfile), -1 if not
+ssize_t portRead(char * buf, size_t len);
+int portWrite(const void * buf, size_t len);
+void portPut(int data);
+int portFlush(void);
+void portConsole(const void * buf, size_t len);
+void portConsoleFlush(void);
+
+/*
+ * A port whose device went away (EIO, ENXIO, hangup, connection reset) is
+ * not given up: output is discarded and the session loop calls
+ * portReopen() until the device is back (inotify on its directory, so
+ * /dev/serial/by-id links work) or hotplugWait seconds have passed.
+ */
+extern int hotplugWait;		// 0: exit as before
+int portGone(int err);		// err means the device is lost, the port is marked so
+int portLost(void);
+int portReopen(void);		// 0: the port is open again
+
+#endif /* TRANSPORT_H_ */
@@ -0,0 +1,641 @@
+/*
+ ============================================================================
+ Name        : vfs.c
+ Author      : F. Erckenbrecht / dg1yfe
+ Copyright   : GPL
+ Description : File system backends the TNC file requests are served from:
+               host directory and in-memory image
+ ============================================================================
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+
+#include "OpenRS.h"
+#include "vfs.h"
+#include "dirscan.h"
+#include "nameidx.h"
+
+struct vfsBackend * vfs = &vfsHost;
+
+
+FILE * vfsOpen(const char * path, const char * mode)
+{
+	return vfs->open(vfs->ctx, path, mode);
+}
+
+
+/*
+ * Host name of a path sent by the TNC, found case-insensitively and by its
+ * 8.3 alias. The other backends compare names case-insensitively anyway.
+ * 0: the path exists, real is the path as given otherwise.
+ */
+int vfsResolve(const char * path, char * real, size_t len)
+{
+	if(vfs == &vfsHost)
+		return nameResolve(path, real, len);
+
+	while(*path == '/')
+		path++;
+	snprintf(real, len, "%s", path);
+	return 0;
+}
+
+
+int vfsStat(const char * path, struct vfsStat * st)
+{
+	return vfs->stat(vfs->ctx, path, st);
+}
+
+
+void * vfsListStart(const char * dir)
+{
+	return vfs->listStart(vfs->ctx, dir);
+}
+
+
+int vfsListNext(void * it, struct FileInfo * fi)
+{
+	if(it == NULL)
+		return -1;
+	return vfs->listNext(vfs->ctx, it, fi);
+}
+
+
+void vfsListStop(void * it)
+{
+	if(it)
+		vfs->listStop(vfs->ctx, it);
+}
+
+
+/*
+ * Host directory (current working directory)
+ */
+static FILE * hostOpen(void * ctx, const char * path, const char * mode)
+{
+	return fopen(path, mode);
+}
+
+
+static int hostStat(void * ctx, const char * path, struct vfsStat * vst)
+{
+	struct stat st;
+
+	if(stat(path, &st) != 0)
+		return -1;
+
+	vst->size = st.st_size;
+#ifndef __APPLE__
+	vst->mtime = st.st_mtim.tv_sec;
+#else
+	vst->mtime = st.st_mtimespec.tv_sec;
+#endif
+	vst->isDir = S_ISDIR(st.st_mode);
+	return 0;
+}
+
+
+static void * hostListStart(void * ctx, const char * dir)
+{
+	char wd[PATH_MAX];
+
+	snprintf(wd, sizeof wd, "%s/%s", cwd, dir);
+	return dirScanStart(wd);
+}
+
+
+static int hostListNext(void * ctx, void * it, struct FileInfo * fi)
+{
+	return dirScanNext(it, fi);
+}
+
+
+static void hostListStop(void * ctx, void * it)
+{
+	dirScanStop(it);
+}
+
+
+struct vfsBackend vfsHost = {
+	"host", NULL,
+	hostOpen, hostStat, hostListStart, hostListNext, hostListStop
+};
+
+
+/*
+ * Streams on in-memory files
+ */
+struct vfsStream {
+	struct vfsMemFile *	mf;
+	uint64_t			pos;
+	int					writable;
+	int					append;
+};
+
+
+static ssize_t streamRead(void * cookie, char * buf, size_t size)
+{
+	struct vfsStream * vs = cookie;
+	uint64_t n;
+
+	if(vs->pos >= vs->mf->size)
+		return 0;
+
+	n = vs->mf->size - vs->pos;
+	if(n > size)
+		n = size;
+	memcpy(buf, vs->mf->data + vs->pos, n);
+	vs->pos += n;
+	return n;
+}
+
+
+static ssize_t streamWrite(void * cookie, const char * buf, size_t size)
+{
+	struct vfsStream * vs = cookie;
+	struct vfsMemFile * mf = vs->mf;
+
+	if(!vs->writable)
+	{
+		errno = EBADF;
+		return 0;
+	}
+	if(vs->append)
+		vs->pos = mf->size;
+
+	if(vs->pos + size > mf->alloc)
+	{
+		uint64_t alloc = mf->alloc ? mf->alloc : 4096;
+		char * data;
+
+		while(alloc < vs->pos + size)
+			alloc *= 2;
+		data = realloc(mf->data, alloc);
+		if(data == NULL)
+		{
+			errno = ENOSPC;
+			return 0;
+		}
+		mf->data = data;
+		mf->alloc = alloc;
+	}
+	if(vs->pos > mf->size)
+		memset(mf->data + mf->size, 0, vs->pos - mf->size);
+
+	memcpy(mf->data + vs->pos, buf, size);
+	vs->pos += size;
+	if(vs->pos > mf->size)
+		mf->size = vs->pos;
+	mf->mtime = time(NULL);
+	return size;
+}
+
+
+static int streamSeek(void * cookie, int64_t * offset, int whence)
+{
+	struct vfsStream * vs = cookie;
+	int64_t pos;
+
+	switch(whence)
+	{
+	case SEEK_SET:
+		pos = *offset;
+		break;
+	case SEEK_CUR:
+		pos = vs->pos + *offset;
+		break;
+	case SEEK_END:
+		pos = vs->mf->size + *offset;
+		break;
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+	if(pos < 0)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	vs->pos = pos;
+	*offset = pos;
+	return 0;
+}
+
+
+static int streamClose(void * cookie)
+{
+	free(cookie);
+	return 0;
+}
+
+
+#ifdef __APPLE__
+static int streamReadBsd(void * cookie, char * buf, int size)
+{
+	return streamRead(cookie, buf, size);
+}
+
+
+static int streamWriteBsd(void * cookie, const char * buf, int size)
+{
+	return streamWrite(cookie, buf, size);
+}
+
+
+static fpos_t streamSeekBsd(void * cookie, fpos_t offset, int whence)
+{
+	int64_t o = offset;
+
+	if(streamSeek(cookie, &o, whence) != 0)
+		return -1;
+	return o;
+}
+#endif
+
+
+FILE * vfsStreamOpen(struct vfsMemFile * mf, const char * mode)
+{
+	struct vfsStream * vs;
+	FILE * f;
+
+	vs = calloc(1, sizeof(*vs));
+	if(vs == NULL)
+		return NULL;
+
+	vs->mf = mf;
+	vs->writable = strpbrk(mode, "wa+") != NULL;
+	vs->append = strchr(mode, 'a') != NULL;
+	if(vs->writable && mf->readOnly)
+	{
+		free(vs);
+		errno = EROFS;
+		return NULL;
+	}
+	if(strchr(mode, 'w'))
+		mf->size = 0;
+
+#ifdef __APPLE__
+	f = funopen(vs, streamReadBsd, streamWriteBsd, streamSeekBsd, streamClose);
+#else
+	{
+		cookie_io_functions_t io = { streamRead, streamWrite, streamSeek, streamClose };
+		f = fopencookie(vs, mode, io);
+	}
+#endif
+	if(f == NULL)
+		free(vs);
+	return f;
+}
+
+
+/*
+ * In-memory image, also used for the members of mounted archives
+ */
+struct memFs {
+	struct vfsMemFile **	file;
+	int						count;
+	int						size;
+	int						readOnly;	// no new files (archives)
+};
+
+struct memList {
+	int		idx;
+	char	dir[PATH_MAX];
+};
+
+
+static struct vfsMemFile * memNew(const char * name, char * data, uint64_t size, time_t mtime, int copy);
+static int memInsert(struct memFs * fs, struct vfsMemFile * mf);
+
+
+static const char * memPath(const char * path)
+{
+	while(*path == '/' || (path[0] == '.' && path[1] == '/'))
+		path += *path == '/' ? 1 : 2;
+	return path;
+}
+
+
+static struct vfsMemFile * memFind(struct memFs * fs, const char * path)
+{
+	int i;
+
+	path = memPath(path);
+	for(i = 0; i < fs->count; i++)
+	{
+		// DOS names, the TNC does not care about case
+		if(strcasecmp(fs->file[i]->name, path) == 0)
+			return fs->file[i];
+	}
+	return NULL;
+}
+
+
+static FILE * memOpen(void * ctx, const char * path, const char * mode)
+{
+	struct memFs * fs = ctx;
+	struct vfsMemFile * mf;
+
+	mf = memFind(fs, path);
+	if(mf == NULL)
+	{
+		if(strpbrk(mode, "wa") == NULL || fs->readOnly)
+		{
+			errno = fs->readOnly ? EROFS : ENOENT;
+			return NULL;
+		}
+		// new file in the image
+		mf = memNew(memPath(path), NULL, 0, time(NULL), 1);
+		if(mf == NULL)
+			return NULL;
+		if(memInsert(fs, mf) != 0)
+		{
+			free(mf->name);
+			free(mf);
+			return NULL;
+		}
+	}
+	if(mf->isDir)
+	{
+		errno = EISDIR;
+		return NULL;
+	}
+	if(mf->data == NULL && mf->cdata && vfsArchiveInflate(mf) != 0)
+	{
+		return NULL;
+	}
+	return vfsStreamOpen(mf, mode);
+}
+
+
+static int memStat(void * ctx, const char * path, struct vfsStat * st)
+{
+	struct vfsMemFile * mf;
+
+	mf = memFind(ctx, path);
+	if(mf == NULL)
+	{
+		errno = ENOENT;
+		return -1;
+	}
+	st->size = mf->size;
+	st->mtime = mf->mtime;
+	st->isDir = mf->isDir;
+	return 0;
+}
+
+
+static void * memListStart(void * ctx, const char * dir)
+{
+	struct memList * ml;
+	size_t len;
+
+	ml = calloc(1, sizeof(*ml));
+	if(ml == NULL)
+		return NULL;
+
+	strncpy(ml->dir, memPath(dir), sizeof(ml->dir)-2);
+	len = strlen(ml->dir);
+	if(len && ml->dir[len-1] != '/')
+		strcat(ml->dir, "/");
+	return ml;
+}
+
+
+static int memListNext(void * ctx, void * it, struct FileInfo * fi)
+{
+	struct memFs * fs = ctx;
+	struct memList * ml = it;
+	size_t len = strlen(ml->dir);
+
+	while(ml->idx < fs->count)
+	{
+		struct vfsMemFile * mf = fs->file[ml->idx++];
+		const char * name;
+
+		if(strncasecmp(mf->name, ml->dir, len) != 0)
+			continue;
+		name = mf->name + len;
+		if(*name == 0 || strchr(name, '/'))
+			continue;		// not a direct member of the directory
+
+		memset(fi, 0, sizeof(*fi));
+		setFileInfoTime(fi, mf->mtime);
+		fi->attr = mf->isDir ? 0x10 : 0;
+		fi->filesize = (uint32_t) mf->size;
+		strncpy(fi->filename, name, 13);
+		return 0;
+	}
+	return -1;
+}
+
+
+static void memListStop(void * ctx, void * it)
+{
+	free(it);
+}
+
+
+struct vfsBackend * vfsMemCreate(int readOnly)
+{
+	struct vfsBackend * b;
+
+	b = calloc(1, sizeof(*b) + sizeof(struct memFs));
+	if(b == NULL)
+		return NULL;
+	((struct memFs *)(b + 1))->readOnly = readOnly;
+
+	b->name = "memory";
+	b->ctx = b + 1;
+	b->open = memOpen;
+	b->stat = memStat;
+	b->listStart = memListStart;
+	b->listNext = memListNext;
+	b->listStop = memListStop;
+	return b;
+}
+
+
+static struct vfsMemFile * memNew(const char * name, char * data, uint64_t size, time_t mtime, int copy)
+{
+	struct vfsMemFile * mf;
+
+	mf = calloc(1, sizeof(*mf));
+	if(mf == NULL)
+		return NULL;
+	mf->name = strdup(name);
+	mf->mtime = mtime;
+	mf->size = size;
+	if(copy)
+	{
+		mf->alloc = size;
+		mf->data = size ? malloc(size) : NULL;
+		if(size && mf->data)
+			memcpy(mf->data, data, size);
+	}
+	else
+	{
+		mf->data = data;
+		mf->readOnly = 1;
+	}
+	if(mf->name == NULL || (copy && size && mf->data == NULL))
+	{
+		free(mf->name);
+		free(mf);
+		errno = ENOMEM;
+		return NULL;
+	}
+	return mf;
+}
+
+
+static int memInsert(struct memFs * fs, struct vfsMemFile * mf)
+{
+	if(fs->count == fs->size)
+	{
+		int size = fs->size ? fs->size * 2 : 64;
+		struct vfsMemFile ** f = realloc(fs->file, size * sizeof(*f));
+		if(f == NULL)
+			return -1;
+		fs->file = f;
+		fs->size = size;
+	}
+	fs->file[fs->count++] = mf;
+	return 0;
+}
+
+
+/*
+ * Add a file to the image. With copy set the data is copied and owned by
+ * the image, otherwise it is referenced (mapped archive or image) and the
+ * file is read only.
+ */
+struct vfsMemFile * vfsMemAdd(struct vfsBackend * b, const char * name, char * data, uint64_t size, time_t mtime, int copy)
+{
+	struct vfsMemFile * mf;
+
+	mf = memNew(name, data, size, mtime, copy);
+	if(mf && memInsert(b->ctx, mf) != 0)
+	{
+		if(mf->alloc)
+			free(mf->data);
+		free(mf->name);
+		free(mf);
+		mf = NULL;
+	}
+	return mf;
+}
+
+
+/*
+ * File of the memory backend in use, for reads straight from its data
+ */
+struct vfsMemFile * vfsMemFind(const char * path)
+{
+	struct vfsMemFile * mf;
+
+	if(vfs->open != memOpen)
+		return NULL;
+	mf = memFind(vfs->ctx, path);
+	return mf && !mf->isDir && mf->data ? mf : NULL;
+}
+
+
+/*
+ * Free an image and the data it owns, referenced data stays with the caller
+ */
+void vfsMemFree(struct vfsBackend * b)
+{
+	struct memFs * fs = b->ctx;
+	int i;
+
+	for(i = 0; i < fs->count; i++)
+	{
+		if(fs->file[i]->alloc)
+			free(fs->file[i]->data);
+		free(fs->file[i]->name);
+		free(fs->file[i]);
+	}
+	free(fs->file);
+	free(b);
+}
+
+
+static int memLoadFile(struct vfsBackend * b, const char * path, const char * name)
+{
+	struct vfsMemFile * mf;
+	struct stat st;
+	FILE * f;
+	size_t n;
+
+	if(stat(path, &st) != 0)
+		return -1;
+
+	mf = vfsMemAdd(b, name, NULL, 0, st.st_mtime, 1);
+	if(mf == NULL)
+		return -1;
+
+	mf->data = malloc(st.st_size ? st.st_size : 1);
+	f = fopen(path, "rb");
+	if(mf->data == NULL || f == NULL)
+	{
+		if(f)
+			fclose(f);
+		return -1;
+	}
+	n = fread(mf->data, 1, st.st_size, f);
+	fclose(f);
+	mf->size = n;
+	mf->alloc = st.st_size ? st.st_size : 1;
+	return 0;
+}
+
+
+/*
+ * Preload a host file or all regular files of a host directory
+ */
+int vfsMemLoad(struct vfsBackend * b, const char * path)
+{
+	struct stat st;
+	DIR * dirp;
+	struct dirent * dir;
+	const char * name;
+	int r = 0;
+
+	if(stat(path, &st) != 0)
+		return -1;
+
+	if(!S_ISDIR(st.st_mode))
+	{
+		name = strrchr(path, '/');
+		return memLoadFile(b, path, name ? name+1 : path);
+	}
+
+	dirp = opendir(path);
+	if(dirp == NULL)
+		return -1;
+	while((dir = readdir(dirp)))
+	{
+		char fname[PATH_MAX];
+
+		snprintf(fname, sizeof fname, "%s/%s", path, dir->d_name);
+		if(stat(fname, &st) != 0 || !S_ISREG(st.st_mode))
+			continue;
+		if(memLoadFile(b, fname, dir->d_name) != 0)
+			r = -1;
+	}
+	closedir(dirp);
+	return r;
+}
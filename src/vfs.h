@@ -0,0 +1,78 @@
+/*
+ ============================================================================
+ Name        : vfs.h
+ Author      : F. Erckenbrecht / dg1yfe
+ Copyright   : GPL
+ Description : File system backends the TNC file requests are served from
+ ============================================================================
+ */
+
+#ifndef VFS_H_
+#define VFS_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "OpenRS.h"
+
+struct vfsStat {
+	uint64_t	size;
+	time_t		mtime;
+	int			isDir;
+};
+
+/*
+ * A backend opens files as stdio streams, so the protocol handler keeps
+ * using fgetc/fputc/fseek/ftell on File[]. Backends that are not the host
+ * file system implement read, write and seek as stream cookie functions
+ * (see vfsStreamOpen()).
+ * Paths are relative to the served directory and use '/' as separator.
+ */
+struct vfsBackend {
+	const char *	name;
+	void *			ctx;
+	FILE *	(*open)(void * ctx, const char * path, const char * mode);
+	int		(*stat)(void * ctx, const char * path, struct vfsStat * st);
+	void *	(*listStart)(void * ctx, const char * dir);
+	int		(*listNext)(void * ctx, void * it, struct FileInfo * fi);	// 0: entry, -1: end
+	void	(*listStop)(void * ctx, void * it);
+};
+
+/* in-memory file, shared by the archive and the memory backend */
+struct vfsMemFile {
+	char *			name;
+	char *			data;
+	uint64_t		size;
+	uint64_t		alloc;		// bytes allocated, 0 if data is not owned (mapping)
+	time_t			mtime;
+	int				isDir;
+	int				readOnly;
+	int				method;		// compressed archive member, inflated on first open
+	const char *	cdata;
+	uint64_t		csize;
+};
+
+extern struct vfsBackend * vfs;		// backend in use
+
+extern struct vfsBackend vfsHost;
+
+FILE * vfsOpen(const char * path, const char * mode);
+int vfsResolve(const char * path, char * real, size_t len);
+int vfsStat(const char * path, struct vfsStat * st);
+void * vfsListStart(const char * dir);
+int vfsListNext(void * it, struct FileInfo * fi);
+void vfsListStop(void * it);
+
+FILE * vfsStreamOpen(struct vfsMemFile * mf, const char * mode);
+
+struct vfsBackend * vfsMemCreate(int readOnly);
+struct vfsMemFile * vfsMemAdd(struct vfsBackend * b, const char * name, char * data, uint64_t size, time_t mtime, int copy);
+int vfsMemLoad(struct vfsBackend * b, const char * path);
+void vfsMemFree(struct vfsBackend * b);
+struct vfsMemFile * vfsMemFind(const char * path);	// NULL: not a memory backend file
+
+struct vfsBackend * vfsArchiveOpen(const char * path);
+int vfsArchiveInflate(struct vfsMemFile * mf);
+
+#endif /* VFS_H_ */
@@ -0,0 +1,371 @@
+/*
+ ============================================================================
+ Name        : vfs_archive.c
+ Author      : F. Erckenbrecht / dg1yfe
+ Copyright   : GPL
+ Description : Read-only tar / zip archive backend. The archive is mapped
+               and its members are served without extracting them.
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <time.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "OpenRS.h"
+#include "vfs.h"
+
+
+static uint16_t rd16(const unsigned char * p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+
+static uint32_t rd32(const unsigned char * p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+
+static uint64_t tarNumber(const unsigned char * p, int len)
+{
+	uint64_t v = 0;
+
+	if(*p & 0x80)
+	{
+		// GNU base-256 encoding for large values
+		v = *p++ & 0x7f;
+		while(--len)
+			v = (v << 8) | *p++;
+		return v;
+	}
+	while(len && (*p == ' ' || *p == 0))
+	{
+		p++;
+		len--;
+	}
+	while(len-- && *p >= '0' && *p <= '7')
+		v = (v << 3) | (*p++ - '0');
+	return v;
+}
+
+
+static struct vfsMemFile * archiveAdd(struct vfsBackend * b, const char * name, const char * data, uint64_t size, time_t mtime)
+{
+	char path[PATH_MAX];
+	struct vfsMemFile * mf;
+	size_t len;
+	int isDir = 0;
+
+	while(name[0] == '.' && name[1] == '/')
+		name += 2;
+	while(*name == '/')
+		name++;
+
+	strncpy(path, name, sizeof(path)-1);
+	path[sizeof(path)-1] = 0;
+	len = strlen(path);
+	if(len && path[len-1] == '/')
+	{
+		path[--len] = 0;
+		isDir = 1;
+	}
+	if(len == 0)
+		return NULL;
+
+	mf = vfsMemAdd(b, path, (char *) data, size, mtime, 0);
+	if(mf)
+		mf->isDir = isDir;
+	return mf;
+}
+
+
+static int tarParse(struct vfsBackend * b, const unsigned char * map, size_t size)
+{
+	size_t off = 0;
+	char longName[PATH_MAX];
+	int haveLongName = 0;
+	int n = 0;
+
+	while(off + 512 <= size)
+	{
+		const unsigned char * h = map + off;
+		char name[PATH_MAX];
+		uint64_t fsize;
+		time_t mtime;
+		char type;
+		size_t data;
+
+		if(h[0] == 0)
+			break;		// end of archive
+
+		fsize = tarNumber(h + 124, 12);
+		mtime = (time_t) tarNumber(h + 136, 12);
+		type = h[156];
+		data = off + 512;
+		if(data + fsize > size)
+			break;		// truncated
+
+		if(haveLongName)
+		{
+			strcpy(name, longName);
+			haveLongName = 0;
+		}
+		else
+		if(memcmp(h + 257, "ustar", 5) == 0 && h[345])
+		{
+			snprintf(name, sizeof name, "%.155s/%.100s", h + 345, h);
+		}
+		else
+		{
+			snprintf(name, sizeof name, "%.100s", h);
+		}
+
+		switch(type)
+		{
+		case 'L':		// GNU long name for the next member
+		{
+			size_t len = fsize < sizeof(longName) ? fsize : sizeof(longName)-1;
+			memcpy(longName, map + data, len);
+			longName[len] = 0;
+			haveLongName = 1;
+			break;
+		}
+		case '0':
+		case '\0':
+		case '7':
+			if(archiveAdd(b, name, (const char *) map + data, fsize, mtime))
+				n++;
+			break;
+		case '5':
+			strncat(name, "/", sizeof(name) - strlen(name) - 1);
+			archiveAdd(b, name, NULL, 0, mtime);
+			break;
+		default:
+			break;		// links, devices and pax headers are not served
+		}
+		off = data + ((fsize + 511) & ~(uint64_t)511);
+	}
+	return n;
+}
+
+
+static time_t dosTime(uint16_t t, uint16_t d)
+{
+	struct tm tm;
+
+	memset(&tm, 0, sizeof(tm));
+	tm.tm_year = (d >> 9) + 80;
+	tm.tm_mon = ((d >> 5) & 0x0f) - 1;
+	tm.tm_mday = d & 0x1f;
+	tm.tm_hour = t >> 11;
+	tm.tm_min = (t >> 5) & 0x3f;
+	tm.tm_sec = (t & 0x1f) * 2;
+	tm.tm_isdst = -1;
+	return mktime(&tm);
+}
+
+
+static int zipParse(struct vfsBackend * b, const unsigned char * map, size_t size)
+{
+	size_t eocd;
+	size_t off;
+	unsigned int count;
+	unsigned int i;
+	int n = 0;
+
+	if(size < 22)
+		return -1;
+
+	// end of central directory record, followed by up to 64k of comment
+	for(eocd = size - 22; ; eocd--)
+	{
+		if(rd32(map + eocd) == 0x06054b50)
+			break;
+		if(eocd == 0 || size - eocd > 22 + 0xffff)
+			return -1;
+	}
+
+	count = rd16(map + eocd + 10);
+	off = rd32(map + eocd + 16);
+
+	for(i = 0; i < count; i++)
+	{
+		const unsigned char * c = map + off;
+		char name[PATH_MAX];
+		unsigned int flags, method, nameLen, extraLen, commentLen;
+		uint32_t csize, usize, local;
+		size_t data;
+		struct vfsMemFile * mf;
+
+		if(off + 46 > size || rd32(c) != 0x02014b50)
+			break;
+
+		flags = rd16(c + 8);
+		method = rd16(c + 10);
+		csize = rd32(c + 20);
+		usize = rd32(c + 24);
+		nameLen = rd16(c + 28);
+		extraLen = rd16(c + 30);
+		commentLen = rd16(c + 32);
+		local = rd32(c + 42);
+
+		if(off + 46 + nameLen > size)
+			break;
+		snprintf(name, sizeof name, "%.*s", nameLen, c + 46);
+		off += 46 + nameLen + extraLen + commentLen;
+
+		if(local + 30 > size || rd32(map + local) != 0x04034b50)
+			continue;
+		data = local + 30 + rd16(map + local + 26) + rd16(map + local + 28);
+		if(data + csize > size)
+			continue;
+
+		if(flags & 0x01)
+		{
+			fprintf(stderr, "%s: encrypted, not served\r\n", name);
+			continue;
+		}
+		if(method == 0)
+		{
+			// stored, served from the mapping: the size has to be that of the data
+			if(usize != csize)
+			{
+				fprintf(stderr, "%s: sizes do not match, not served\r\n", name);
+				continue;
+			}
+			mf = archiveAdd(b, name, (const char *) map + data, usize, dosTime(rd16(c + 12), rd16(c + 14)));
+		}
+		else
+		if(method == 8)
+		{
+			// deflated, inflated into memory when it is opened
+			mf = archiveAdd(b, name, NULL, usize, dosTime(rd16(c + 12), rd16(c + 14)));
+			if(mf)
+			{
+				mf->method = method;
+				mf->cdata = (const char *) map + data;
+				mf->csize = csize;
+			}
+		}
+		else
+		{
+			fprintf(stderr, "%s: compression method %u not supported\r\n", name, method);
+			continue;
+		}
+		if(mf && !mf->isDir)
+			n++;
+	}
+	return n;
+}
+
+
+int vfsArchiveInflate(struct vfsMemFile * mf)
+{
+#ifdef HAVE_ZLIB
+	z_stream zs;
+	char * data;
+	int r;
+
+	data = malloc(mf->size ? mf->size : 1);
+	if(data == NULL)
+		return -1;
+
+	memset(&zs, 0, sizeof(zs));
+	if(inflateInit2(&zs, -MAX_WBITS) != Z_OK)
+	{
+		free(data);
+		return -1;
+	}
+	zs.next_in = (Bytef *) mf->cdata;
+	zs.avail_in = mf->csize;
+	zs.next_out = (Bytef *) data;
+	zs.avail_out = mf->size;
+	r = inflate(&zs, Z_FINISH);
+	inflateEnd(&zs);
+	if(r != Z_STREAM_END)
+	{
+		free(data);
+		errno = EIO;
+		return -1;
+	}
+	mf->data = data;
+	mf->alloc = mf->size ? mf->size : 1;
+	return 0;
+#else
+	fprintf(stderr, "%s is deflated, this build of OpenRS has no zlib support (HAVE_ZLIB)\r\n", mf->name);
+	errno = ENOTSUP;
+	return -1;
+#endif
+}
+
+
+struct vfsBackend * vfsArchiveOpen(const char * path)
+{
+	struct vfsBackend * b;
+	struct stat st;
+	unsigned char * map;
+	int fd;
+	int n;
+
+	fd = open(path, O_RDONLY);
+	if(fd == -1)
+		return NULL;
+	if(fstat(fd, &st) != 0 || st.st_size == 0)
+	{
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED)
+		return NULL;
+
+	b = vfsMemCreate(1);
+	if(b == NULL)
+	{
+		munmap(map, st.st_size);
+		return NULL;
+	}
+	b->name = "archive";
+
+	if(st.st_size >= 4 && rd32(map) == 0x04034b50)
+	{
+		n = zipParse(b, map, st.st_size);
+	}
+	else
+	if(st.st_size >= 512 && memcmp(map + 257, "ustar", 5) == 0)
+	{
+		n = tarParse(b, map, st.st_size);
+	}
+	else
+	{
+		// zip files may be prefixed (self extracting), try the directory
+		n = zipParse(b, map, st.st_size);
+		if(n < 0)
+			n = tarParse(b, map, st.st_size);
+	}
+
+	if(n < 0)
+	{
+		vfsMemFree(b);
+		munmap(map, st.st_size);
+		errno = EINVAL;
+		return NULL;
+	}
+	return b;
+}
@@ -0,0 +1,84 @@
+/*
+ ============================================================================
+ Name        : wire.c
+ Author      : F. Erckenbrecht / dg1yfe
+ Copyright   : GPL
+ Description : Raw capture of the bytes on the TNC port, both directions
+               with time stamps, for the offline dissector
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+
+#include "wire.h"
+
+#define WIRE_BUFFER	(1 << 20)	// stdio buffer, the disk sees 1 MiB writes
+
+char * wireName = NULL;
+int wireOn = 0;
+
+static FILE * wireFile = NULL;
+static char * wireBuf = NULL;
+
+
+int wireOpen(const char * port, int speed)
+{
+	struct wireHeader hdr;
+
+	if(wireName == NULL || wireOn)
+		return 0;
+
+	wireFile = fopen(wireName, "wb");
+	if(wireFile == NULL)
+	{
+		fprintf(stderr, "Could not create the capture %s (%s)\r\n", wireName, strerror(errno));
+		return -1;
+	}
+	wireBuf = malloc(WIRE_BUFFER);
+	if(wireBuf)
+		setvbuf(wireFile, wireBuf, _IOFBF, WIRE_BUFFER);
+
+	memset(&hdr, 0, sizeof hdr);
+	memcpy(hdr.magic, WIRE_MAGIC, sizeof hdr.magic);
+	hdr.speed = speed;
+	strncpy(hdr.port, port, sizeof hdr.port - 1);
+	fwrite(&hdr, sizeof hdr, 1, wireFile);
+	wireOn = 1;
+	return 0;
+}
+
+
+void wireData(uint32_t dir, const void * buf, size_t len)
+{
+	struct wireRecord rec;
+	struct timespec ts;
+
+	if(!wireOn || len == 0)
+		return;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	rec.usec = (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	rec.len = len | dir;
+	rec.reserved = 0;
+	if(fwrite(&rec, sizeof rec, 1, wireFile) != 1 || fwrite(buf, 1, len, wireFile) != len)
+	{
+		fprintf(stderr, "Error writing the capture %s (%s), stopped\r\n", wireName, strerror(errno));
+		wireClose();
+	}
+}
+
+
+void wireClose(void)
+{
+	if(!wireOn)
+		return;
+	wireOn = 0;
+	fclose(wireFile);
+	wireFile = NULL;
+	free(wireBuf);
+	wireBuf = NULL;
+}
@@ -0,0 +1,46 @@
+/*
+ ============================================================================
+ Name        : wire.h
+ Author      : F. Erckenbrecht / dg1yfe
+ Copyright   : GPL
+ Description : Raw capture of the bytes on the TNC port, both directions
+               with time stamps, for the offline dissector
+ ============================================================================
+ */
+
+#ifndef WIRE_H_
+#define WIRE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * A capture starts with a struct wireHeader, followed by records of a
+ * struct wireRecord and len bytes as read from or written to the port
+ * (after telnet processing), host byte order. The time is that of the
+ * read() or write(), bytes of one record share it.
+ */
+#define WIRE_MAGIC	"ORSWIRE1"
+#define WIRE_TX		0x80000000u		// host to TNC
+
+struct wireHeader {
+	char		magic[8];
+	uint32_t	speed;
+	uint32_t	flags;
+	char		port[48];
+};
+
+struct wireRecord {
+	uint64_t	usec;		// since the epoch
+	uint32_t	len;		// | WIRE_TX
+	uint32_t	reserved;	// 0
+};
+
+extern char * wireName;		// capture file, opened with the port
+extern int wireOn;
+
+int wireOpen(const char * port, int speed);
+void wireData(uint32_t dir, const void * buf, size_t len);
+void wireClose(void);
+
+#endif /* WIRE_H_ */